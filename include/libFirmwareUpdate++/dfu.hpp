@@ -1,11 +1,17 @@
 #ifndef libFirmwareUpdate_dfu_h
 #define libFirmwareUpdate_dfu_h
 
+#include "libFirmwareUpdate++/dfu/DeviceIdentity.hpp"
 #include "libFirmwareUpdate++/dfu/DfuDownloader.hpp"
 #include "libFirmwareUpdate++/dfu/DfuFile.hpp"
 #include "libFirmwareUpdate++/dfu/DfuFinder.hpp"
 #include "libFirmwareUpdate++/dfu/DfuInterface.hpp"
 #include "libFirmwareUpdate++/dfu/DfuseOptions.hpp"
+#include "libFirmwareUpdate++/dfu/FirmwareImage.hpp"
+#include "libFirmwareUpdate++/dfu/FlashPlanFile.hpp"
+#include "libFirmwareUpdate++/dfu/FleetDownloader.hpp"
+#include "libFirmwareUpdate++/dfu/ImageCache.hpp"
+#include "libFirmwareUpdate++/dfu/PollProfiles.hpp"
 #include "libFirmwareUpdate++/dfu/UsbDfuFuncDescriptor.hpp"
 
 #endif
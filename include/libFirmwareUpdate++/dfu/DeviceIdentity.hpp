@@ -0,0 +1,45 @@
+#ifndef libFirmwareUpdate_dfu_DeviceIdentity_h
+#define libFirmwareUpdate_dfu_DeviceIdentity_h
+
+#include "libFirmwareUpdate++/UsbId.hpp"
+#include "libFirmwareUpdate++/dfu/DfuFinder.hpp"
+#include "libFirmwareUpdate++/dfu/DfuInterface.hpp"
+
+#include <memory>
+#include <string>
+
+namespace FwUpd
+{
+
+/*
+ * Identifies a physical device across re-enumeration (e.g. switching from runtime to DFU mode), when it gets a new
+ * device address and possibly a different VID:PID and serial number.
+ * Recorded before the device is detached, then used to pick the same device out of the search results afterwards,
+ * so that several devices with the same IDs can be switched at once.
+ */
+class DeviceIdentity
+{
+public:
+	// Port path, empty if not known
+	std::string path;
+	// Serial number before re-enumeration, empty if the device does not have one
+	std::string serial;
+	UsbId runtimeUsbId;
+	// IDs expected in DFU mode. Parts which are not set (<0) match anything.
+	UsbId dfuUsbId;
+
+	static DeviceIdentity fromInterface(const DfuInterface &dif);
+
+	/*
+	 * Returns the interfaces from a search (for DFU mode devices) which belong to this device. Candidates on the same
+	 * path are preferred; if there are none (e.g. the device reappeared on another port of a hub), a single device with
+	 * the same serial number is accepted. If no serial number matches either, the candidate is accepted if there is
+	 * only one device in DFU mode.
+	 * The result is empty if no device matches, or if the match is ambiguous.
+	 */
+	DfuFinder::Results select(const DfuFinder::Results &candidates) const;
+};
+
+}
+
+#endif
@@ -4,6 +4,10 @@
 #include "libFirmwareUpdate++/dfu/DfuFile.hpp"
 #include "libFirmwareUpdate++/dfu/DfuFinder.hpp"
 #include "libFirmwareUpdate++/dfu/DfuseOptions.hpp"
+#include "libFirmwareUpdate++/dfu/FirmwareImage.hpp"
+#include "libFirmwareUpdate++/dfu/FlashPlanFile.hpp"
+#include "libFirmwareUpdate++/dfu/PollProfiles.hpp"
+#include <functional>
 #include <memory>
 
 namespace FwUpd
@@ -14,13 +18,31 @@ class DfuDownloader
 public:
 	std::shared_ptr<Context> ctx;
 	std::shared_ptr<DfuFile> file;
+	// Set instead of file when several downloaders share the same image
+	std::shared_ptr<const FirmwareImage> image;
+	// Set instead of file or image to download a DfuSe plan made in advance. The device must have the memory layout and
+	// transfer size the plan was made for.
+	std::shared_ptr<const FlashPlanFile> plan;
 	DfuFinder probe;
 	bool forceDfuse = false;
 	bool finalReset = false;
+	// Longest time to wait for the device to reappear in DFU mode after it has been detached
+	uint32_t reenumerateTimeoutMs = 5000;
 	std::shared_ptr<DfuseOptions> dfuseOpts = std::make_shared<DfuseOptions>();
+	// Optional. If set, run() calls this on a separate thread to load file (e.g. by calling file.loadFile()), so that
+	// loading, suffix checking and DfuSe parsing overlap with finding, detaching and re-enumerating the device.
+	// If the probe does not have a vendor and product ID to match, run() waits for the file before searching,
+	// so that the IDs from the suffix can be used.
+	// file must not be accessed by anything else until run() returns.
+	std::function<void(DfuFile &file)> fileLoader;
+	// Optional. Learned device busy times, used instead of reported poll timeouts once there are enough samples.
+	// Can be shared between downloaders. Saved at the end of run() if it has a filename.
+	std::shared_ptr<PollProfiles> pollProfiles;
 	bool run();
 
 	DfuDownloader(std::shared_ptr<Context> ctx, std::shared_ptr<DfuFile> file);
+	DfuDownloader(std::shared_ptr<Context> ctx, std::shared_ptr<const FirmwareImage> image);
+	DfuDownloader(std::shared_ptr<Context> ctx, std::shared_ptr<const FlashPlanFile> plan);
 };
 
 }
@@ -8,15 +8,31 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <memory>
 
 namespace FwUpd
 {
 
+class MappedFile;
+class DfuStreamReader;
+
 class DfuFile
 {
 public:
 	std::shared_ptr<Context> ctx;
 
+	enum class LoadMode
+	{
+		// Read the entire file into data
+		Copy,
+		// Map the file read-only instead of copying it. Pages are shared with other processes using the same file.
+		// The file must not be modified while it is mapped.
+		Map,
+		// Don't read the data up front, it is read in chunks while downloading so that memory use is bounded.
+		// Suffix and size fields are only valid once the download has read the whole file.
+		Stream,
+	};
+
 	enum class PrefixType
 	{
 		None,
@@ -25,14 +41,18 @@ public:
 	};
 
 	// Entire file contents loaded into memory (including prefix and suffix)
+	// Empty if the file was loaded with LoadMode::Map, use getData() to access the contents regardless of how they were loaded.
 	std::vector<uint8_t> data;
+	std::shared_ptr<MappedFile> mapping;
+	// Source of the data, if loaded with LoadMode::Stream
+	std::shared_ptr<DfuStreamReader> stream;
 
 	// Sizes of various parts
 	struct {
-		uint32_t total;
-		uint32_t prefix;
-		uint32_t suffix;
-		uint32_t getPayload() const
+		uint64_t total;
+		uint64_t prefix;
+		uint64_t suffix;
+		uint64_t getPayload() const
 		{
 			return total - prefix - suffix;
 		}
@@ -48,20 +68,34 @@ public:
 	UsbId usbId;
 	uint16_t bcdDevice;
 
+	// CRC of the file contents before the suffix (prefix and payload), calculated while loading.
+	// Allows updateFile() to write a new suffix without reading the payload again. Must be cleared if the data is modified.
+	bool hasContentCrc;
+	uint32_t contentCrc;
+
 	DfuFile(std::shared_ptr<Context> ctx);
 	virtual ~DfuFile();
 
 	void reset();
-	void loadFile(std::string filename);
-	void loadStdIn();
+	void loadFile(std::string filename, LoadMode mode = LoadMode::Copy);
+	void loadStdIn(LoadMode mode = LoadMode::Copy);
+
+	bool isStreaming() const;
+	// Entire file contents (size.total bytes), either from data or from the mapping. Not available when streaming.
+	const uint8_t *getData() const;
 
 	void storeFile(std::string filename, bool writeSuffix, bool writePrefix);
-	bool hasPrefix();
-	bool hasSuffix();
-	void printSuffixAndPrefix(std::ostream &stream = std::cout);
-	void provideDefaultSearchId(UsbId *dst);
+	// Like storeFile, but for writing back to the file this object was loaded from after changing suffix or prefix fields.
+	// Only the prefix and suffix bytes are written, unless the prefix length changes (the payload then has to move, so the
+	// whole file is rewritten). Afterwards, this object describes the updated file.
+	// The file must not have been modified since it was loaded.
+	void updateFile(std::string filename, bool writeSuffix, bool writePrefix);
+	bool hasPrefix() const;
+	bool hasSuffix() const;
+	void printSuffixAndPrefix(std::ostream &stream = std::cout) const;
+	void provideDefaultSearchId(UsbId *dst) const;
 
-	UsbId getSearchId();
+	UsbId getSearchId() const;
 };
 
 }
@@ -5,6 +5,7 @@
 #include "libFirmwareUpdate++/UsbId.hpp"
 #include "libFirmwareUpdate++/dfu/DfuInterface.hpp"
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -16,6 +17,7 @@ class DfuFinder
 public:
 	std::shared_ptr<Context> ctx;
 
+	// USB port path in the dfu-util format, e.g. "1-2.3" (the "1-2-2.3" format printed by older versions also matches)
 	std::string match_path;
 	UsbId match_usbId;
 	UsbId match_usbId_dfu;
@@ -29,6 +31,10 @@ public:
 
 	using Results = std::vector<std::shared_ptr<DfuInterface>>;
 	Results find();
+	// As find(), but if nothing matches, waits up to timeoutMs for a matching device to appear (e.g. after a detach).
+	// Devices are looked for again whenever libusb reports a new device where hotplug is supported, otherwise every
+	// few milliseconds.
+	Results waitFor(uint32_t timeoutMs);
 
 	DfuFinder(std::shared_ptr<Context> ctx);
 	virtual ~DfuFinder();
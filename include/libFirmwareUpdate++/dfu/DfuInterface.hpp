@@ -5,6 +5,7 @@
 #include "libFirmwareUpdate++/UsbId.hpp"
 #include "libFirmwareUpdate++/dfu/UsbDfuFuncDescriptor.hpp"
 
+#include <functional>
 #include <string>
 
 class libusb_device;
@@ -39,6 +40,8 @@ public:
     uint8_t bMaxPacketSize0;
     std::string alt_name;
     std::string serial_name;
+    // USB port path (e.g. "1-2.3"), which stays the same when the device re-enumerates. Empty if not known.
+    std::string path;
 
     libusb_device *dev = nullptr;
     libusb_device_handle *dev_handle = nullptr;
@@ -57,6 +60,23 @@ public:
 	int getState();
 	int abort();
 
+	/*
+	 * Asynchronous variants, so that one thread can drive many devices at once.
+	 * The result passed to the callback is the same as the synchronous function would return.
+	 * Callbacks are called on the context's USB event thread, so they should return quickly and must not do
+	 * synchronous transfers. These return 0, or a negative libusb error code if the transfer could not be submitted
+	 * (the callback is not called in that case).
+	 * Buffers receiving data (dfuXferInAsync, getStatusAsync) must stay valid until the transfer has completed;
+	 * download data is copied when the transfer is submitted.
+	 */
+	using XferCallback = std::function<void(int result)>;
+	int dfuXferInAsync(uint8_t bRequest, uint16_t wValue, unsigned char *data, uint16_t wLength, XferCallback cb);
+	int dfuXferOutAsync(uint8_t bRequest, uint16_t wValue, const unsigned char *data, uint16_t wLength, XferCallback cb);
+
+	int downloadAsync(uint16_t blockNum, const unsigned char *data, uint16_t length, XferCallback cb);
+	int getStatusAsync(struct dfu_status *status, XferCallback cb);
+	int abortAsync(XferCallback cb);
+
 	void openDevice();
 	void closeDevice();
 	void claimInterface();
@@ -13,6 +13,15 @@ public:
 	bool leave = false;
 	bool unprotect = false;
 	bool massErase = false;
+	// Let the erase planner use a mass erase instead of page erases when it estimates that to be faster. This erases all
+	// of the flash, not only the pages in the image. Like massErase, it requires force.
+	bool autoMassErase = false;
+	// Do not download chunks which are entirely 0xff to erasable memory. The pages they cover are still erased, so the
+	// result is the same as downloading them (for flash which erases to 0xff).
+	bool skipBlankChunks = false;
+	// Do not erase or download the chunks of 0xff at the end of each element (e.g. padding to the size of a flash bank).
+	// Unlike skipBlankChunks, this leaves the previous contents of the pages they cover.
+	bool trimBlankTail = false;
 };
 
 }
@@ -0,0 +1,52 @@
+#ifndef libFirmwareUpdate_dfu_FirmwareImage_h
+#define libFirmwareUpdate_dfu_FirmwareImage_h
+
+#include "libFirmwareUpdate++/Context.hpp"
+#include "libFirmwareUpdate++/dfu/DfuFile.hpp"
+
+#include <memory>
+#include <string>
+
+namespace FwUpd
+{
+
+namespace Dfuse
+{
+class Image;
+}
+
+/*
+ * Firmware file which has been loaded, checked and parsed, and cannot be modified afterwards.
+ * Any number of downloads on different threads can use the same FirmwareImage at once, without copying the data.
+ */
+class FirmwareImage
+{
+protected:
+	std::shared_ptr<const DfuFile> file;
+	std::shared_ptr<const Dfuse::Image> dfuseImage;
+
+	FirmwareImage(std::shared_ptr<DfuFile> file);
+
+public:
+	// Takes ownership of a loaded file, which must not be modified afterwards.
+	// Logs and throws if the file is being streamed, or if it is an invalid DfuSe file.
+	static std::shared_ptr<const FirmwareImage> create(std::shared_ptr<DfuFile> file);
+	// Loads a file with LoadMode::Copy or LoadMode::Map
+	static std::shared_ptr<const FirmwareImage> load(std::shared_ptr<Context> ctx, const std::string &filename,
+		DfuFile::LoadMode mode = DfuFile::LoadMode::Copy);
+
+	// Contents and metadata (sizes, suffix and prefix fields)
+	const DfuFile &getFile() const
+	{
+		return *file;
+	}
+	// Structure of the file if it is a DfuSe file (suffix bcdDFU 0x11a), otherwise null
+	std::shared_ptr<const Dfuse::Image> getDfuseImage() const
+	{
+		return dfuseImage;
+	}
+};
+
+}
+
+#endif
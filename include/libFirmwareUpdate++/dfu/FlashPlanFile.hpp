@@ -0,0 +1,111 @@
+#ifndef libFirmwareUpdate_dfu_FlashPlanFile_h
+#define libFirmwareUpdate_dfu_FlashPlanFile_h
+
+#include "libFirmwareUpdate++/Context.hpp"
+#include "libFirmwareUpdate++/UsbId.hpp"
+#include "libFirmwareUpdate++/dfu/DfuseOptions.hpp"
+#include "libFirmwareUpdate++/dfu/FirmwareImage.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace FwUpd
+{
+
+class MappedFile;
+
+namespace Dfuse
+{
+class FlashPlan;
+class MemLayout;
+}
+
+/*
+ * DfuSe download which has been planned in advance (e.g. once per image and device type in CI) and stored in a file.
+ * The file holds the memory layout fingerprint it was planned for, the operations (erases, address commands and
+ * writes, with their block numbers) and the data for each write, so downloading it needs no parsing, planning or
+ * layout checking. It is memory mapped, and the data is sent straight from the mapping.
+ *
+ * The format is versioned and little-endian:
+ * - 64 byte header: "FWUPPLAN", format version, header size, suffix VID, PID and bcdDevice, alternate setting,
+ *   transfer size, CRC32 of the layout descriptor string, CRC32 of the firmware file, segment count, operation count,
+ *   payload offset and size, CRC32 of the payload, and CRC32 of everything before the payload
+ * - memory segments (16 bytes each): first and last address, page size, memory type flags
+ * - operations (24 bytes each): type, block number, address, size, CRC32 of the write data, payload offset
+ * - the payload, starting on a 4 KiB boundary, with each write's data at a multiple of the transfer size
+ * Loading checks the payload CRC (unless told not to), and the data of each write is checked against its own CRC again
+ * just before it is sent, so corrupt data is never written to the device even if the file changes while mapped.
+ */
+class FlashPlanFile
+{
+public:
+	static const uint16_t formatVersion = 1;
+
+	class Header
+	{
+	public:
+		// From the firmware file suffix (0xffff matches any device)
+		UsbId usbId;
+		uint16_t bcdDevice = 0;
+		uint8_t alternateSetting = 0;
+		// Block numbers count in units of this, so it must be the device's wTransferSize
+		uint32_t transferSize = 0;
+		// CRC32 of the memory layout descriptor (interface string) the plan was made for
+		uint32_t layoutCrc = 0;
+		// CRC32 of the whole firmware file the plan was made from
+		uint32_t imageCrc = 0;
+		uint64_t payloadSize = 0;
+		uint32_t payloadCrc = 0;
+	};
+
+protected:
+	std::shared_ptr<MappedFile> mapping;
+	Header header;
+	std::shared_ptr<const Dfuse::FlashPlan> plan;
+	std::shared_ptr<const Dfuse::MemLayout> layout;
+	const uint8_t *payload = nullptr;
+
+	FlashPlanFile();
+
+public:
+	// Plans downloading a DfuSe image to alternate setting alternateSetting of devices whose interface string is
+	// layoutDesc (e.g. "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg") and whose wTransferSize is
+	// transferSize, and writes the plan to filename. Options which change the plan (massErase, autoMassErase,
+	// skipBlankChunks, trimBlankTail, leave) are taken from opts. Logs and throws if the image is not a DfuSe image or does
+	// not fit the layout.
+	static void compile(std::shared_ptr<const FirmwareImage> image, const std::string &layoutDesc,
+		uint8_t alternateSetting, uint32_t transferSize, const DfuseOptions &opts, const std::string &filename);
+	// Maps a plan file. Logs and throws if it is not a valid plan, or is a newer format version.
+	// If verifyPayload is set, the payload CRC is also checked (this reads the whole file), so that a corrupt plan is
+	// rejected before the download starts. Without it, corrupt data is only found when its write is reached, leaving the
+	// device partly programmed.
+	static std::shared_ptr<const FlashPlanFile> load(std::shared_ptr<Context> ctx, const std::string &filename,
+		bool verifyPayload = true);
+
+	const Header &getHeader() const
+	{
+		return header;
+	}
+	// IDs to search for, as DfuFile::getSearchId()
+	UsbId getSearchId() const;
+	bool matchesLayout(const std::string &layoutDesc) const;
+
+	std::shared_ptr<const Dfuse::FlashPlan> getPlan() const
+	{
+		return plan;
+	}
+	std::shared_ptr<const Dfuse::MemLayout> getLayout() const
+	{
+		return layout;
+	}
+	// Write operation offsets are relative to this
+	const uint8_t *getPayload() const
+	{
+		return payload;
+	}
+};
+
+}
+
+#endif
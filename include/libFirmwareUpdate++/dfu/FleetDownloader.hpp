@@ -0,0 +1,77 @@
+#ifndef libFirmwareUpdate_dfu_FleetDownloader_h
+#define libFirmwareUpdate_dfu_FleetDownloader_h
+
+#include "libFirmwareUpdate++/Context.hpp"
+#include "libFirmwareUpdate++/UsbId.hpp"
+#include "libFirmwareUpdate++/dfu/DfuFinder.hpp"
+#include "libFirmwareUpdate++/dfu/DfuseOptions.hpp"
+#include "libFirmwareUpdate++/dfu/FirmwareImage.hpp"
+#include "libFirmwareUpdate++/dfu/FlashPlanFile.hpp"
+#include "libFirmwareUpdate++/dfu/PollProfiles.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace FwUpd
+{
+
+/*
+ * Downloads one image to every device matching probe, in parallel (for production programming).
+ * Each device gets its own DfuDownloader and Context (for its log and progress), and is followed through detach and
+ * re-enumeration by its USB port path (and serial number in runtime mode), so devices with the same VID:PID do not get
+ * mixed up. The downloads share the USB threads of ctx, so the number of threads does not grow with the number of
+ * devices.
+ */
+class FleetDownloader
+{
+public:
+	class DeviceResult
+	{
+	public:
+		// USB port path, as used by DfuFinder::match_path
+		std::string path;
+		std::string serial;
+		UsbId usbId;
+		bool success = false;
+		// Last error message logged for the device, if any
+		std::string error;
+		// All messages logged for the device (subject to the fleet context's minimum log level)
+		std::vector<LogMsg> log;
+	};
+
+	// Used for fleet-wide messages. Device messages are passed to its log handler prefixed by the device path, unless
+	// deviceLogHandler is set.
+	std::shared_ptr<Context> ctx;
+	std::shared_ptr<const FirmwareImage> image;
+	// Set instead of image to download a DfuSe plan made in advance (see DfuDownloader::plan)
+	std::shared_ptr<const FlashPlanFile> plan;
+	// Selects the devices to download to. match_path must not be set.
+	DfuFinder probe;
+	bool forceDfuse = false;
+	bool finalReset = false;
+	std::shared_ptr<DfuseOptions> dfuseOpts = std::make_shared<DfuseOptions>();
+	std::shared_ptr<PollProfiles> pollProfiles;
+	uint32_t reenumerateTimeoutMs = 5000;
+	// Maximum number of devices programmed at once, 0 for no limit
+	size_t maxParallel = 0;
+	// Detach all runtime mode devices as soon as they are found, without waiting for a free download slot, and
+	// download to devices already in DFU mode while the others re-enumerate
+	bool detachAhead = false;
+
+	// Optional handlers for per-device messages and progress. Called from the fleet's threads, but only from one thread at a
+	// time for each device.
+	std::function<void(const std::string &path, const LogMsg &msg)> deviceLogHandler;
+	std::function<void(const std::string &path, float x, std::string desc)> deviceProgressHandler;
+
+	// Returns one result per device found, sorted by path. Overall progress is reported through ctx.
+	std::vector<DeviceResult> run();
+
+	FleetDownloader(std::shared_ptr<Context> ctx, std::shared_ptr<const FirmwareImage> image);
+	FleetDownloader(std::shared_ptr<Context> ctx, std::shared_ptr<const FlashPlanFile> plan);
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef libFirmwareUpdate_dfu_ImageCache_h
+#define libFirmwareUpdate_dfu_ImageCache_h
+
+#include "libFirmwareUpdate++/Context.hpp"
+#include "libFirmwareUpdate++/dfu/DfuFile.hpp"
+#include "libFirmwareUpdate++/dfu/FirmwareImage.hpp"
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace FwUpd
+{
+
+/*
+ * Cache of loaded, checked and parsed firmware images, for programs which load the same files repeatedly.
+ * A file is only loaded again if its size, modification time or (where supported) inode have changed.
+ * Files with identical contents share one image. Least recently used images are dropped from the cache when it
+ * exceeds its memory budget (images which are still in use elsewhere stay valid, they are just no longer cached).
+ * Files are always copied into memory (never mapped), so that an image which has been checked cannot change if its file
+ * is rewritten in place while the image is cached or in use.
+ * Thread-safe.
+ */
+class ImageCache
+{
+public:
+	class Stats
+	{
+	public:
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		// Misses which found an image with identical contents already in the cache
+		uint64_t contentMatches = 0;
+		// Total size of files which did not need to be loaded because of a hit
+		uint64_t bytesSaved = 0;
+		uint64_t evictions = 0;
+		uint64_t bytesCached = 0;
+		size_t entries = 0;
+	};
+
+protected:
+	class FileId
+	{
+	public:
+		std::string filename;
+		uint64_t size;
+		int64_t mtime;
+		int64_t mtimeNsec;
+		uint64_t inode;
+		bool operator<(const FileId &other) const;
+	};
+	class Entry
+	{
+	public:
+		FileId id;
+		uint32_t contentCrc;
+		std::shared_ptr<const FirmwareImage> image;
+	};
+
+	std::shared_ptr<Context> ctx;
+	uint64_t maxBytes;
+	mutable std::mutex mtx;
+	// Most recently used first
+	std::list<Entry> entries;
+	std::map<FileId, std::list<Entry>::iterator> index;
+	// Number of entries using each image, so that images shared by several files are only counted once
+	std::map<const FirmwareImage*, size_t> imageRefs;
+	Stats stats;
+
+	// Returns false if the file cannot be accessed
+	static bool getFileId(const std::string &filename, FileId *id);
+	void remove(std::list<Entry>::iterator it);
+	void evict();
+
+public:
+	// maxBytes is the budget for the total size of cached files
+	ImageCache(std::shared_ptr<Context> ctx, uint64_t maxBytes = 256*1024*1024);
+	ImageCache(const ImageCache&) = delete;
+	ImageCache &operator=(const ImageCache&) = delete;
+
+	// Returns the cached image for the file if it has not changed, otherwise loads it.
+	// Logs and throws if the file cannot be loaded.
+	std::shared_ptr<const FirmwareImage> load(const std::string &filename);
+	void clear();
+	void setMaxBytes(uint64_t x);
+	Stats getStats() const;
+};
+
+}
+
+#endif
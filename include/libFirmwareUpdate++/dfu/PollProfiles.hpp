@@ -0,0 +1,77 @@
+#ifndef libFirmwareUpdate_dfu_PollProfiles_h
+#define libFirmwareUpdate_dfu_PollProfiles_h
+
+#include "libFirmwareUpdate++/Context.hpp"
+#include "libFirmwareUpdate++/UsbId.hpp"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+namespace FwUpd
+{
+
+/*
+ * Learned times that devices actually spend busy (dfuDNBUSY or dfuMANIFEST) for each operation, keyed by
+ * VID:PID:bcdDevice. Many devices report a much longer bwPollTimeout than they need (and some report one which is
+ * too short), so once enough downloads have been seen, the first status poll after an operation is sent at the
+ * learned time instead of the reported one.
+ * Optionally persisted to a file, so that later sessions start with what earlier ones learned. Thread-safe, so one
+ * instance can be shared by downloads to many devices.
+ */
+class PollProfiles
+{
+public:
+	enum class Operation
+	{
+		ChunkWrite,
+		PageErase,
+		MassErase,
+		SetAddress,
+		Manifest,
+		Count
+	};
+
+protected:
+	// Histogram buckets are a quarter power of two wide (bucket i starts at 2^(i/4) ms), up to about 17 minutes
+	static const int bucketCount = 80;
+	class Histogram
+	{
+	public:
+		std::array<uint32_t, bucketCount> counts = {};
+		uint32_t total = 0;
+	};
+	using Key = std::tuple<int, int, uint16_t, Operation>;
+
+	std::shared_ptr<Context> ctx;
+	std::string filename;
+	mutable std::mutex mtx;
+	std::map<Key, Histogram> profiles;
+	bool modified = false;
+
+	static int bucketFor(uint32_t ms);
+	static uint32_t bucketStart(int bucket);
+
+public:
+	// Loads profiles from filename if it is set and exists
+	PollProfiles(std::shared_ptr<Context> ctx, std::string filename = "");
+
+	// Returns false if too little has been learned for this device and operation yet
+	bool estimate(const UsbId &usbId, uint16_t bcdDevice, Operation op, uint32_t *ms) const;
+	// busyMs is the time from the status reporting the device busy, to the status reporting it finished.
+	// doneAtFirstPoll is set if the device had already finished when it was first polled again, so that busyMs is only
+	// an upper bound.
+	void record(const UsbId &usbId, uint16_t bcdDevice, Operation op, uint32_t busyMs, bool doneAtFirstPoll);
+
+	// Writes the profiles to filename, if it is set and anything changed. Throws on failure.
+	void save();
+	void clear();
+};
+
+}
+
+#endif
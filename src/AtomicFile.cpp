@@ -0,0 +1,227 @@
+#include "AtomicFile.hpp"
+#include "ContextImpl.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+namespace FwUpd
+{
+
+#if defined(_WIN32) || defined(_WIN64)
+
+AtomicFile::AtomicFile(const std::string &filename) :
+	filename(filename)
+{
+	tmpFilename = filename + "." + std::to_string(GetCurrentProcessId()) + "." +
+		std::to_string(GetTickCount64()) + ".tmp";
+	f = std::fopen(tmpFilename.c_str(), "wb");
+	if (!f)
+		throw Error(LogMsgType::FileIoError, "Could not open file " + filename + " for writing");
+}
+
+void AtomicFile::closeAndRemove()
+{
+	if (!f)
+		return;
+	std::fclose(f);
+	f = nullptr;
+	std::remove(tmpFilename.c_str());
+}
+
+void AtomicFile::writev(const Buffer *bufs, size_t count)
+{
+	for (size_t i=0; i<count; i++)
+		write(bufs[i].data, bufs[i].length);
+}
+
+void AtomicFile::write(const uint8_t *data, size_t length)
+{
+	if (length && std::fwrite(data, 1, length, f) != length)
+		throw Error(LogMsgType::FileIoError, "Could not write to file");
+}
+
+void AtomicFile::commit()
+{
+	if (std::fflush(f) != 0 || _commit(_fileno(f)) != 0)
+		throw Error(LogMsgType::FileIoError, "Could not write to file");
+	std::fclose(f);
+	f = nullptr;
+	if (!MoveFileExA(tmpFilename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		std::remove(tmpFilename.c_str());
+		throw Error(LogMsgType::FileIoError, "Could not replace file " + filename);
+	}
+}
+
+#else
+
+// If filename is a symlink, returns the file it points to, so that the link is kept and its target replaced
+static std::string resolveLink(const std::string &filename)
+{
+	struct stat st;
+	if (lstat(filename.c_str(), &st) != 0 || !S_ISLNK(st.st_mode))
+		return filename;
+	char *resolved = realpath(filename.c_str(), nullptr);
+	if (!resolved)
+		return filename;
+	std::string result = resolved;
+	std::free(resolved);
+	return result;
+}
+
+AtomicFile::AtomicFile(const std::string &filename_) :
+	filename(resolveLink(filename_))
+{
+	struct stat st;
+	bool exists = (stat(filename.c_str(), &st) == 0);
+
+	// A pipe, terminal or device cannot be replaced by renaming a regular file over it. Names in /dev (e.g. /dev/stdout
+	// redirected to a file) stand for an already open file, so they are not replaced either.
+	if (exists && (!S_ISREG(st.st_mode) || filename_.compare(0, 5, "/dev/") == 0))
+	{
+		direct = true;
+		fd = open(filename.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+		if (fd < 0)
+			throw Error(LogMsgType::FileIoError, "Could not open file " + filename_ + " for writing");
+		return;
+	}
+
+	// Not mkstemp, so that the file is created with the permissions (from the umask) a normally created file would have
+	static std::atomic<unsigned int> counter(0);
+	for (int attempt=0; fd<0 && attempt<100; attempt++)
+	{
+		tmpFilename = filename + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+		fd = open(tmpFilename.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (fd < 0 && errno != EEXIST)
+			break;
+	}
+	if (fd < 0)
+		throw Error(LogMsgType::FileIoError, "Could not open file " + filename_ + " for writing");
+
+	// Keep the owner and permissions of an existing file. Changing the owner needs privileges, so failing to do so is
+	// not an error (the file then belongs to the user writing it, as it would if it had been deleted and recreated).
+	// The owner is set first, since changing it clears set-user-ID and set-group-ID bits.
+	if (exists)
+	{
+		// Without privileges, the group can still be kept if the user is a member of it
+		int ret = fchown(fd, st.st_uid, st.st_gid);
+		if (ret != 0)
+			ret = fchown(fd, -1, st.st_gid);
+		(void)ret;
+		fchmod(fd, st.st_mode & 07777);
+	}
+}
+
+void AtomicFile::closeAndRemove()
+{
+	if (fd < 0)
+		return;
+	close(fd);
+	fd = -1;
+	if (!direct)
+		unlink(tmpFilename.c_str());
+}
+
+void AtomicFile::writev(const Buffer *bufs, size_t count)
+{
+	struct iovec iov[IOV_MAX];
+	while (count)
+	{
+		int iovcnt = 0;
+		size_t used = 0;
+		for (; used<count && iovcnt<IOV_MAX; used++)
+		{
+			if (!bufs[used].length)
+				continue;
+			iov[iovcnt].iov_base = const_cast<uint8_t*>(bufs[used].data);
+			iov[iovcnt].iov_len = bufs[used].length;
+			iovcnt++;
+		}
+
+		// Handle partial writes by continuing from wherever the write stopped
+		int first = 0;
+		while (first < iovcnt)
+		{
+			ssize_t ret = ::writev(fd, iov + first, iovcnt - first);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw Error(LogMsgType::FileIoError, "Could not write to file");
+			}
+			size_t written = ret;
+			while (first < iovcnt && written >= iov[first].iov_len)
+			{
+				written -= iov[first].iov_len;
+				first++;
+			}
+			if (first < iovcnt)
+			{
+				iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + written;
+				iov[first].iov_len -= written;
+			}
+		}
+		bufs += used;
+		count -= used;
+	}
+}
+
+void AtomicFile::write(const uint8_t *data, size_t length)
+{
+	Buffer buf = {data, length};
+	writev(&buf, 1);
+}
+
+void AtomicFile::commit()
+{
+	if (direct)
+	{
+		// Pipes and terminals cannot be synced, and there is nothing to rename
+		int ret = close(fd);
+		fd = -1;
+		if (ret != 0)
+			throw Error(LogMsgType::FileIoError, "Could not write to file");
+		return;
+	}
+	if (fsync(fd) != 0)
+		throw Error(LogMsgType::FileIoError, "Could not write to file");
+	if (close(fd) != 0)
+	{
+		fd = -1;
+		unlink(tmpFilename.c_str());
+		throw Error(LogMsgType::FileIoError, "Could not write to file");
+	}
+	fd = -1;
+	if (rename(tmpFilename.c_str(), filename.c_str()) != 0)
+	{
+		unlink(tmpFilename.c_str());
+		throw Error(LogMsgType::FileIoError, "Could not replace file " + filename);
+	}
+}
+
+#endif
+
+AtomicFile::~AtomicFile()
+{
+	closeAndRemove();
+}
+
+}
@@ -0,0 +1,60 @@
+#ifndef fwupd_AtomicFile_h
+#define fwupd_AtomicFile_h
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+
+namespace FwUpd
+{
+
+/*
+ * Output file which is written to a temporary file in the same directory, then renamed over the destination by commit().
+ * Readers of the destination therefore never see a partially written file.
+ * If commit() is not called, the temporary file is removed. Throws Error(LogMsgType::FileIoError) on failure.
+ * On POSIX systems, the permissions and (where allowed) owner of an existing destination are kept, and if the destination
+ * is a symlink, the file it points to is replaced. Other metadata, such as hard links, extended attributes and ACLs,
+ * is not kept, and on Windows the new file gets default permissions.
+ * On POSIX systems, an existing destination which is not a regular file (such as a pipe or terminal), or which is named
+ * in /dev (such as /dev/stdout), is written to directly instead, since it cannot be replaced.
+ */
+class AtomicFile
+{
+public:
+	class Buffer
+	{
+	public:
+		const uint8_t *data;
+		size_t length;
+	};
+
+protected:
+	std::string filename;
+	std::string tmpFilename;
+#if defined(_WIN32) || defined(_WIN64)
+	FILE *f = nullptr;
+#else
+	int fd = -1;
+	// Writing straight to a destination which is not a regular file, without a temporary file
+	bool direct = false;
+#endif
+
+	void closeAndRemove();
+
+public:
+	AtomicFile(const std::string &filename);
+	~AtomicFile();
+	AtomicFile(const AtomicFile&) = delete;
+	AtomicFile &operator=(const AtomicFile&) = delete;
+
+	// Writes the buffers in order, using a single system call where possible
+	void writev(const Buffer *bufs, size_t count);
+	void write(const uint8_t *data, size_t length);
+	// Flushes the data to disk and replaces the destination file
+	void commit();
+};
+
+}
+
+#endif
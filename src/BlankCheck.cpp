@@ -0,0 +1,236 @@
+#include "BlankCheck.hpp"
+
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FWUPD_BLANK_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || (defined(__ARM_NEON) && defined(__arm__))
+#define FWUPD_BLANK_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace FwUpd
+{
+
+namespace
+{
+
+bool isBlank_scalar(const uint8_t *x, size_t n)
+{
+	uint64_t acc = ~uint64_t(0);
+	while (n >= 32)
+	{
+		uint64_t w[4];
+		std::memcpy(w, x, sizeof(w));
+		acc &= w[0] & w[1] & w[2] & w[3];
+		if (acc != ~uint64_t(0))
+			return false;
+		x += 32;
+		n -= 32;
+	}
+	while (n >= 8)
+	{
+		uint64_t w;
+		std::memcpy(&w, x, sizeof(w));
+		acc &= w;
+		x += 8;
+		n -= 8;
+	}
+	uint8_t tail = 0xff;
+	while (n--)
+		tail &= *x++;
+	return acc == ~uint64_t(0) && tail == 0xff;
+}
+
+#ifdef FWUPD_BLANK_X86
+
+bool sse2Supported()
+{
+#if defined(__SSE2__)
+	return true;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool avx2Supported()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse2")))
+bool isBlank_sse2(const uint8_t *x, size_t n)
+{
+	const __m128i ones = _mm_set1_epi8(-1);
+	while (n >= 64)
+	{
+		__m128i a = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x)),
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(x+16)));
+		__m128i b = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x+32)),
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(x+48)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(a, b), ones)) != 0xffff)
+			return false;
+		x += 64;
+		n -= 64;
+	}
+	while (n >= 16)
+	{
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x)), ones)) != 0xffff)
+			return false;
+		x += 16;
+		n -= 16;
+	}
+	return isBlank_scalar(x, n);
+}
+
+__attribute__((target("avx2")))
+bool isBlank_avx2(const uint8_t *x, size_t n)
+{
+	const __m256i ones = _mm256_set1_epi8(-1);
+	while (n >= 128)
+	{
+		__m256i a = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x)),
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x+32)));
+		__m256i b = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x+64)),
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x+96)));
+		// testc sets CF if all bits of ones are set in the operand
+		if (!_mm256_testc_si256(_mm256_and_si256(a, b), ones))
+			return false;
+		x += 128;
+		n -= 128;
+	}
+	while (n >= 32)
+	{
+		if (!_mm256_testc_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x)), ones))
+			return false;
+		x += 32;
+		n -= 32;
+	}
+	return isBlank_scalar(x, n);
+}
+
+#endif
+
+#ifdef FWUPD_BLANK_NEON
+
+bool isBlank_neon(const uint8_t *x, size_t n)
+{
+	while (n >= 64)
+	{
+		uint8x16_t a = vandq_u8(vld1q_u8(x), vld1q_u8(x+16));
+		uint8x16_t b = vandq_u8(vld1q_u8(x+32), vld1q_u8(x+48));
+		uint64x2_t v = vreinterpretq_u64_u8(vandq_u8(a, b));
+		if ((vgetq_lane_u64(v, 0) & vgetq_lane_u64(v, 1)) != ~uint64_t(0))
+			return false;
+		x += 64;
+		n -= 64;
+	}
+	return isBlank_scalar(x, n);
+}
+
+#endif
+
+using IsBlankFn = bool (*)(const uint8_t *x, size_t n);
+
+IsBlankFn getIsBlankFn(BlankCheck::Engine engine)
+{
+	if (!BlankCheck::isSupported(engine))
+		engine = BlankCheck::Engine::Scalar;
+	switch (engine)
+	{
+#ifdef FWUPD_BLANK_X86
+	case BlankCheck::Engine::SSE2:
+		return isBlank_sse2;
+	case BlankCheck::Engine::AVX2:
+		return isBlank_avx2;
+#endif
+#ifdef FWUPD_BLANK_NEON
+	case BlankCheck::Engine::NEON:
+		return isBlank_neon;
+#endif
+	case BlankCheck::Engine::Scalar:
+	default:
+		return isBlank_scalar;
+	}
+}
+
+}
+
+bool BlankCheck::isSupported(Engine engine)
+{
+	switch (engine)
+	{
+	case Engine::Scalar:
+		return true;
+	case Engine::SSE2:
+#ifdef FWUPD_BLANK_X86
+	{
+		static const bool supported = sse2Supported();
+		return supported;
+	}
+#else
+		return false;
+#endif
+	case Engine::AVX2:
+#ifdef FWUPD_BLANK_X86
+	{
+		static const bool supported = avx2Supported();
+		return supported;
+	}
+#else
+		return false;
+#endif
+	case Engine::NEON:
+#ifdef FWUPD_BLANK_NEON
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+BlankCheck::Engine BlankCheck::getDefaultEngine()
+{
+	if (isSupported(Engine::AVX2))
+		return Engine::AVX2;
+	if (isSupported(Engine::SSE2))
+		return Engine::SSE2;
+	if (isSupported(Engine::NEON))
+		return Engine::NEON;
+	return Engine::Scalar;
+}
+
+const char *BlankCheck::engineName(Engine engine)
+{
+	switch (engine)
+	{
+	case Engine::Scalar:
+		return "scalar";
+	case Engine::SSE2:
+		return "sse2";
+	case Engine::AVX2:
+		return "avx2";
+	case Engine::NEON:
+		return "neon";
+	}
+	return nullptr;
+}
+
+bool BlankCheck::isBlank(const uint8_t *x, size_t n)
+{
+	static const IsBlankFn fn = getIsBlankFn(getDefaultEngine());
+	return fn(x, n);
+}
+
+bool BlankCheck::isBlank(const uint8_t *x, size_t n, Engine engine)
+{
+	return getIsBlankFn(engine)(x, n);
+}
+
+}
@@ -0,0 +1,33 @@
+#ifndef fwupd_BlankCheck_h
+#define fwupd_BlankCheck_h
+
+#include <cstdint>
+#include <cstdlib>
+
+namespace FwUpd
+{
+
+// Checks for erased flash contents (all bits set)
+class BlankCheck
+{
+public:
+	// Implementations of the scan. All of them produce identical results, the fastest supported one is used by default.
+	enum class Engine
+	{
+		Scalar,// 8 bytes at a time, portable
+		SSE2,
+		AVX2,
+		NEON,
+	};
+	static bool isSupported(Engine engine);
+	static Engine getDefaultEngine();
+	static const char *engineName(Engine engine);
+
+	// Returns true if all n bytes are 0xff
+	static bool isBlank(const uint8_t *x, size_t n);
+	static bool isBlank(const uint8_t *x, size_t n, Engine engine);
+};
+
+}
+
+#endif
@@ -1,4 +1,31 @@
 #include "CRC32.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FWUPD_CRC32_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+#define FWUPD_CRC32_ARMV8 1
+#if defined(__clang__)
+#define fwupd_crc32b __builtin_arm_crc32b
+#define fwupd_crc32d __builtin_arm_crc32d
+#define FWUPD_TARGET_ARMV8_CRC __attribute__((target("crc")))
+#else
+#include <arm_acle.h>
+#define fwupd_crc32b __crc32b
+#define fwupd_crc32d __crc32d
+#define FWUPD_TARGET_ARMV8_CRC __attribute__((target("+crc")))
+#endif
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
 
 namespace FwUpd
 {
@@ -53,10 +80,404 @@ void CRC32::update_u8(uint8_t x)
 	val = crc32_table[(val ^ x) & 0xff] ^ (val >> 8);
 }
 
-void CRC32::update_u8(const uint8_t *x, size_t n)
+namespace
+{
+
+// crc32_table extended for slicing: table[k][i] is the CRC of byte i followed by k zero bytes
+struct SlicingTables
+{
+	uint32_t table[16][256];
+	SlicingTables()
+	{
+		for (int i=0; i<256; i++)
+			table[0][i] = crc32_table[i];
+		for (int k=1; k<16; k++)
+		{
+			for (int i=0; i<256; i++)
+			{
+				uint32_t prev = table[k-1][i];
+				table[k][i] = (prev >> 8) ^ table[0][prev & 0xff];
+			}
+		}
+	}
+};
+
+const SlicingTables &getSlicingTables()
+{
+	static const SlicingTables tables;
+	return tables;
+}
+
+uint32_t update_bytewise(uint32_t crc, const uint8_t *x, size_t n)
 {
 	for (size_t i=0; i<n; i++)
-		update_u8(x[i]);
+		crc = crc32_table[(crc ^ x[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+// Bytes are assembled individually so that this works regardless of host endianness and alignment
+inline uint32_t read_u32l(const uint8_t *p)
+{
+	return uint32_t(p[0]) | (uint32_t(p[1])<<8) | (uint32_t(p[2])<<16) | (uint32_t(p[3])<<24);
+}
+
+uint32_t update_slicing(uint32_t crc, const uint8_t *x, size_t n)
+{
+	const uint32_t (*t)[256] = getSlicingTables().table;
+	while (n >= 16)
+	{
+		crc ^= read_u32l(x);
+		crc = t[15][crc & 0xff] ^ t[14][(crc>>8) & 0xff] ^ t[13][(crc>>16) & 0xff] ^ t[12][crc>>24] ^
+			t[11][x[4]] ^ t[10][x[5]] ^ t[9][x[6]] ^ t[8][x[7]] ^
+			t[7][x[8]] ^ t[6][x[9]] ^ t[5][x[10]] ^ t[4][x[11]] ^
+			t[3][x[12]] ^ t[2][x[13]] ^ t[1][x[14]] ^ t[0][x[15]];
+		x += 16;
+		n -= 16;
+	}
+	if (n >= 8)
+	{
+		crc ^= read_u32l(x);
+		crc = t[7][crc & 0xff] ^ t[6][(crc>>8) & 0xff] ^ t[5][(crc>>16) & 0xff] ^ t[4][crc>>24] ^
+			t[3][x[4]] ^ t[2][x[5]] ^ t[1][x[6]] ^ t[0][x[7]];
+		x += 8;
+		n -= 8;
+	}
+	return update_bytewise(crc, x, n);
+}
+
+#ifdef FWUPD_CRC32_PCLMUL
+
+bool pclmulSupported()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+/*
+ * Folding with carry-less multiplication, as described in Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". The constants are for the bit-reflected
+ * polynomial 0xEDB88320. Requires n>=64 and n to be a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+uint32_t update_pclmul_blocks(uint32_t crc, const uint8_t *x, size_t n)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 0x00));
+	x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 0x10));
+	x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 0x20));
+	x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+	x += 64;
+	n -= 64;
+
+	// Fold 64 bytes at a time
+	while (n >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 0x30)));
+		x += 64;
+		n -= 64;
+	}
+
+	// Fold the four accumulators into one
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// Fold 16 bytes at a time
+	while (n >= 16)
+	{
+		x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x));
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		x += 16;
+		n -= 16;
+	}
+
+	// Fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+uint32_t update_pclmul(uint32_t crc, const uint8_t *x, size_t n)
+{
+	if (n >= 64)
+	{
+		size_t blocks = n & ~static_cast<size_t>(15);
+		crc = update_pclmul_blocks(crc, x, blocks);
+		x += blocks;
+		n -= blocks;
+	}
+	return update_slicing(crc, x, n);
+}
+
+#endif
+
+#ifdef FWUPD_CRC32_ARMV8
+
+bool armv8Supported()
+{
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+	return true;
+#elif defined(__linux__) && defined(HWCAP_CRC32)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	return false;
+#endif
+}
+
+FWUPD_TARGET_ARMV8_CRC
+uint32_t update_armv8(uint32_t crc, const uint8_t *x, size_t n)
+{
+	while (n && (reinterpret_cast<uintptr_t>(x) & 7))
+	{
+		crc = fwupd_crc32b(crc, *x++);
+		n--;
+	}
+	const uint64_t *x64 = reinterpret_cast<const uint64_t*>(x);
+	while (n >= 32)
+	{
+		crc = fwupd_crc32d(crc, x64[0]);
+		crc = fwupd_crc32d(crc, x64[1]);
+		crc = fwupd_crc32d(crc, x64[2]);
+		crc = fwupd_crc32d(crc, x64[3]);
+		x64 += 4;
+		n -= 32;
+	}
+	while (n >= 8)
+	{
+		crc = fwupd_crc32d(crc, *x64++);
+		n -= 8;
+	}
+	x = reinterpret_cast<const uint8_t*>(x64);
+	while (n--)
+		crc = fwupd_crc32b(crc, *x++);
+	return crc;
+}
+
+#endif
+
+/*
+ * Helpers for CRC32::combine, working in GF(2) polynomials modulo the (reflected) CRC polynomial.
+ * Based on the approach used by zlib's crc32_combine.
+ */
+const uint32_t crc32_poly = 0xedb88320;
+
+// Returns a*b modulo the CRC polynomial. Bit 31 is x^0.
+uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = uint32_t(1) << 31;
+	uint32_t p = 0;
+	while (m)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? ((b >> 1) ^ crc32_poly) : (b >> 1);
+	}
+	return p;
+}
+
+// x^(2^k) modulo the CRC polynomial, for k=0..63
+struct PowerTable
+{
+	uint32_t x2n[64];
+	PowerTable()
+	{
+		uint32_t p = uint32_t(1) << 30;// x^1
+		x2n[0] = p;
+		for (int k=1; k<64; k++)
+			x2n[k] = p = multmodp(p, p);
+	}
+};
+
+// Returns x^(n*2^k) modulo the CRC polynomial
+uint32_t x2nmodp(uint64_t n, unsigned k)
+{
+	static const PowerTable table;
+	uint32_t p = uint32_t(1) << 31;// x^0
+	while (n)
+	{
+		if (n & 1)
+			p = multmodp(table.x2n[k & 63], p);
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+// Blocks smaller than this are not worth handing to another thread
+const size_t parallel_min_block = 1 << 22;
+
+using UpdateFn = uint32_t (*)(uint32_t crc, const uint8_t *x, size_t n);
+
+UpdateFn getUpdateFn(CRC32::Engine engine)
+{
+	if (!CRC32::isSupported(engine))
+		engine = CRC32::Engine::Slicing;
+	switch (engine)
+	{
+	case CRC32::Engine::Bytewise:
+		return update_bytewise;
+#ifdef FWUPD_CRC32_PCLMUL
+	case CRC32::Engine::PCLMUL:
+		return update_pclmul;
+#endif
+#ifdef FWUPD_CRC32_ARMV8
+	case CRC32::Engine::ARMv8:
+		return update_armv8;
+#endif
+	case CRC32::Engine::Slicing:
+	default:
+		return update_slicing;
+	}
+}
+
+}
+
+bool CRC32::isSupported(Engine engine)
+{
+	switch (engine)
+	{
+	case Engine::Bytewise:
+	case Engine::Slicing:
+		return true;
+	case Engine::PCLMUL:
+#ifdef FWUPD_CRC32_PCLMUL
+	{
+		static const bool supported = pclmulSupported();
+		return supported;
+	}
+#else
+		return false;
+#endif
+	case Engine::ARMv8:
+#ifdef FWUPD_CRC32_ARMV8
+	{
+		static const bool supported = armv8Supported();
+		return supported;
+	}
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+CRC32::Engine CRC32::getDefaultEngine()
+{
+	if (isSupported(Engine::PCLMUL))
+		return Engine::PCLMUL;
+	if (isSupported(Engine::ARMv8))
+		return Engine::ARMv8;
+	return Engine::Slicing;
+}
+
+const char *CRC32::engineName(Engine engine)
+{
+	switch (engine)
+	{
+	case Engine::Bytewise:
+		return "bytewise";
+	case Engine::Slicing:
+		return "slicing-by-16";
+	case Engine::PCLMUL:
+		return "pclmul";
+	case Engine::ARMv8:
+		return "armv8-crc32";
+	}
+	return nullptr;
+}
+
+void CRC32::update_u8(const uint8_t *x, size_t n)
+{
+	static const UpdateFn fn = getUpdateFn(getDefaultEngine());
+	val = fn(val, x, n);
+}
+
+void CRC32::update_u8(const uint8_t *x, size_t n, Engine engine)
+{
+	val = getUpdateFn(engine)(val, x, n);
+}
+
+void CRC32::update_u8_parallel(const uint8_t *x, size_t n, ThreadPool &pool)
+{
+	// The calling thread checksums the last block itself, so one more block than there are workers
+	size_t blockCount = std::min(pool.size() + 1, n / parallel_min_block);
+	if (blockCount <= 1)
+	{
+		update_u8(x, n);
+		return;
+	}
+
+	size_t blockSize = n / blockCount;
+	std::vector<std::future<uint32_t>> results;
+	results.reserve(blockCount - 1);
+	for (size_t i=0; i<blockCount-1; i++)
+	{
+		const uint8_t *blockStart = x + i*blockSize;
+		results.push_back(pool.submit([blockStart, blockSize]() {
+			CRC32 crc;
+			crc.update_u8(blockStart, blockSize);
+			return crc.val;
+		}));
+	}
+
+	size_t lastOffset = (blockCount - 1) * blockSize;
+	CRC32 last;
+	last.update_u8(x + lastOffset, n - lastOffset);
+
+	for (std::future<uint32_t> &r : results)
+		val = combine(val, r.get(), blockSize);
+	val = combine(val, last.val, n - lastOffset);
+}
+
+uint32_t CRC32::combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB)
+{
+	/* CRC32 here has no final xor, so the register after B is the register after B starting
+	 * from zero, xored with the starting value shifted through lengthB bytes of zeros.
+	 * crcB already includes the shifted default start value 0xffffffff, so replace that with crcA.
+	 */
+	return crcB ^ multmodp(x2nmodp(lengthB, 3), crcA ^ 0xffffffff);
 }
 
 
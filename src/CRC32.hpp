@@ -7,13 +7,35 @@
 namespace FwUpd
 {
 
+class ThreadPool;
+
 class CRC32
 {
 public:
+	// Implementations of the block update. All of them produce identical results, the fastest supported one is used by default.
+	enum class Engine
+	{
+		Bytewise,// One table lookup per byte
+		Slicing,// Slicing-by-16 (and slicing-by-8 for the tail), portable
+		PCLMUL,// x86 carry-less multiplication folding (PCLMULQDQ + SSE4.1)
+		ARMv8,// ARMv8 CRC32 instructions
+	};
+	static bool isSupported(Engine engine);
+	static Engine getDefaultEngine();
+	static const char *engineName(Engine engine);
+
 	uint32_t val = 0xffffffff;
 
 	void update_u8(uint8_t x);
 	void update_u8(const uint8_t *x, size_t n);
+	// Update using a specific engine (falls back to Slicing if the engine is not supported on this CPU)
+	void update_u8(const uint8_t *x, size_t n, Engine engine);
+	// Update by splitting the data into blocks which are checksummed concurrently on the pool and then combined
+	void update_u8_parallel(const uint8_t *x, size_t n, ThreadPool &pool);
+
+	// Returns the CRC of block A followed by block B.
+	// crcA is the CRC of A (starting from any value), crcB is the CRC of B starting from the default value of 0xffffffff.
+	static uint32_t combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB);
 	CRC32()
 	{}
 	CRC32(uint32_t val) : val(val)
@@ -0,0 +1,225 @@
+#include "ChunkSource.hpp"
+#include "ContextImpl.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace FwUpd
+{
+
+ChunkSource::~ChunkSource()
+{}
+
+MemoryChunkSource::MemoryChunkSource(const uint8_t *data, uint64_t length, std::shared_ptr<const void> owner) :
+	owner(owner), data(data), length(length)
+{}
+
+const uint8_t *MemoryChunkSource::next(size_t n, size_t *got)
+{
+	*got = static_cast<size_t>(std::min<uint64_t>(n, length - pos));
+	const uint8_t *result = data + pos;
+	pos += *got;
+	return result;
+}
+
+void ReadAheadChunkSource::Shared::readerLoop()
+{
+	while (1)
+	{
+		size_t block;
+		{
+			std::unique_lock<std::mutex> lk(mtx);
+			cv.wait(lk, [this] { return stopping || !freeBlocks.empty(); });
+			if (stopping)
+				return;
+			block = freeBlocks.front();
+			freeBlocks.pop_front();
+		}
+
+		// Fill the whole block, so that consumers only see a short block at the end of the data
+		size_t length = 0;
+		bool reachedEnd = false;
+		std::exception_ptr readError;
+		try {
+			while (length < blocks[block].size())
+			{
+				size_t ret = readFn(blocks[block].data() + length, blocks[block].size() - length);
+				if (!ret)
+				{
+					reachedEnd = true;
+					break;
+				}
+				length += ret;
+			}
+		} catch (...) {
+			readError = std::current_exception();
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			blockLengths[block] = length;
+			if (length)
+				filledBlocks.push_back(block);
+			else
+				freeBlocks.push_back(block);
+			if (reachedEnd || readError)
+			{
+				eof = true;
+				error = readError;
+			}
+		}
+		cv.notify_all();
+		if (reachedEnd || readError)
+			return;
+	}
+}
+
+ReadAheadChunkSource::ReadAheadChunkSource(ReadFn readFn, size_t blockSize, size_t blockCount, uint64_t totalSize) :
+	shared(std::make_shared<Shared>()), totalSize(totalSize)
+{
+	blockCount = std::max<size_t>(blockCount, 2);
+	shared->readFn = readFn;
+	shared->blocks.resize(blockCount, std::vector<uint8_t>(blockSize));
+	shared->blockLengths.resize(blockCount, 0);
+	for (size_t i=0; i<blockCount; i++)
+		shared->freeBlocks.push_back(i);
+
+	std::shared_ptr<Shared> s = shared;
+	reader = std::thread([s]() { s->readerLoop(); });
+}
+
+ReadAheadChunkSource::~ReadAheadChunkSource()
+{
+	{
+		std::lock_guard<std::mutex> lk(shared->mtx);
+		shared->stopping = true;
+	}
+	// The reader thread exits as soon as its current read (if any) returns
+	shared->cv.notify_all();
+	reader.join();
+}
+
+void ReadAheadChunkSource::releaseBlock()
+{
+	if (currBlock < 0)
+		return;
+	{
+		std::lock_guard<std::mutex> lk(shared->mtx);
+		shared->freeBlocks.push_back(currBlock);
+	}
+	shared->cv.notify_all();
+	currBlock = -1;
+	currOffset = 0;
+}
+
+bool ReadAheadChunkSource::nextBlock()
+{
+	releaseBlock();
+	std::unique_lock<std::mutex> lk(shared->mtx);
+	shared->cv.wait(lk, [this] { return shared->eof || !shared->filledBlocks.empty(); });
+	if (shared->filledBlocks.empty())
+	{
+		if (shared->error)
+			std::rethrow_exception(shared->error);
+		return false;
+	}
+	currBlock = shared->filledBlocks.front();
+	shared->filledBlocks.pop_front();
+	currOffset = 0;
+	return true;
+}
+
+const uint8_t *ReadAheadChunkSource::next(size_t n, size_t *got)
+{
+	*got = 0;
+	if (currBlock < 0 || currOffset == shared->blockLengths[currBlock])
+	{
+		if (!nextBlock())
+			return nullptr;
+	}
+
+	// Usual case: chunk is entirely within the current block
+	size_t remaining = shared->blockLengths[currBlock] - currOffset;
+	if (remaining >= n)
+	{
+		const uint8_t *result = shared->blocks[currBlock].data() + currOffset;
+		currOffset += n;
+		pos += n;
+		*got = n;
+		return result;
+	}
+
+	// Chunk spans blocks, so copy it to make it contiguous
+	staging.clear();
+	while (staging.size() < n)
+	{
+		if (currBlock < 0 || currOffset == shared->blockLengths[currBlock])
+		{
+			if (!nextBlock())
+				break;
+		}
+		const uint8_t *src = shared->blocks[currBlock].data() + currOffset;
+		size_t count = std::min(n - staging.size(), shared->blockLengths[currBlock] - currOffset);
+		staging.insert(staging.end(), src, src + count);
+		currOffset += count;
+	}
+	pos += staging.size();
+	*got = staging.size();
+	return staging.data();
+}
+
+// Returns a ReadFn for a stdio stream, which keeps the stream alive for as long as the reader thread needs it
+static ReadAheadChunkSource::ReadFn stdioReader(std::shared_ptr<FILE> f, const char *errorMsg)
+{
+	return [f, errorMsg](uint8_t *dst, size_t n) {
+		size_t ret = std::fread(dst, 1, n, f.get());
+		if (!ret && std::ferror(f.get()))
+			throw Error(LogMsgType::FileIoError, errorMsg);
+		return ret;
+	};
+}
+
+PipeChunkSource::PipeChunkSource(FILE *f, size_t blockSize, size_t blockCount) :
+	ReadAheadChunkSource(stdioReader(std::shared_ptr<FILE>(f, [](FILE*) {}), "Could not read from stream"),
+		blockSize, blockCount)
+{}
+
+static uint64_t fileSize(FILE *f)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	struct _stat64 st;
+	if (_fstat64(_fileno(f), &st) != 0)
+		return ChunkSource::unknownSize;
+#else
+	struct stat st;
+	if (fstat(fileno(f), &st) != 0)
+		return ChunkSource::unknownSize;
+#endif
+	return st.st_size;
+}
+
+static std::shared_ptr<FILE> openForReading(ContextImpl *ctxi, const std::string &filename)
+{
+	FILE *f = std::fopen(filename.c_str(), "rb");
+	if (!f)
+		ctxi->logAndThrow(LogMsgType::FileIoError, "Could not open file " + filename + " for reading");
+	return std::shared_ptr<FILE>(f, std::fclose);
+}
+
+FileChunkSource::FileChunkSource(ContextImpl *ctxi, const std::string &filename, size_t blockSize, size_t blockCount) :
+	FileChunkSource(openForReading(ctxi, filename), blockSize, blockCount)
+{}
+
+FileChunkSource::FileChunkSource(std::shared_ptr<FILE> f, size_t blockSize, size_t blockCount) :
+	ReadAheadChunkSource(stdioReader(f, "Could not read from file"), blockSize, blockCount, fileSize(f.get()))
+{}
+
+}
@@ -0,0 +1,147 @@
+#ifndef fwupd_ChunkSource_h
+#define fwupd_ChunkSource_h
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace FwUpd
+{
+
+class ContextImpl;
+
+// Sequential source of data for the download controllers to pull chunks from
+class ChunkSource
+{
+public:
+	static const uint64_t unknownSize = UINT64_MAX;
+
+	// Returns a pointer to the next n bytes and sets *got to n. Fewer bytes are only returned at the end of the data,
+	// and *got is 0 once all data has been read. The pointer is valid until the next call.
+	virtual const uint8_t *next(size_t n, size_t *got) = 0;
+	// Number of bytes returned so far
+	virtual uint64_t position() const = 0;
+	// Total number of bytes, or unknownSize if this is not known until the end of the data is reached
+	virtual uint64_t size() const
+	{
+		return unknownSize;
+	}
+
+	virtual ~ChunkSource();
+};
+
+// Data which is already in memory (e.g. a std::vector or a MappedFile). owner keeps the memory alive.
+class MemoryChunkSource : public ChunkSource
+{
+protected:
+	std::shared_ptr<const void> owner;
+	const uint8_t *data;
+	uint64_t length;
+	uint64_t pos = 0;
+
+public:
+	const uint8_t *next(size_t n, size_t *got) override;
+	uint64_t position() const override
+	{
+		return pos;
+	}
+	uint64_t size() const override
+	{
+		return length;
+	}
+
+	MemoryChunkSource(const uint8_t *data, uint64_t length, std::shared_ptr<const void> owner = nullptr);
+};
+
+/*
+ * Data read from a blocking source by a background thread.
+ * Reading is done in blocks, with blockCount blocks in flight, so that the consumer (usually USB transfers)
+ * does not have to wait for reads as long as the source keeps up on average.
+ */
+class ReadAheadChunkSource : public ChunkSource
+{
+public:
+	// Reads up to n bytes into dst, returning the number of bytes read (0 at the end of the data). May throw.
+	using ReadFn = std::function<size_t(uint8_t *dst, size_t n)>;
+
+protected:
+	// State shared with the reader thread
+	class Shared
+	{
+	public:
+		ReadFn readFn;
+		std::vector<std::vector<uint8_t>> blocks;
+		std::vector<size_t> blockLengths;
+		std::deque<size_t> freeBlocks, filledBlocks;
+		std::mutex mtx;
+		std::condition_variable cv;
+		bool eof = false;
+		bool stopping = false;
+		std::exception_ptr error;
+
+		void readerLoop();
+	};
+	std::shared_ptr<Shared> shared;
+	std::thread reader;
+	uint64_t totalSize;
+	uint64_t pos = 0;
+
+	// Block currently being consumed, or -1 if none
+	int currBlock = -1;
+	size_t currOffset = 0;
+	// Used for chunks which span more than one block
+	std::vector<uint8_t> staging;
+
+	// Waits for the next filled block and makes it current. Returns false at the end of the data.
+	bool nextBlock();
+	void releaseBlock();
+
+public:
+	const uint8_t *next(size_t n, size_t *got) override;
+	uint64_t position() const override
+	{
+		return pos;
+	}
+	uint64_t size() const override
+	{
+		return totalSize;
+	}
+
+	ReadAheadChunkSource(ReadFn readFn, size_t blockSize, size_t blockCount = 2, uint64_t totalSize = unknownSize);
+	// Waits for the reader thread to finish its current read (if any), so readFn is never called after this returns
+	virtual ~ReadAheadChunkSource();
+	ReadAheadChunkSource(const ReadAheadChunkSource&) = delete;
+	ReadAheadChunkSource &operator=(const ReadAheadChunkSource&) = delete;
+};
+
+// Pipe or other non-seekable stream, such as stdin. The stream is not closed.
+class PipeChunkSource : public ReadAheadChunkSource
+{
+public:
+	PipeChunkSource(FILE *f, size_t blockSize = 65536, size_t blockCount = 2);
+};
+
+/*
+ * File on slow storage (network shares, SD cards etc), read in large blocks with several blocks of read-ahead.
+ * Logs and throws if the file cannot be opened.
+ */
+class FileChunkSource : public ReadAheadChunkSource
+{
+protected:
+	FileChunkSource(std::shared_ptr<FILE> f, size_t blockSize, size_t blockCount);
+
+public:
+	FileChunkSource(ContextImpl *ctxi, const std::string &filename, size_t blockSize = 1024*1024, size_t blockCount = 4);
+};
+
+}
+
+#endif
@@ -1,4 +1,7 @@
 #include "ContextImpl.hpp"
+#include "ThreadPool.hpp"
+#include "UsbEventThread.hpp"
+#include "PollScheduler.hpp"
 
 #include <libusb.h>
 #include <iostream>
@@ -47,17 +50,22 @@ void ContextImpl::setLogHandler(Context::LogHandler f)
 	logHandler = f;
 }
 
-void ContextImpl::updateLibUsbLogLevel()
+static void setLibUsbLogLevel(libusb_context *libusb_ctx, bool verbose)
 {
-	std::lock_guard<std::recursive_mutex> lk(mtx);
-	if (!libusb_ctx)
-		return;
-	if (shouldLog(LogLevel::Verbose3))
+	if (verbose)
 		libusb_set_debug(libusb_ctx, 255);
 	else
 		libusb_set_debug(libusb_ctx, LIBUSB_LOG_LEVEL_NONE);
 }
 
+void ContextImpl::updateLibUsbLogLevel()
+{
+	std::shared_ptr<UsbBackend> backend = getUsbBackend();
+	std::lock_guard<std::mutex> lk(backend->mtx);
+	if (backend->libusb_ctx)
+		setLibUsbLogLevel(backend->libusb_ctx, shouldLog(LogLevel::Verbose3));
+}
+
 void ContextImpl::setProgressHandler(Context::ProgressHandler f)
 {
 	std::lock_guard<std::recursive_mutex> lk(mtx);
@@ -202,20 +210,62 @@ void ContextImpl::logfAndThrow(const char *fmt, ...)
 	va_end(args);
 }
 
-libusb_context *ContextImpl::getLibUsbCtx()
+std::shared_ptr<UsbBackend> ContextImpl::getUsbBackend()
+{
+	std::lock_guard<std::recursive_mutex> lk(mtx);
+	return usb;
+}
+
+void ContextImpl::shareUsb(ContextImpl &other)
 {
+	std::shared_ptr<UsbBackend> backend = other.getUsbBackend();
 	std::lock_guard<std::recursive_mutex> lk(mtx);
-	if (!libusb_ctx)
+	usb = backend;
+}
+
+libusb_context *ContextImpl::getLibUsbCtx()
+{
+	std::shared_ptr<UsbBackend> backend = getUsbBackend();
+	std::lock_guard<std::mutex> lk(backend->mtx);
+	if (!backend->libusb_ctx)
 	{
-		int ret = libusb_init(&libusb_ctx);
+		int ret = libusb_init(&backend->libusb_ctx);
 		if (ret)
 		{
+			backend->libusb_ctx = nullptr;
 			logf(LogLevel::Error, "libusb_init return code: %d", ret);
 			logAndThrow("unable to initialize libusb");
 		}
-		updateLibUsbLogLevel();
+		setLibUsbLogLevel(backend->libusb_ctx, shouldLog(LogLevel::Verbose3));
 	}
-	return libusb_ctx;
+	return backend->libusb_ctx;
+}
+
+ThreadPool &ContextImpl::getThreadPool()
+{
+	std::lock_guard<std::recursive_mutex> lk(mtx);
+	if (!threadPool)
+		threadPool.reset(new ThreadPool());
+	return *threadPool;
+}
+
+UsbEventThread &ContextImpl::getUsbEventThread()
+{
+	libusb_context *libusb_ctx = getLibUsbCtx();
+	std::shared_ptr<UsbBackend> backend = getUsbBackend();
+	std::lock_guard<std::mutex> lk(backend->mtx);
+	if (!backend->eventThread)
+		backend->eventThread.reset(new UsbEventThread(libusb_ctx));
+	return *backend->eventThread;
+}
+
+PollScheduler &ContextImpl::getPollScheduler()
+{
+	std::shared_ptr<UsbBackend> backend = getUsbBackend();
+	std::lock_guard<std::mutex> lk(backend->mtx);
+	if (!backend->pollScheduler)
+		backend->pollScheduler.reset(new PollScheduler());
+	return *backend->pollScheduler;
 }
 
 void ContextImpl::assert_usbXferOk(int ret, std::string txt)
@@ -232,7 +282,17 @@ void ContextImpl::assert_usbXferLength(int requiredLength, int ret, std::string
 		logAndThrow(LogMsgType::UsbIoError, txt);
 }
 
-ContextImpl::ContextImpl()
+UsbBackend::~UsbBackend()
+{
+	// Waits for outstanding transfers, whose callbacks can schedule polls
+	eventThread.reset();
+	pollScheduler.reset();
+	if (libusb_ctx)
+		libusb_exit(libusb_ctx);
+}
+
+ContextImpl::ContextImpl() :
+	usb(std::make_shared<UsbBackend>())
 {
 	minLogLevel = LogLevel::Warn;
 	productName = "USB device";
@@ -240,12 +300,11 @@ ContextImpl::ContextImpl()
 
 ContextImpl::~ContextImpl()
 {
+	// Waits for outstanding transfers if no other context shares them. Not done with the lock held, since their
+	// callbacks may log.
+	usb.reset();
 	std::lock_guard<std::recursive_mutex> lk(mtx);
-	if (libusb_ctx)
-	{
-		libusb_exit(libusb_ctx);
-		libusb_ctx = nullptr;
-	}
+	threadPool.reset();
 }
 
 
@@ -5,6 +5,7 @@
 
 #include <mutex>
 #include <atomic>
+#include <memory>
 #include <stdexcept>
 #include <cstdarg>
 
@@ -13,6 +14,10 @@ class libusb_context;
 namespace FwUpd
 {
 
+class PollScheduler;
+class ThreadPool;
+class UsbEventThread;
+
 class Error : public std::runtime_error
 {
 public:
@@ -22,18 +27,35 @@ public:
 	virtual ~Error();
 };
 
+// libusb context and the threads handling asynchronous USB transfers, which several contexts can share
+class UsbBackend
+{
+public:
+	std::mutex mtx;
+	libusb_context *libusb_ctx = nullptr;
+	std::unique_ptr<UsbEventThread> eventThread;
+	std::unique_ptr<PollScheduler> pollScheduler;
+
+	UsbBackend() = default;
+	~UsbBackend();
+	UsbBackend(const UsbBackend&) = delete;
+	UsbBackend &operator=(const UsbBackend&) = delete;
+};
+
 class ContextImpl
 {
 protected:
 	Context::LogHandler logHandler;
 	Context::ProgressHandler progressHandler;
 	std::atomic<LogLevel> minLogLevel;
-	libusb_context *libusb_ctx = nullptr;
 	std::string productName;
+	std::unique_ptr<ThreadPool> threadPool;
+	std::shared_ptr<UsbBackend> usb;
 
 	std::recursive_mutex mtx;
 
 	void updateLibUsbLogLevel();
+	std::shared_ptr<UsbBackend> getUsbBackend();
 
 public:
 
@@ -63,6 +85,15 @@ public:
 	[[noreturn]] void logfAndThrow(const char *fmt, ...);
 
 	libusb_context *getLibUsbCtx();
+	// Shared pool for CPU bound work, created on first use
+	ThreadPool &getThreadPool();
+	// Thread handling asynchronous USB transfers, started on first use
+	UsbEventThread &getUsbEventThread();
+	// Thread running the delayed steps (such as status polls) of asynchronous downloads, started on first use
+	PollScheduler &getPollScheduler();
+	// Uses the libusb context, USB event thread and poll scheduler of other, so that the devices of many contexts are
+	// driven by the same threads. Call before this context has used USB.
+	void shareUsb(ContextImpl &other);
 	void assert_usbXferOk(int ret, std::string txt="libusb_control_transfer failed");
 	void assert_usbXferLength(int requiredLength, int ret, std::string txt);
 
@@ -0,0 +1,112 @@
+#include "MappedFile.hpp"
+#include "ContextImpl.hpp"
+
+#include <cstdint>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace FwUpd
+{
+
+#if defined(_WIN32) || defined(_WIN64)
+
+MappedFile::MappedFile(ContextImpl *ctxi, const std::string &filename)
+{
+	HANDLE fileHandle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		ctxi->logAndThrow(LogMsgType::FileIoError, "Could not open file " + filename + " for reading");
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize))
+	{
+		CloseHandle(fileHandle);
+		ctxi->logAndThrow(LogMsgType::FileIoError, "Could not get size of file " + filename);
+	}
+	length = fileSize.QuadPart;
+	if (length != static_cast<size_t>(length))
+	{
+		CloseHandle(fileHandle);
+		ctxi->logAndThrow(LogMsgType::FileIoError, "File size is too big to map");
+	}
+
+	// Zero length files cannot be mapped, but there is also nothing to map
+	if (length)
+	{
+		mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mappingHandle)
+			ptr = static_cast<const uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+	}
+	CloseHandle(fileHandle);
+	if (length && !ptr)
+	{
+		if (mappingHandle)
+			CloseHandle(mappingHandle);
+		mappingHandle = nullptr;
+		ctxi->logAndThrow(LogMsgType::FileIoError, "Could not map file " + filename);
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (ptr)
+		UnmapViewOfFile(ptr);
+	if (mappingHandle)
+		CloseHandle(mappingHandle);
+}
+
+#else
+
+MappedFile::MappedFile(ContextImpl *ctxi, const std::string &filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		ctxi->logAndThrow(LogMsgType::FileIoError, "Could not open file " + filename + " for reading");
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		ctxi->logAndThrow(LogMsgType::FileIoError, "Could not get size of file " + filename);
+	}
+	length = st.st_size;
+	if (length != static_cast<size_t>(length))
+	{
+		close(fd);
+		ctxi->logAndThrow(LogMsgType::FileIoError, "File size is too big to map");
+	}
+
+	// Zero length files cannot be mapped, but there is also nothing to map
+	if (length)
+	{
+		void *p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+		{
+			close(fd);
+			ctxi->logAndThrow(LogMsgType::FileIoError, "Could not map file " + filename);
+		}
+		ptr = static_cast<const uint8_t*>(p);
+#ifdef POSIX_MADV_SEQUENTIAL
+		posix_madvise(p, length, POSIX_MADV_SEQUENTIAL);
+#endif
+	}
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	if (ptr)
+		munmap(const_cast<uint8_t*>(ptr), length);
+}
+
+#endif
+
+}
@@ -0,0 +1,41 @@
+#ifndef fwupd_MappedFile_h
+#define fwupd_MappedFile_h
+
+#include <cstdint>
+#include <string>
+
+namespace FwUpd
+{
+
+class ContextImpl;
+
+// Read-only memory mapping of an entire file
+class MappedFile
+{
+protected:
+	const uint8_t *ptr = nullptr;
+	uint64_t length = 0;
+#if defined(_WIN32) || defined(_WIN64)
+	void *mappingHandle = nullptr;
+#endif
+
+public:
+	const uint8_t *data() const
+	{
+		return ptr;
+	}
+	uint64_t size() const
+	{
+		return length;
+	}
+
+	// Logs and throws on failure
+	MappedFile(ContextImpl *ctxi, const std::string &filename);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile &operator=(const MappedFile&) = delete;
+};
+
+}
+
+#endif
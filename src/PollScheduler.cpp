@@ -0,0 +1,118 @@
+#include "PollScheduler.hpp"
+
+#include <algorithm>
+
+/* Number of 1ms slots in the wheel. Longer deadlines stay in their slot for more than one rotation. */
+#define WHEEL_SLOTS 4096
+
+namespace FwUpd
+{
+
+int64_t PollScheduler::toMs(Clock::time_point t)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+}
+
+void PollScheduler::schedule(Clock::time_point deadline, std::function<void()> f)
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	Task task;
+	task.deadline = deadline;
+	// Slots up to processedMs will not be looked at again until the next rotation
+	task.slotMs = std::max(toMs(deadline), processedMs + 1);
+	task.f = std::move(f);
+	wheel[task.slotMs % WHEEL_SLOTS].push_back(std::move(task));
+	taskCount++;
+	if (deadline < waitDeadline)
+		cv.notify_one();
+}
+
+void PollScheduler::scheduleAfter(uint32_t msecs, std::function<void()> f)
+{
+	schedule(Clock::now() + std::chrono::milliseconds(msecs), std::move(f));
+}
+
+PollScheduler::Clock::time_point PollScheduler::takeDue(Clock::time_point now, std::vector<std::function<void()>> &due)
+{
+	int64_t nowMs = toMs(now);
+	// After a long sleep, one pass over the whole wheel covers every slot
+	int64_t endMs = std::min(nowMs, processedMs + WHEEL_SLOTS);
+	for (int64_t ms = processedMs + 1; ms <= endMs && taskCount; ms++)
+	{
+		Slot &slot = wheel[ms % WHEEL_SLOTS];
+		for (auto it = slot.begin(); it != slot.end();)
+		{
+			auto curr = it++;
+			if (curr->deadline > now)
+				continue;
+			due.push_back(std::move(curr->f));
+			slot.erase(curr);
+			taskCount--;
+		}
+	}
+	// The current millisecond is looked at again, since tasks in it may not be due yet
+	processedMs = std::max(processedMs, nowMs - 1);
+
+	// The first slot with a task for its current rotation has the earliest deadline
+	Clock::time_point next = Clock::time_point::max();
+	for (int64_t ms = processedMs + 1; ms <= processedMs + WHEEL_SLOTS && taskCount; ms++)
+	{
+		for (const Task &task : wheel[ms % WHEEL_SLOTS])
+		{
+			if (task.slotMs == ms && task.deadline < next)
+				next = task.deadline;
+		}
+		if (next != Clock::time_point::max())
+			return next;
+	}
+	// All tasks are more than one rotation away
+	for (const Slot &slot : wheel)
+	{
+		for (const Task &task : slot)
+			next = std::min(next, task.deadline);
+	}
+	return next;
+}
+
+void PollScheduler::run()
+{
+	std::vector<std::function<void()>> due;
+	std::unique_lock<std::mutex> lk(mtx);
+	while (!stopping)
+	{
+		waitDeadline = takeDue(Clock::now(), due);
+		if (!due.empty())
+		{
+			// Tasks can schedule further tasks
+			waitDeadline = Clock::time_point();
+			lk.unlock();
+			for (auto &f : due)
+				f();
+			due.clear();
+			lk.lock();
+			continue;
+		}
+		if (waitDeadline == Clock::time_point::max())
+			cv.wait(lk);
+		else
+			cv.wait_until(lk, waitDeadline);
+	}
+}
+
+PollScheduler::PollScheduler() :
+	wheel(WHEEL_SLOTS), processedMs(toMs(Clock::now()) - 1), waitDeadline(Clock::time_point::max())
+{
+	thread = std::thread(&PollScheduler::run, this);
+}
+
+PollScheduler::~PollScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		stopping = true;
+	}
+	cv.notify_one();
+	thread.join();
+}
+
+}
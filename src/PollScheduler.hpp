@@ -0,0 +1,70 @@
+#ifndef fwupd_PollScheduler_h
+#define fwupd_PollScheduler_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace FwUpd
+{
+
+/*
+ * Runs tasks at deadlines, such as the next GETSTATUS request after a device's bwPollTimeout, so that one thread can
+ * service the polls of many devices.
+ * Tasks are kept in a hashed timer wheel with 1ms slots. The thread sleeps until the exact deadline of the earliest
+ * task, so that devices with small poll timeouts are not delayed by a coarse tick.
+ * Tasks run on the scheduler's thread, so they should return quickly. Tasks which have not run when the scheduler is
+ * destroyed are discarded.
+ */
+class PollScheduler
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+protected:
+	class Task
+	{
+	public:
+		Clock::time_point deadline;
+		// Millisecond of the wheel rotation the task is in, which can be later than its deadline if the deadline had
+		// already passed when it was scheduled
+		int64_t slotMs;
+		std::function<void()> f;
+	};
+	using Slot = std::list<Task>;
+
+	std::vector<Slot> wheel;
+	size_t taskCount = 0;
+	// All slots up to and including this millisecond have been run
+	int64_t processedMs;
+	std::mutex mtx;
+	std::condition_variable cv;
+	// Deadline the thread is sleeping until, Clock::time_point::max() if it is waiting for a task
+	Clock::time_point waitDeadline;
+	bool stopping = false;
+	std::thread thread;
+
+	static int64_t toMs(Clock::time_point t);
+	void run();
+	// Moves tasks which are due into due, returns the deadline of the earliest remaining task
+	Clock::time_point takeDue(Clock::time_point now, std::vector<std::function<void()>> &due);
+
+public:
+	// Runs f on the scheduler thread once deadline has been reached
+	void schedule(Clock::time_point deadline, std::function<void()> f);
+	void scheduleAfter(uint32_t msecs, std::function<void()> f);
+
+	PollScheduler();
+	~PollScheduler();
+	PollScheduler(const PollScheduler&) = delete;
+	PollScheduler &operator=(const PollScheduler&) = delete;
+};
+
+}
+
+#endif
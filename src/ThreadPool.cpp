@@ -0,0 +1,44 @@
+#include "ThreadPool.hpp"
+
+namespace FwUpd
+{
+
+void ThreadPool::workerLoop()
+{
+	while (1)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lk(mtx);
+			cv.wait(lk, [this] { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
+
+ThreadPool::ThreadPool(size_t threadCount)
+{
+	if (!threadCount)
+		threadCount = std::thread::hardware_concurrency();
+	if (!threadCount)
+		threadCount = 1;
+	for (size_t i=0; i<threadCount; i++)
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		stopping = true;
+	}
+	cv.notify_all();
+	for (std::thread &t : workers)
+		t.join();
+}
+
+}
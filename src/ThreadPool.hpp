@@ -0,0 +1,58 @@
+#ifndef fwupd_ThreadPool_h
+#define fwupd_ThreadPool_h
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace FwUpd
+{
+
+// Fixed size pool of worker threads for CPU bound host-side work (checksums, parsing etc)
+class ThreadPool
+{
+protected:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool stopping = false;
+
+	void workerLoop();
+
+public:
+	// Queues f to be run on one of the worker threads. The returned future receives the result (or exception) of f.
+	template <typename F>
+	auto submit(F f) -> std::future<decltype(f())>
+	{
+		using R = decltype(f());
+		auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+		std::future<R> result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			tasks.emplace_back([task]() { (*task)(); });
+		}
+		cv.notify_one();
+		return result;
+	}
+
+	size_t size() const
+	{
+		return workers.size();
+	}
+
+	// threadCount=0 means one thread per hardware thread
+	ThreadPool(size_t threadCount = 0);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool &operator=(const ThreadPool&) = delete;
+};
+
+}
+
+#endif
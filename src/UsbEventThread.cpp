@@ -0,0 +1,175 @@
+#include "UsbEventThread.hpp"
+
+#include <libusb.h>
+#include <cstring>
+
+/* libusb_interrupt_event_handler was added in libusb 1.0.21, with older versions stopping relies on the event timeout */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER 1
+#define EVENT_TIMEOUT_US 1000000
+#else
+#define EVENT_TIMEOUT_US 100000
+#endif
+
+namespace FwUpd
+{
+
+class UsbTransfer
+{
+public:
+	UsbEventThread *owner;
+	UsbEventThread::Callback cb;
+	// Destination for data from IN transfers
+	unsigned char *inData;
+
+	static void LIBUSB_CALL done(libusb_transfer *transfer)
+	{
+		UsbTransfer *t = static_cast<UsbTransfer*>(transfer->user_data);
+		int result;
+		// Same results as libusb_control_transfer
+		switch (transfer->status)
+		{
+		case LIBUSB_TRANSFER_COMPLETED:
+			result = transfer->actual_length;
+			if (t->inData && result > 0)
+				std::memcpy(t->inData, libusb_control_transfer_get_data(transfer), result);
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			result = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			result = LIBUSB_ERROR_PIPE;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			result = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			result = LIBUSB_ERROR_OVERFLOW;
+			break;
+		default:
+			result = LIBUSB_ERROR_IO;
+			break;
+		}
+
+		delete[] transfer->buffer;
+		libusb_free_transfer(transfer);
+		UsbEventThread *owner = t->owner;
+		try
+		{
+			t->cb(result);
+		}
+		catch (...)
+		{
+			// There is nobody to report this to, and it must not stop the event thread
+		}
+		delete t;
+		owner->pending--;
+	}
+};
+
+class UsbHotplug
+{
+public:
+	static int LIBUSB_CALL arrived(libusb_context *, libusb_device *, libusb_hotplug_event, void *userData)
+	{
+		UsbEventThread *t = static_cast<UsbEventThread*>(userData);
+		{
+			std::lock_guard<std::mutex> lk(t->arrivalMtx);
+			t->arrivals++;
+		}
+		t->arrivalCv.notify_all();
+		// Stay registered
+		return 0;
+	}
+};
+
+bool UsbEventThread::watchArrivals()
+{
+	std::lock_guard<std::mutex> lk(arrivalMtx);
+	if (hotplugRegistered)
+		return true;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return false;
+	int ret = libusb_hotplug_register_callback(usbCtx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, &UsbHotplug::arrived, this,
+		&hotplugHandle);
+	hotplugRegistered = (ret == LIBUSB_SUCCESS);
+	return hotplugRegistered;
+}
+
+uint64_t UsbEventThread::arrivalCount()
+{
+	std::lock_guard<std::mutex> lk(arrivalMtx);
+	return arrivals;
+}
+
+void UsbEventThread::waitForArrival(uint64_t seen, std::chrono::steady_clock::time_point deadline)
+{
+	std::unique_lock<std::mutex> lk(arrivalMtx);
+	arrivalCv.wait_until(lk, deadline, [&]() { return arrivals != seen; });
+}
+
+int UsbEventThread::submitControl(libusb_device_handle *devHandle, uint8_t bmRequestType, uint8_t bRequest,
+	uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout, Callback cb)
+{
+	libusb_transfer *transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+	unsigned char *buffer = new unsigned char[LIBUSB_CONTROL_SETUP_SIZE + wLength];
+	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex, wLength);
+	bool isIn = (bmRequestType & LIBUSB_ENDPOINT_IN) != 0;
+	if (!isIn && wLength)
+		std::memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+
+	UsbTransfer *t = new UsbTransfer;
+	t->owner = this;
+	t->cb = std::move(cb);
+	t->inData = isIn ? data : nullptr;
+	libusb_fill_control_transfer(transfer, devHandle, buffer, &UsbTransfer::done, t, timeout);
+
+	pending++;
+	int ret = submitTransfer(transfer);
+	if (ret < 0)
+	{
+		pending--;
+		delete t;
+		delete[] buffer;
+		libusb_free_transfer(transfer);
+	}
+	return ret < 0 ? ret : 0;
+}
+
+int UsbEventThread::submitTransfer(libusb_transfer *transfer)
+{
+	return libusb_submit_transfer(transfer);
+}
+
+void UsbEventThread::run()
+{
+	while (!stopping || pending)
+	{
+		struct timeval tv;
+		tv.tv_sec = EVENT_TIMEOUT_US / 1000000;
+		tv.tv_usec = EVENT_TIMEOUT_US % 1000000;
+		libusb_handle_events_timeout_completed(usbCtx, &tv, nullptr);
+	}
+}
+
+UsbEventThread::UsbEventThread(libusb_context *usbCtx) :
+	usbCtx(usbCtx), stopping(false), pending(0)
+{
+	thread = std::thread(&UsbEventThread::run, this);
+}
+
+UsbEventThread::~UsbEventThread()
+{
+	if (hotplugRegistered)
+		libusb_hotplug_deregister_callback(usbCtx, hotplugHandle);
+	stopping = true;
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+	libusb_interrupt_event_handler(usbCtx);
+#endif
+	thread.join();
+}
+
+}
@@ -0,0 +1,76 @@
+#ifndef fwupd_UsbEventThread_h
+#define fwupd_UsbEventThread_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+class libusb_context;
+class libusb_device_handle;
+struct libusb_transfer;
+
+namespace FwUpd
+{
+
+class UsbTransfer;
+class UsbHotplug;
+
+/*
+ * Thread which handles libusb events for asynchronous transfers, so that one host thread can have transfers to many
+ * devices in flight at the same time.
+ * Completion callbacks run on this thread. They should return quickly, and must not do synchronous libusb transfers.
+ */
+class UsbEventThread
+{
+public:
+	// result is the number of bytes transferred, or a negative libusb error code (same as libusb_control_transfer)
+	using Callback = std::function<void(int result)>;
+
+protected:
+	libusb_context *usbCtx;
+	std::thread thread;
+	std::atomic<bool> stopping;
+	// Submitted transfers which have not completed yet. The thread keeps handling events until they have all completed.
+	std::atomic<size_t> pending;
+
+	// Device arrivals seen by the hotplug callback
+	std::mutex arrivalMtx;
+	std::condition_variable arrivalCv;
+	uint64_t arrivals = 0;
+	bool hotplugRegistered = false;
+	int hotplugHandle;
+
+	void run();
+	// Hands a filled in transfer to libusb. Replaced by tests to complete transfers without a device.
+	virtual int submitTransfer(libusb_transfer *transfer);
+	friend class UsbTransfer;
+	friend class UsbHotplug;
+
+public:
+	/*
+	 * Submits a control transfer. For IN transfers, data must stay valid until the callback has been called.
+	 * For OUT transfers, the data is copied before this returns.
+	 * Returns 0, or a negative libusb error code if the transfer could not be submitted (the callback is not called then).
+	 */
+	int submitControl(libusb_device_handle *devHandle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout, Callback cb);
+
+	// Starts counting device arrivals with a libusb hotplug callback. Returns false if the platform does not support hotplug.
+	bool watchArrivals();
+	uint64_t arrivalCount();
+	// Waits until arrivalCount() is no longer seen, or until deadline
+	void waitForArrival(uint64_t seen, std::chrono::steady_clock::time_point deadline);
+
+	UsbEventThread(libusb_context *usbCtx);
+	virtual ~UsbEventThread();
+	UsbEventThread(const UsbEventThread&) = delete;
+	UsbEventThread &operator=(const UsbEventThread&) = delete;
+};
+
+}
+
+#endif
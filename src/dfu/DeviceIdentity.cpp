@@ -0,0 +1,69 @@
+#include "libFirmwareUpdate++/dfu/DeviceIdentity.hpp"
+#include "usb_dfu.hpp"
+
+#include <set>
+#include <tuple>
+
+namespace FwUpd
+{
+
+DeviceIdentity DeviceIdentity::fromInterface(const DfuInterface &dif)
+{
+	DeviceIdentity id;
+	id.path = dif.path;
+	if (dif.serial_name != "UNKNOWN")
+		id.serial = dif.serial_name;
+	id.runtimeUsbId = dif.usbId;
+	return id;
+}
+
+// Number of physical devices the interfaces belong to
+static size_t countDevices(const DfuFinder::Results &interfaces)
+{
+	std::set<std::tuple<std::string, uint16_t, uint16_t>> devices;
+	for (const auto &dif : interfaces)
+		devices.insert(std::make_tuple(dif->path, dif->busnum, dif->devnum));
+	return devices.size();
+}
+
+DfuFinder::Results DeviceIdentity::select(const DfuFinder::Results &candidates) const
+{
+	DfuFinder::Results dfuMode;
+	for (const auto &dif : candidates)
+	{
+		if ((dif->flags & DFU_IFF_DFU) && dif->usbId.matchesSearch(dfuUsbId))
+			dfuMode.push_back(dif);
+	}
+
+	DfuFinder::Results result;
+	if (!path.empty())
+	{
+		for (const auto &dif : dfuMode)
+		{
+			if (dif->path == path)
+				result.push_back(dif);
+		}
+		if (!result.empty())
+			return result;
+	}
+
+	if (!serial.empty())
+	{
+		for (const auto &dif : dfuMode)
+		{
+			if (dif->serial_name == serial)
+				result.push_back(dif);
+		}
+		if (countDevices(result) == 1)
+			return result;
+		result.clear();
+	}
+
+	// Even with a known path, so that a device which reappears elsewhere with a new serial number (e.g. an STM32
+	// bootloader) is still found when it is the only one
+	if (countDevices(dfuMode) == 1)
+		return dfuMode;
+	return result;
+}
+
+}
@@ -1,7 +1,12 @@
 #include "DfuController.hpp"
 #include "ContextImpl.hpp"
 #include "usb_dfu.hpp"
-#include "Util.hpp"
+#include "DfuFile.hpp"
+#include "PollScheduler.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <future>
 
 #ifdef HAVE_GETPAGESIZE
 #include <unistd.h>
@@ -50,113 +55,254 @@ void DfuController::calcTransferSize()
 	transferSize = getDefaultTransferSize();
 }
 
-void DfuController::abortToIdle()
+void DfuController::progress()
+{
+	// Total size is not known in advance when streaming
+	uint64_t total = source->size();
+	if (total == ChunkSource::unknownSize || !total)
+		return;
+	// <10% and >90% reserved for enumeration/reset/other programming tasks
+	float prog = (static_cast<float>(source->position())/total) * 0.9 + 0.05;
+	ctxi()->progress(prog, "Downloading");
+}
+
+void DfuController::guard(const Step &step)
+{
+	try {
+		step();
+	} catch (...) {
+		finish(std::current_exception());
+	}
+}
+
+void DfuController::after(uint32_t msecs, Step next)
+{
+	if (!msecs) {
+		guard(next);
+		return;
+	}
+	ctxi()->getPollScheduler().scheduleAfter(msecs, [this, next]() { guard(next); });
+}
+
+void DfuController::sendDownload(uint16_t block, const uint8_t *data, uint16_t length,
+	std::function<void(int result)> next)
+{
+	int ret = dif->downloadAsync(block, data, length, [this, next](int result) {
+		guard([&]() { next(result); });
+	});
+	/* The callback is not called if the transfer could not be submitted */
+	if (ret < 0)
+		next(ret);
+}
+
+void DfuController::requestStatus(std::function<void(int result)> next)
+{
+	int ret = dif->getStatusAsync(&status, [this, next](int result) {
+		guard([&]() { next(result); });
+	});
+	if (ret < 0)
+		next(ret);
+}
+
+void DfuController::abortToIdle(Step next)
 {
-	struct dfu_status dst;
+	auto statusReceived = [this, next](int ret) {
+		ctxi()->assert_usbXferOk(ret, "Error during abort get_status");
+		if (status.bState != DFU_STATE_dfuIDLE) {
+			ctxi()->logAndThrow("Failed to enter idle state on abort");
+		}
+		after(status.bwPollTimeout, next);
+	};
+	int ret = dif->abortAsync([this, statusReceived](int result) {
+		guard([&]() {
+			ctxi()->assert_usbXferOk(result, "Error sending dfu abort request");
+			requestStatus(statusReceived);
+		});
+	});
+	ctxi()->assert_usbXferOk(ret, "Error sending dfu abort request");
+}
 
-	ctxi()->assert_usbXferOk(dif->abort(), "Error sending dfu abort request");
-	ctxi()->assert_usbXferOk(dif->getStatus(&dst), "Error during abort get_status");
-	if (dst.bState != DFU_STATE_dfuIDLE) {
-		ctxi()->logAndThrow("Failed to enter idle state on abort");
+void DfuController::dataSent(Step next)
+{
+	if (!onDataSent) {
+		next();
+		return;
+	}
+	try {
+		onDataSent();
+	} catch (...) {
+		/* Return the device to dfuIDLE instead of letting it manifest */
+		std::exception_ptr error = std::current_exception();
+		if (dif->abortAsync([this, error](int) { finish(error); }) < 0)
+			finish(error);
+		return;
 	}
-	milliSleep(dst.bwPollTimeout);
+	next();
+}
+
+void DfuController::finish(std::exception_ptr error)
+{
+	/* Nothing may touch the controller after done has been called, since it can be destroyed by then */
+	Finished done = std::move(finished);
+	finished = nullptr;
+	if (done)
+		done(error);
+}
+
+void DfuController::start(Finished done)
+{
+	finished = std::move(done);
+	guard([this]() { begin(); });
+}
+
+int DfuController::run()
+{
+	auto result = std::make_shared<std::promise<void>>();
+	std::future<void> ended = result->get_future();
+	start([result](std::exception_ptr error) {
+		if (error)
+			result->set_exception(error);
+		else
+			result->set_value();
+	});
+	ended.get();
+	return 0;
 }
 
 DfuController::DfuController(std::shared_ptr<DfuInterface> dif) :
 	dif(dif)
 {}
 
-int DfuController_download::run()
+DfuController::~DfuController()
+{}
+
+BusyPoller::BusyPoller(DfuController *c, PollProfiles::Operation op) :
+	c(c), op(op)
+{}
+
+uint32_t BusyPoller::delay(uint32_t reportedMs)
 {
-	calcTransferSize();
+	ContextImpl *ctxi = c->dif->ctx->pImpl;
+	uint32_t ms = reportedMs;
+	if (!waits++)
+	{
+		start = std::chrono::steady_clock::now();
+		if (c->pollProfiles && c->pollProfiles->estimate(c->dif->usbId, c->dif->bcdDevice, op, &learned))
+		{
+			ctxi->logf(LogLevel::Verbose2, "Using learned poll time %u ms (device reported %u ms)", learned, reportedMs);
+			ms = learned;
+		}
+	}
+	else if (learned)
+	{
+		ms = std::min(reportedMs, std::max<uint32_t>(1, learned/4));
+	}
+	return ms;
+}
 
-	int bytes_sent;
-	int expected_size;
-	unsigned short transaction = 0;
-	struct dfu_status dst;
-	int ret;
+void BusyPoller::done()
+{
+	if (!waits || !c->pollProfiles)
+		return;
+	auto busy = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	c->pollProfiles->record(c->dif->usbId, c->dif->bcdDevice, op, static_cast<uint32_t>(busy), waits == 1);
+}
+
+void DfuController_download::begin()
+{
+	calcTransferSize();
 
 	ctxi()->log(LogLevel::Info, "Copying data from PC to "+ctxi()->getProductName());
 
 	// Note: sent data includes prefix (if any)
-	uint8_t *buf = file->data.data();
-	expected_size = file->size.total - file->size.suffix;
-	bytes_sent = 0;
+	if (!source)
+		source = image ? FirmwareImage_openSource(image, false) : DfuFile_openSource(file, false);
+	bytesSent = 0;
+	transaction = 0;
 
 	ctxi()->progress(0.05, "Downloading");
-	while (bytes_sent < expected_size) {
-		int bytes_left;
-		int chunk_size;
-
-		bytes_left = expected_size - bytes_sent;
-		if (bytes_left < transferSize)
-			chunk_size = bytes_left;
-		else
-			chunk_size = transferSize;
+	sendNextChunk();
+}
 
-		ctxi()->assert_usbXferOk(dif->download(transaction++, chunk_size ? buf : nullptr, chunk_size),
-								 "Error during download");
-		bytes_sent += chunk_size;
-		buf += chunk_size;
+void DfuController_download::sendNextChunk()
+{
+	size_t chunk_size;
+	const uint8_t *chunk = source->next(transferSize, &chunk_size);
+	if (!chunk_size) {
+		dataSent([this]() {
+			/* send one zero sized download request to signalize end */
+			sendDownload(transaction, nullptr, 0, [this](int ret) {
+				ctxi()->assert_usbXferOk(ret, "Error sending completion packet");
+				ctxi()->progress(0.95, "Downloading");
+				ctxi()->logf(LogLevel::Verbose, "Sent a total of %" PRIu64 " bytes", bytesSent);
+				poller = BusyPoller(this, PollProfiles::Operation::Manifest);
+				pollManifest();
+			});
+		});
+		return;
+	}
 
-		do {
-			ctxi()->assert_usbXferOk(dif->getStatus(&dst),
-									 "Error during download get_status");
+	sendDownload(transaction++, chunk, chunk_size, [this, chunk_size](int ret) {
+		ctxi()->assert_usbXferOk(ret, "Error during download");
+		bytesSent += chunk_size;
+		poller = BusyPoller(this, PollProfiles::Operation::ChunkWrite);
+		pollChunk();
+	});
+}
 
-			if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
-					dst.bState == DFU_STATE_dfuERROR)
-				break;
+void DfuController_download::pollChunk()
+{
+	requestStatus([this](int ret) {
+		ctxi()->assert_usbXferOk(ret, "Error during download get_status");
 
+		if (status.bState != DFU_STATE_dfuDNLOAD_IDLE && status.bState != DFU_STATE_dfuERROR) {
 			/* Wait while device executes flashing */
-			milliSleep(dst.bwPollTimeout);
-
-		} while (1);
-		if (dst.bStatus != DFU_STATUS_OK) {
-			ctxi()->logfAndThrow("Error during download: state(%u) = %s, status(%u) = %s", dst.bState,
-				dfu_state_to_string(dst.bState), dst.bStatus,
-				dfu_status_to_string(dst.bStatus));
+			after(poller.delay(status.bwPollTimeout), [this]() { pollChunk(); });
+			return;
 		}
-		// <10% and >90% reserved for enumeration/reset/other programming tasks
-		float prog = (static_cast<float>(bytes_sent)/(bytes_sent + bytes_left)) * 0.9 + 0.05;
-		ctxi()->progress(prog, "Downloading");
-	}
-
-	/* send one zero sized download request to signalize end */
-	ctxi()->assert_usbXferOk(dif->download(transaction, nullptr, 0),
-							 "Error sending completion packet");
-
-	ctxi()->progress(0.95, "Downloading");
-
-	ctxi()->logf(LogLevel::Verbose, "Sent a total of %i bytes", bytes_sent);
+		if (status.bStatus != DFU_STATUS_OK) {
+			ctxi()->logfAndThrow("Error during download: state(%u) = %s, status(%u) = %s", status.bState,
+				dfu_state_to_string(status.bState), status.bStatus,
+				dfu_status_to_string(status.bStatus));
+		}
+		poller.done();
+		progress();
+		sendNextChunk();
+	});
+}
 
-get_status:
+void DfuController_download::pollManifest()
+{
 	/* Transition to MANIFEST_SYNC state */
-	ret = dif->getStatus(&dst);
-	if (ret < 0) {
-		ctxi()->logf(LogLevel::Warn, "unable to read DFU status after completion");
-		return bytes_sent;
-	}
-	ctxi()->logf(LogLevel::Info, "state(%u) = %s, status(%u) = %s\n", dst.bState,
-		dfu_state_to_string(dst.bState), dst.bStatus,
-		dfu_status_to_string(dst.bStatus));
-
-	milliSleep(dst.bwPollTimeout);
-
-	/* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
-	switch (dst.bState) {
-	case DFU_STATE_dfuMANIFEST_SYNC:
-	case DFU_STATE_dfuMANIFEST:
-		/* some devices (e.g. TAS1020b) need some time before we
-		 * can obtain the status */
-		milliSleep(1000);
-		goto get_status;
-		break;
-	case DFU_STATE_dfuIDLE:
-		break;
-	}
-	ctxi()->logf(LogLevel::Info, "Done!");
+	requestStatus([this](int ret) {
+		if (ret < 0) {
+			ctxi()->logf(LogLevel::Warn, "unable to read DFU status after completion");
+			finish();
+			return;
+		}
+		ctxi()->logf(LogLevel::Info, "state(%u) = %s, status(%u) = %s\n", status.bState,
+			dfu_state_to_string(status.bState), status.bStatus,
+			dfu_status_to_string(status.bStatus));
 
-	return bytes_sent;
+		/* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
+		switch (status.bState) {
+		case DFU_STATE_dfuMANIFEST_SYNC:
+		case DFU_STATE_dfuMANIFEST:
+			/* some devices (e.g. TAS1020b) need some time before we
+			 * can obtain the status */
+			after(poller.delay(status.bwPollTimeout + 1000), [this]() { pollManifest(); });
+			return;
+		case DFU_STATE_dfuIDLE:
+			poller.done();
+			break;
+		default:
+			break;
+		}
+		after(status.bwPollTimeout, [this]() {
+			ctxi()->logf(LogLevel::Info, "Done!");
+			finish();
+		});
+	});
 }
 
 }
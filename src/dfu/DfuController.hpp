@@ -2,33 +2,123 @@
 #define fwupd_dfu_DfuController_h
 
 #include "libFirmwareUpdate++/dfu.hpp"
+#include "ChunkSource.hpp"
+#include <chrono>
 #include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
 
 namespace FwUpd
 {
 
 
+class DfuController;
+
+/*
+ * Works out how long to wait while the device is busy with an operation. The first wait uses the learned time from the
+ * controller's pollProfiles if there is one, otherwise the poll timeout the device reported. If the device is still busy
+ * after a learned wait, it is polled again at a fraction of the learned time (if that is shorter than the reported
+ * timeout).
+ */
+class BusyPoller
+{
+protected:
+	DfuController *c = nullptr;
+	PollProfiles::Operation op = PollProfiles::Operation::ChunkWrite;
+	std::chrono::steady_clock::time_point start;
+	int waits = 0;
+	// Learned time for the first wait, 0 if there is none
+	uint32_t learned = 0;
+
+public:
+	BusyPoller() = default;
+	BusyPoller(DfuController *c, PollProfiles::Operation op);
+	// Returns the time to wait before the next status poll
+	uint32_t delay(uint32_t reportedMs);
+	// Records how long the device was busy. Call once it has finished, unless it ended up in an error state.
+	void done();
+};
+
+/*
+ * Downloads run as a chain of steps, each started by the completion of an asynchronous USB transfer (on the context's
+ * USB event thread) or by a poll deadline (on its poll scheduler thread), so that the downloads of many devices can
+ * share those two threads. Only one step of a download runs at a time.
+ * An exception thrown by a step ends the download with that error.
+ */
 class DfuController
 {
 protected:
+	using Step = std::function<void()>;
+	using Finished = std::function<void(std::exception_ptr error)>;
+	Finished finished;
+	// Result of the last requestStatus()
+	struct dfu_status status;
+	// Poller for the operation the device is currently busy with
+	BusyPoller poller;
+
 	ContextImpl *ctxi() const;
 	uint32_t getDefaultTransferSize();
 	void calcTransferSize();
 	int transferSize;
+	// Reports download progress based on the read position in source, if its size is known
+	void progress();
+
+	// Runs step, ending the download if it throws
+	void guard(const Step &step);
+	// Runs next once msecs have passed
+	void after(uint32_t msecs, Step next);
+	// Sends a DNLOAD request, then calls next with the result of the transfer. data is copied.
+	void sendDownload(uint16_t block, const uint8_t *data, uint16_t length, std::function<void(int result)> next);
+	// Sends a GETSTATUS request, then calls next with the result of the transfer (the status is stored in status)
+	void requestStatus(std::function<void(int result)> next);
+	// Returns the device to dfuIDLE, then calls next
+	void abortToIdle(Step next);
+	// Calls onDataSent (if set), then next. If onDataSent throws, the device is returned to dfuIDLE and the download ends.
+	void dataSent(Step next);
+	// Ends the download, successfully if error is null
+	void finish(std::exception_ptr error = nullptr);
+	// First step of the download
+	virtual void begin() = 0;
+
 public:
 	std::shared_ptr<DfuInterface> dif = nullptr;
 	uint32_t transferSizeOverride = 0;
-	void abortToIdle();
+	// Data to download. If not set, the DFU download controller reads from its file (DfuSe downloads always use the
+	// file data, which is in memory).
+	std::shared_ptr<ChunkSource> source;
+	// Called after all data has been sent, but before the device is told the download is complete.
+	// When streaming, the file suffix has been read by this point. Throwing aborts the download.
+	std::function<void()> onDataSent;
+	// Optional, learned times the device spends busy, used instead of the reported poll timeouts
+	std::shared_ptr<PollProfiles> pollProfiles;
+
+	// Starts the download and returns. done is called exactly once when it has ended, with the error that ended it (null
+	// on success), usually on the USB event or poll scheduler thread. The controller must outlive the download.
+	void start(Finished done);
+	// Runs the download, waiting for it to end. Returns 0 on success, throws the error that ended it otherwise.
+	int run();
 
 	DfuController(std::shared_ptr<DfuInterface> dif);
+	virtual ~DfuController();
 };
 
 class DfuController_download: public DfuController
 {
 public:
 	std::shared_ptr<DfuFile> file;
-	int run();
+	// Alternative to file, for downloading the same image to several devices at once
+	std::shared_ptr<const FirmwareImage> image;
 	using DfuController::DfuController;
+
+protected:
+	uint64_t bytesSent = 0;
+	unsigned short transaction = 0;
+
+	void begin() override;
+	void sendNextChunk();
+	void pollChunk();
+	void pollManifest();
 };
 
 }
@@ -2,6 +2,8 @@
 #include "PackedData.hpp"
 #include "ContextImpl.hpp"
 #include "Util.hpp"
+#include "ThreadPool.hpp"
+#include "MappedFile.hpp"
 
 #include "DfuFile.hpp"
 
@@ -18,11 +20,17 @@
 #include <time.h>
 #include <fcntl.h>
 
-#define DFU_SUFFIX_LENGTH 16
-#define LMDFU_PREFIX_LENGTH 8
-#define LPCDFU_PREFIX_LENGTH 16
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define PROGRESS_BAR_WIDTH 25
-#define STDIN_CHUNK_SIZE 65536
+/* Files larger than this have their suffix CRC checked on multiple threads */
+#define PARALLEL_CRC_MIN_SIZE (16*1024*1024)
 
 namespace FwUpd
 {
@@ -40,6 +48,8 @@ DfuFile::~DfuFile()
 void DfuFile::reset()
 {
 	data.clear();
+	mapping = nullptr;
+	stream = nullptr;
 	size.total = 0;
 	size.prefix = 0;
 	size.suffix = 0;
@@ -48,6 +58,7 @@ void DfuFile::reset()
 	lmdfu_address = 0;
 	prefix_type = PrefixType::None;
 	dwCRC = 0xFFFFFFFF;
+	hasContentCrc = false;
 
 	/* default values, if no valid suffix is found */
 	bcdDFU = 0;
@@ -56,17 +67,60 @@ void DfuFile::reset()
 	bcdDevice = 0xFFFF;
 }
 
-void DfuFile::loadFile(std::string filename)
+// Checks whether the file ends with the signature of a DFU suffix which can be streamed.
+// The suffix CRC can only be checked once the whole file has been read.
+static bool hasStreamableSuffixSignature(const std::string &filename)
+{
+	std::ifstream f(filename, std::ios::binary | std::ios::ate);
+	if (f.fail() || f.tellg() < DFU_SUFFIX_LENGTH)
+		return false;
+	uint8_t dfusuffix[DFU_SUFFIX_LENGTH];
+	f.seekg(-DFU_SUFFIX_LENGTH, std::ios::end);
+	f.read(reinterpret_cast<char*>(dfusuffix), DFU_SUFFIX_LENGTH);
+	if (f.fail())
+		return false;
+	return (dfusuffix[10] == 'D' && dfusuffix[9] == 'F' && dfusuffix[8] == 'U' && dfusuffix[11] == DFU_SUFFIX_LENGTH);
+}
+
+void DfuFile::loadFile(std::string filename, LoadMode mode)
 {
 	reset();
 
+	if (mode == LoadMode::Stream)
+	{
+		// Data is read ahead in large blocks as it is downloaded
+		auto src = std::make_shared<FileChunkSource>(ctx->pImpl, filename);
+		auto reader = std::make_shared<DfuStreamReader>(this, src);
+		// Lets the download report progress. If the suffix turns out to be invalid, the last few bytes are sent
+		// after the expected size has been reached.
+		if (src->size() != ChunkSource::unknownSize)
+		{
+			uint64_t suffixLength = hasStreamableSuffixSignature(filename) ? DFU_SUFFIX_LENGTH : 0;
+			if (src->size() >= suffixLength)
+				reader->setExpectedSize(src->size() - suffixLength);
+		}
+		reader->start();
+		stream = reader;
+		return;
+	}
+
+	if (mode == LoadMode::Map)
+	{
+		mapping = std::make_shared<MappedFile>(ctx->pImpl, filename);
+		size.total = mapping->size();
+		DfuFileReader impl(this);
+		impl.read();
+		return;
+	}
+
 	std::ifstream f(filename, std::ios::binary | std::ios::ate);
 	if (f.fail())
 		ctx->pImpl->logAndThrow(LogMsgType::FileIoError, "Could not open file " + filename + " for reading");
 
-	std::streampos fileSize = f.tellg();
-	if (fileSize < 0 || (uint32_t)fileSize != fileSize)
-		ctx->pImpl->logAndThrow(LogMsgType::FileIoError, "File size is too big");
+	std::streamoff fileSize = f.tellg();
+	// Only a limit on 32-bit hosts, larger files can still be streamed
+	if (fileSize < 0 || (uint64_t)(size_t)fileSize != (uint64_t)fileSize)
+		ctx->pImpl->logAndThrow(LogMsgType::FileIoError, "File size is too big to load into memory");
 
 	f.seekg(0, std::ios::beg);
 	if (f.fail())
@@ -82,57 +136,92 @@ void DfuFile::loadFile(std::string filename)
 	impl.read();
 }
 
-void DfuFile::loadStdIn()
+void DfuFile::loadStdIn(LoadMode mode)
 {
 	reset();
 
 #if defined(_WIN32) || defined(_WIN64)
 	_setmode( _fileno( stdin ), _O_BINARY );
 #endif
-	size_t read_bytes;
-	std::array<uint8_t, 65536> tmp;
-	while ((read_bytes = std::fread(tmp.data(), sizeof(uint8_t), tmp.size(), stdin)))
+	if (mode == LoadMode::Map)
+		ctx->pImpl->logAndThrow(LogMsgType::InvalidOptions, "stdin cannot be memory mapped");
+
+	auto reader = std::make_shared<DfuStreamReader>(this, std::make_shared<PipeChunkSource>(stdin, STDIN_CHUNK_SIZE));
+	reader->start();
+	if (mode == LoadMode::Stream)
 	{
-		size.total += read_bytes;
-		data.reserve(size.total);
-		std::copy(data.begin(), data.end(), std::back_inserter(data));
+		// Data is read as it is downloaded
+		stream = reader;
+		return;
 	}
+
+	const uint8_t *chunk;
+	size_t chunkLength;
+	while ((chunk = reader->next(STDIN_CHUNK_SIZE, &chunkLength)) && chunkLength)
+		data.insert(data.end(), chunk, chunk + chunkLength);
+	const uint8_t *suffix = reader->getSuffix(&chunkLength);
+	data.insert(data.end(), suffix, suffix + chunkLength);
+
 	if (ctx->pImpl->shouldLog(LogLevel::Verbose))
-		ctx->pImpl->logf(LogLevel::Verbose, "Read %" PRIu32 " bytes from stdin", size.total);
+		ctx->pImpl->logf(LogLevel::Verbose, "Read %" PRIu64 " bytes from stdin", size.total);
+}
 
-	DfuFileReader impl(this);
-	impl.read();
+void DfuFile::updateFile(std::string filename, bool writeSuffix, bool writePrefix)
+{
+	if (isStreaming())
+		throw Error(LogMsgType::InvalidOptions, "A streamed file cannot be stored");
+
+	DfuFileWriter impl(this);
+	if (!impl.update(filename, writeSuffix, writePrefix))
+	{
+		ctx->pImpl->log(LogLevel::Verbose, "Prefix length changed, rewriting whole file");
+		storeFile(filename, writeSuffix, writePrefix);
+		loadFile(filename, mapping ? LoadMode::Map : LoadMode::Copy);
+	}
 }
 
 void DfuFile::storeFile(std::string filename, bool writeSuffix, bool writePrefix)
 {
-	std::ofstream f(filename, std::ios::trunc | std::ios::binary);
-	if (f.fail())
-		throw Error(LogMsgType::FileIoError, "Could not open file " + filename + " for writing");
+	if (isStreaming())
+		throw Error(LogMsgType::InvalidOptions, "A streamed file cannot be stored");
 
+	// The data is written to a temporary file which then replaces the destination, so that the destination is never
+	// left partially written. This also allows a file to be stored over itself while it is memory mapped.
+	AtomicFile f(filename);
 	DfuFileWriter impl(this);
 	impl.write(f, writeSuffix, writePrefix);
-	if (f.fail())
-		throw Error(LogMsgType::FileIoError, "Could not write to file");
+	f.commit();
+}
+
+bool DfuFile::isStreaming() const
+{
+	return (stream != nullptr);
 }
 
-bool DfuFile::hasPrefix()
+const uint8_t *DfuFile::getData() const
+{
+	if (mapping)
+		return mapping->data();
+	return data.data();
+}
+
+bool DfuFile::hasPrefix() const
 {
 	return (size.prefix>0 && prefix_type!=PrefixType::None);
 }
 
-bool DfuFile::hasSuffix()
+bool DfuFile::hasSuffix() const
 {
 	return (size.suffix>0);
 }
 
-void DfuFile::printSuffixAndPrefix(std::ostream &s)
+void DfuFile::printSuffixAndPrefix(std::ostream &s) const
 {
 	if (size.prefix == LMDFU_PREFIX_LENGTH) {
 		printfStream(s, "The file contains a TI Stellaris DFU prefix with the following properties:\n");
 		printfStream(s, "Address:\t0x%08x\n", lmdfu_address);
 	} else if (size.prefix == LPCDFU_PREFIX_LENGTH) {
-		uint8_t * prefix = data.data();
+		const uint8_t *prefix = getData();
 		printfStream(s, "The file contains a NXP unencrypted LPC DFU prefix with the following properties:\n");
 		printfStream(s, "Size:\t%5d kiB\n", prefix[2]>>1|prefix[3]<<7);
 	} else if (size.prefix != 0) {
@@ -144,12 +233,12 @@ void DfuFile::printSuffixAndPrefix(std::ostream &s)
 		printfStream(s, "Product ID:\t0x%04X\n",usbId.product);
 		printfStream(s, "Vendor ID:\t0x%04X\n", usbId.vendor);
 		printfStream(s, "BCD DFU:\t0x%04X\n", bcdDFU);
-		printfStream(s, "Length:\t\t%i\n", size.suffix);
+		printfStream(s, "Length:\t\t%" PRIu64 "\n", size.suffix);
 		printfStream(s, "CRC:\t\t0x%08X\n", dwCRC);
 	}
 }
 
-void DfuFile::provideDefaultSearchId(UsbId *dst)
+void DfuFile::provideDefaultSearchId(UsbId *dst) const
 {
 	/* If dst does not have any vendor or product IDs to use for device matching,
 	 * use any IDs from the file suffix for device matching.
@@ -174,7 +263,7 @@ void DfuFile::provideDefaultSearchId(UsbId *dst)
 	}
 }
 
-UsbId DfuFile::getSearchId()
+UsbId DfuFile::getSearchId() const
 {
 	UsbId result;
 	if (hasSuffix())
@@ -199,11 +288,14 @@ void DfuFileReader::logMissingSuffixReason(const char *reason)
 }
 
 bool DfuFileReader::probePrefix()
+{
+	return probePrefix(f->getData(), f->size.total - f->size.suffix);
+}
+
+bool DfuFileReader::probePrefix(const uint8_t *prefix, size_t maxPrefixSize)
 {
 	f->size.prefix = 0;
-	uint8_t *prefix = f->data.data();
 
-	size_t maxPrefixSize = f->size.total - f->size.suffix;
 	if (LMDFU_PREFIX_LENGTH<=maxPrefixSize && (prefix[0] == 0x01) && (prefix[1] == 0x00))
 	{
 		f->prefix_type = DfuFile::PrefixType::LMDFU;
@@ -223,8 +315,42 @@ bool DfuFileReader::probePrefix()
 bool DfuFileReader::probeSuffix()
 {
 	CRC32 crc;
-	const uint8_t *dfusuffix;
 
+	if (f->size.total < DFU_SUFFIX_LENGTH) {
+		crc.update_u8(f->getData(), f->size.total);
+		f->contentCrc = crc;
+		f->hasContentCrc = true;
+		logMissingSuffixReason("File too short for DFU suffix");
+		return false;
+	}
+
+	// CRC of everything before the (possible) suffix is kept for updateFile
+	uint64_t suffixStart = f->size.total - DFU_SUFFIX_LENGTH;
+	const uint8_t *dfusuffix = f->getData() + suffixStart;
+	if (f->size.total >= PARALLEL_CRC_MIN_SIZE)
+		crc.update_u8_parallel(f->getData(), suffixStart, ctxi()->getThreadPool());
+	else
+		crc.update_u8(f->getData(), suffixStart);
+	CRC32 contentCrc = crc;
+	crc.update_u8(dfusuffix, DFU_SUFFIX_LENGTH - 4);
+
+	bool result = parseSuffix(dfusuffix, crc);
+	if (!result)
+	{
+		contentCrc.update_u8(dfusuffix, DFU_SUFFIX_LENGTH);
+		f->contentCrc = contentCrc;
+		f->hasContentCrc = true;
+	}
+	else if (f->size.suffix == DFU_SUFFIX_LENGTH)
+	{
+		f->contentCrc = contentCrc;
+		f->hasContentCrc = true;
+	}
+	return result;
+}
+
+bool DfuFileReader::parseSuffix(const uint8_t *dfusuffix, uint32_t crc)
+{
 	// TODO: only modify suffix vars if suffix was successfully parsed
 	// TODO: update logging
 
@@ -233,10 +359,6 @@ bool DfuFileReader::probeSuffix()
 		return false;
 	}
 
-	dfusuffix = f->data.data() + f->size.total -
-		DFU_SUFFIX_LENGTH;
-
-
 	// TODO: use memcmp, with DFU_SUFFIX_LENGTH-5-3 as origin
 	if (dfusuffix[10] != 'D' ||
 		dfusuffix[9]  != 'F' ||
@@ -245,7 +367,6 @@ bool DfuFileReader::probeSuffix()
 		return false;
 	}
 
-	crc.update_u8(f->data.data(), f->size.total - 4);
 	f->dwCRC = PackedData::Reader(dfusuffix+12).read_u32l();
 
 	if (f->dwCRC != crc) {
@@ -300,46 +421,45 @@ void DfuFileWriter::crcWrite(const uint8_t *data, size_t n)
 		throw Error(LogMsgType::FileIoError, "Could not write to file");
 }
 
-void DfuFileWriter::writePrefix()
+size_t DfuFileWriter::makePrefix(uint8_t *dfuprefix)
 {
 	if (f->prefix_type == DfuFile::PrefixType::LMDFU) {
-		uint8_t lmdfu_prefix[LMDFU_PREFIX_LENGTH];
 		uint32_t addr = f->lmdfu_address / 1024;
 
 		/* lmdfu_dfu_prefix payload length excludes prefix and suffix */
 		uint32_t len = f->size.total -
 			f->size.prefix - f->size.suffix;
 
-		PackedData::Writer d(lmdfu_prefix, LMDFU_PREFIX_LENGTH);
+		PackedData::Writer d(dfuprefix, LMDFU_PREFIX_LENGTH);
 		d.write_u8(0x01); /* STELLARIS_DFU_PROG */
 		d.write_u8(0x00); /* Reserved */
 		d.write_u16l(addr);
 		d.write_u32l(len);
 
-		crcWrite(lmdfu_prefix, LMDFU_PREFIX_LENGTH);
+		crc.update_u8(dfuprefix, LMDFU_PREFIX_LENGTH);
+		return LMDFU_PREFIX_LENGTH;
 	}
 	if (f->prefix_type == DfuFile::PrefixType::LPCDFU_UNENCRYPTED) {
-		uint8_t lpcdfu_prefix[LPCDFU_PREFIX_LENGTH] = {0};
-
 		/* Payload is firmware and prefix rounded to 512 bytes */
 		uint32_t len = (f->size.total - f->size.suffix + 511) /512;
 
-		PackedData::Writer d(lpcdfu_prefix, LPCDFU_PREFIX_LENGTH);
+		memset(dfuprefix, 0, LPCDFU_PREFIX_LENGTH);
+		PackedData::Writer d(dfuprefix, LPCDFU_PREFIX_LENGTH);
 		d.write_u8(0x1a); /* Unencrypted*/
 		d.write_u8(0x3f); /* Reserved */
 		d.write_u16l(len);
 
 		for (int i = 12; i < LPCDFU_PREFIX_LENGTH; i++)
-			lpcdfu_prefix[i] = 0xff;
+			dfuprefix[i] = 0xff;
 
-		crcWrite(lpcdfu_prefix, LPCDFU_PREFIX_LENGTH);
+		crc.update_u8(dfuprefix, LPCDFU_PREFIX_LENGTH);
+		return LPCDFU_PREFIX_LENGTH;
 	}
+	return 0;
 }
 
-void DfuFileWriter::writeSuffix()
+size_t DfuFileWriter::makeSuffix(uint8_t *dfusuffix)
 {
-	uint8_t dfusuffix[DFU_SUFFIX_LENGTH];
-
 	PackedData::Writer d(dfusuffix, DFU_SUFFIX_LENGTH);
 	d.write_u16l(f->bcdDevice);
 	d.write_u16l(f->usbId.product);
@@ -349,28 +469,166 @@ void DfuFileWriter::writeSuffix()
 	d.write_u8('F');
 	d.write_u8('D');
 	d.write_u8(DFU_SUFFIX_LENGTH);
-	crcWrite(dfusuffix, DFU_SUFFIX_LENGTH - 4);
+	crc.update_u8(dfusuffix, DFU_SUFFIX_LENGTH - 4);
 
 	d.write_u32l(crc);
-	crcWrite(dfusuffix + 12, 4);
+	crc.update_u8(dfusuffix + 12, 4);
+	return DFU_SUFFIX_LENGTH;
+}
+
+// Writes data at offset in an existing file. If newSize is not 0, the file is then truncated or extended to newSize.
+// The file must have the size expectedSize.
+static void patchFile(const std::string &filename, uint64_t expectedSize,
+	const std::vector<std::pair<uint64_t, AtomicFile::Buffer>> &patches, uint64_t newSize)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	int fd = _open(filename.c_str(), _O_RDWR | _O_BINARY);
+	if (fd < 0)
+		throw Error(LogMsgType::FileIoError, "Could not open file " + filename + " for writing");
+	struct _stat64 st;
+	bool ok = (_fstat64(fd, &st) == 0);
+	if (ok && (uint64_t)st.st_size != expectedSize)
+	{
+		_close(fd);
+		throw Error(LogMsgType::FileIoError, "File " + filename + " has changed since it was loaded");
+	}
+	for (const auto &p : patches)
+	{
+		ok = ok && (_lseeki64(fd, p.first, SEEK_SET) == (__int64)p.first);
+		ok = ok && (_write(fd, p.second.data, p.second.length) == (int)p.second.length);
+	}
+	if (ok && newSize != expectedSize)
+		ok = (_chsize_s(fd, newSize) == 0);
+	ok = ok && (_commit(fd) == 0);
+	_close(fd);
+#else
+	int fd = open(filename.c_str(), O_RDWR);
+	if (fd < 0)
+		throw Error(LogMsgType::FileIoError, "Could not open file " + filename + " for writing");
+	struct stat st;
+	bool ok = (fstat(fd, &st) == 0);
+	if (ok && (uint64_t)st.st_size != expectedSize)
+	{
+		close(fd);
+		throw Error(LogMsgType::FileIoError, "File " + filename + " has changed since it was loaded");
+	}
+	for (const auto &p : patches)
+		ok = ok && (pwrite(fd, p.second.data, p.second.length, p.first) == (ssize_t)p.second.length);
+	if (ok && newSize != expectedSize)
+		ok = (ftruncate(fd, newSize) == 0);
+	ok = ok && (fsync(fd) == 0);
+	close(fd);
+#endif
+	if (!ok)
+		throw Error(LogMsgType::FileIoError, "Could not write to file");
+}
+
+bool DfuFileWriter::update(const std::string &filename, bool shouldWriteSuffix, bool shouldWritePrefix)
+{
+	if (!f->hasContentCrc)
+		return false;
+
+	uint8_t dfuprefix[LPCDFU_PREFIX_LENGTH];
+	uint8_t dfusuffix[DFU_SUFFIX_LENGTH];
+	crc = 0xFFFFFFFF;
+	size_t prefixLength = shouldWritePrefix ? makePrefix(dfuprefix) : 0;
+	if (prefixLength != f->size.prefix)
+		return false;
+
+	// Replace the old prefix at the start of the cached CRC with the new one
+	uint64_t payloadLength = f->size.getPayload();
+	CRC32 oldPrefixCrc;
+	oldPrefixCrc.update_u8(f->getData(), f->size.prefix);
+	uint32_t payloadCrc = f->contentCrc ^ CRC32::combine(oldPrefixCrc, 0, payloadLength);
+	crc = CRC32::combine(crc, payloadCrc, payloadLength);
+	uint32_t newContentCrc = crc;
+	size_t suffixLength = shouldWriteSuffix ? makeSuffix(dfusuffix) : 0;
+
+	std::vector<std::pair<uint64_t, AtomicFile::Buffer>> patches;
+	if (prefixLength && memcmp(dfuprefix, f->getData(), prefixLength) != 0)
+		patches.push_back({0, {dfuprefix, prefixLength}});
+	if (suffixLength)
+		patches.push_back({prefixLength + payloadLength, {dfusuffix, suffixLength}});
+	uint64_t newTotal = prefixLength + payloadLength + suffixLength;
+	patchFile(filename, f->size.total, patches, newTotal);
+
+	// Update this object to match the file
+	if (f->mapping)
+	{
+		f->mapping = nullptr;
+		f->mapping = std::make_shared<MappedFile>(f->ctx->pImpl, filename);
+	}
+	else
+	{
+		std::copy(dfuprefix, dfuprefix + prefixLength, f->data.begin());
+		f->data.resize(prefixLength + payloadLength);
+		f->data.insert(f->data.end(), dfusuffix, dfusuffix + suffixLength);
+	}
+	f->size.total = newTotal;
+	f->size.suffix = suffixLength;
+	if (suffixLength)
+	{
+		f->dwCRC = PackedData::Reader(dfusuffix + 12).read_u32l();
+	}
+	else
+	{
+		/* same values as loading a file without a suffix */
+		f->dwCRC = 0xFFFFFFFF;
+		f->bcdDFU = 0;
+		f->usbId.clear();
+		f->bcdDevice = 0xFFFF;
+	}
+	f->contentCrc = newContentCrc;
+	return true;
 }
 
 void DfuFileWriter::write(std::ostream &dst_, bool shouldWriteSuffix, bool shouldWritePrefix)
 {
 	dst = &dst_;
 	crc = 0xFFFFFFFF;
+	uint8_t buf[std::max(LPCDFU_PREFIX_LENGTH, DFU_SUFFIX_LENGTH)];
 
 	if (shouldWritePrefix) {
-		writePrefix();
+		size_t length = makePrefix(buf);
+		dst->write(reinterpret_cast<const char*>(buf), length);
 	}
 
 	/* write firmware binary */
-	crcWrite(f->data.data() + f->size.prefix,
-	    f->size.total - f->size.prefix - f->size.suffix);
+	crcWrite(f->getData() + f->size.prefix, f->size.getPayload());
 
 	if (shouldWriteSuffix) {
-		writeSuffix();
+		makeSuffix(buf);
+		dst->write(reinterpret_cast<const char*>(buf), DFU_SUFFIX_LENGTH);
 	}
+	if (!dst->good())
+		throw Error(LogMsgType::FileIoError, "Could not write to file");
+}
+
+void DfuFileWriter::write(AtomicFile &dst_, bool shouldWriteSuffix, bool shouldWritePrefix)
+{
+	crc = 0xFFFFFFFF;
+	uint8_t dfuprefix[LPCDFU_PREFIX_LENGTH];
+	uint8_t dfusuffix[DFU_SUFFIX_LENGTH];
+	const uint8_t *payload = f->getData() + f->size.prefix;
+	uint64_t payloadLength = f->size.getPayload();
+
+	// Prefix is written along with the first chunk, and the suffix along with the last
+	AtomicFile::Buffer bufs[3];
+	size_t bufCount = 0;
+	if (shouldWritePrefix)
+		bufs[bufCount++] = {dfuprefix, makePrefix(dfuprefix)};
+
+	uint64_t pos = 0;
+	do {
+		size_t n = static_cast<size_t>(std::min<uint64_t>(STORE_CHUNK_SIZE, payloadLength - pos));
+		crc.update_u8(payload + pos, n);
+		bufs[bufCount++] = {payload + pos, n};
+		pos += n;
+		if (pos == payloadLength && shouldWriteSuffix)
+			bufs[bufCount++] = {dfusuffix, makeSuffix(dfusuffix)};
+		dst_.writev(bufs, bufCount);
+		bufCount = 0;
+	} while (pos < payloadLength);
 }
 
 }
@@ -3,9 +3,20 @@
 
 #include "libFirmwareUpdate++/dfu.hpp"
 #include "CRC32.hpp"
+#include "ChunkSource.hpp"
+#include "AtomicFile.hpp"
 #include <cstdint>
 #include <cstdlib>
 #include <iosfwd>
+#include <memory>
+#include <vector>
+
+#define DFU_SUFFIX_LENGTH 16
+#define LMDFU_PREFIX_LENGTH 8
+#define LPCDFU_PREFIX_LENGTH 16
+#define STDIN_CHUNK_SIZE 65536
+/* Size of the chunks which are checksummed and then written when storing a file */
+#define STORE_CHUNK_SIZE (1024*1024)
 
 
 namespace FwUpd
@@ -28,8 +39,80 @@ public:
 	DfuFileReader(DfuFile *f);
 
 	void read();
+
+	// Checks for a known prefix at the start of the file, maxPrefixSize is the number of bytes which may belong to a prefix
+	bool probePrefix(const uint8_t *prefix, size_t maxPrefixSize);
+	// Checks and parses a suffix. f->size.total must already be set.
+	// dfusuffix points to the last DFU_SUFFIX_LENGTH bytes of the file, crc is the CRC of the file excluding its last 4 bytes.
+	bool parseSuffix(const uint8_t *dfusuffix, uint32_t crc);
+};
+
+/*
+ * Class to read a DfuFile incrementally from a stream, without needing to hold the whole file in memory.
+ * The last DFU_SUFFIX_LENGTH bytes are always held back, so that the suffix can be identified once the end
+ * of the stream is reached, and the suffix CRC is updated as data is read.
+ * next() only returns file data (including the prefix, if any), never the suffix.
+ */
+class DfuStreamReader : public ChunkSource
+{
+protected:
+	DfuFile *f;
+	std::shared_ptr<ChunkSource> src;
+	std::vector<uint8_t> buf;
+	size_t head = 0, tail = 0;// unread data is buf[head..tail)
+	bool srcEof = false;
+	bool finished = false;
+	size_t suffixLength = 0;
+	CRC32 crc;// CRC of all data returned so far
+	uint64_t bytesReturned = 0;
+	uint64_t expectedSize = unknownSize;
+
+	size_t buffered() const
+	{
+		return tail - head;
+	}
+	// Reads from src until at least n bytes are buffered or the end of the stream is reached
+	void fill(size_t n);
+	// Called at the end of the stream to parse the suffix (if any) and fill in the file size
+	void finish();
+
+public:
+	// src provides the raw bytes of the file, including any suffix
+	DfuStreamReader(DfuFile *f, std::shared_ptr<ChunkSource> src);
+
+	// Detects the file prefix (if any). Must be called before next().
+	void start();
+	// Returns file data, excluding the suffix. Once *got is 0, the suffix fields of the DfuFile are valid.
+	const uint8_t *next(size_t n, size_t *got) override;
+	uint64_t position() const override
+	{
+		return bytesReturned;
+	}
+	// Exact once the end of the file has been reached, otherwise the size passed to setExpectedSize
+	uint64_t size() const override;
+	// Sets the size of the file data (excluding the suffix) if it is known in advance, e.g. from the file size
+	void setExpectedSize(uint64_t size)
+	{
+		expectedSize = size;
+	}
+	// Returns the held back suffix bytes, once next() has reached the end of the file data
+	const uint8_t *getSuffix(size_t *length) const;
+	bool isFinished() const
+	{
+		return finished;
+	}
 };
 
+/*
+ * Returns a source for the data to be downloaded from a file: the data from the start of the file (or the end of the
+ * prefix, if skipPrefix is true) to the start of the suffix.
+ * Resident files give a MemoryChunkSource which keeps the file alive. Streamed files give the file's stream,
+ * and can therefore only be read once.
+ */
+std::shared_ptr<ChunkSource> DfuFile_openSource(std::shared_ptr<DfuFile> file, bool skipPrefix);
+// As DfuFile_openSource, for an image which can be read by any number of sources at once
+std::shared_ptr<ChunkSource> FirmwareImage_openSource(std::shared_ptr<const FirmwareImage> image, bool skipPrefix);
+
 /*
  * Class to write the contents of a DfuFile object to a stream.
  *   Firmware data: always written
@@ -44,14 +127,20 @@ protected:
 	CRC32 crc;
 
 	void crcWrite(const uint8_t *data, size_t n);
-	void writePrefix();
-	void writeSuffix();
+	// Fill in the prefix or suffix and update crc, returning the length (0 if the file has no known prefix type)
+	size_t makePrefix(uint8_t *dfuprefix);
+	size_t makeSuffix(uint8_t *dfusuffix);
 
 public:
 	DfuFileWriter(DfuFile *f) : f(f)
 	{}
 
 	void write(std::ostream &dst_, bool shouldWriteSuffix, bool shouldWritePrefix);
+	// Single pass over the data: each chunk is checksummed just before it is written, while it is still in cache
+	void write(AtomicFile &dst_, bool shouldWriteSuffix, bool shouldWritePrefix);
+	// Writes only the prefix and suffix into the existing file, using the cached content CRC instead of reading the payload.
+	// Returns false without changing anything if this is not possible (prefix length changes, or no cached CRC).
+	bool update(const std::string &filename, bool shouldWriteSuffix, bool shouldWritePrefix);
 };
 
 }
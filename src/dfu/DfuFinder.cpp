@@ -1,6 +1,13 @@
 #include "libFirmwareUpdate++/dfu.hpp"
 #include "DfuFinderImpl.hpp"
 #include "ContextImpl.hpp"
+#include "UsbEventThread.hpp"
+
+#include <chrono>
+
+/* Interval for looking for devices if libusb cannot report arrivals, or in case an arrival was missed */
+#define RESCAN_INTERVAL_MS 50
+#define HOTPLUG_RESCAN_INTERVAL_MS 250
 
 namespace FwUpd
 {
@@ -17,6 +24,36 @@ DfuFinder::Results DfuFinder::find()
 	return dst;
 }
 
+DfuFinder::Results DfuFinder::waitFor(uint32_t timeoutMs)
+{
+	using Clock = std::chrono::steady_clock;
+	Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+	UsbEventThread &events = ctx->pImpl->getUsbEventThread();
+	bool hotplug = events.watchArrivals();
+
+	Results dst;
+	DfuFinderImpl impl;
+	impl.ctxi = ctx->pImpl;
+	impl.usbctx = ctx->pImpl->getLibUsbCtx();
+	impl.f = this;
+	impl.results = &dst;
+	// A device which has only just appeared may not be accessible yet, that is only reported by the final search
+	impl.openErrorLevel = LogLevel::Verbose;
+	while (1)
+	{
+		uint64_t seen = events.arrivalCount();
+		impl.find();
+		if (!dst.empty())
+			return dst;
+		Clock::time_point now = Clock::now();
+		if (now >= deadline)
+			break;
+		Clock::time_point rescan = now + std::chrono::milliseconds(hotplug ? HOTPLUG_RESCAN_INTERVAL_MS : RESCAN_INTERVAL_MS);
+		events.waitForArrival(seen, std::min(rescan, deadline));
+	}
+	return find();
+}
+
 DfuFinder::DfuFinder(std::shared_ptr<Context> ctx) : ctx(ctx)
 {
 	reset();
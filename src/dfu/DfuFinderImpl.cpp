@@ -27,11 +27,13 @@ void DfuFinderImpl::find()
 		struct libusb_device_descriptor desc;
 		struct libusb_device *dev = list[i];
 
-		if (f->match_path!="" && get_path(dev) != f->match_path)
+		std::string path = get_path(dev);
+		// Paths in the format older versions printed are still accepted
+		if (f->match_path!="" && path != f->match_path && get_path(dev, true) != f->match_path)
 			continue;
 		if (libusb_get_device_descriptor(dev, &desc))
 			continue;
-		probe_configuration(dev, &desc);
+		probe_configuration(dev, &desc, path);
 	}
 	libusb_free_device_list(list, 0);
 }
@@ -70,7 +72,7 @@ int DfuFinderImpl::find_descriptor(const uint8_t *desc_list, int list_len, uint8
 
 }
 
-void DfuFinderImpl::probe_configuration(libusb_device *dev, libusb_device_descriptor *desc)
+void DfuFinderImpl::probe_configuration(libusb_device *dev, libusb_device_descriptor *desc, const std::string &path)
 {
 	UsbDfuFuncDescriptor func_dfu;
 	libusb_device_handle *devh;
@@ -226,7 +228,7 @@ found_dfu:
 					// Failure to open the device on Windows may mean that the correct driver (i.e. something libusb can use) has not been selected/installed
 					logFmtStr += " \nPlease check that you have installed the correct driver.";
 #endif
-					ctxi->logf(LogLevel::Warn, logFmtStr.data(), desc->idVendor, desc->idProduct);
+					ctxi->logf(openErrorLevel, logFmtStr.data(), desc->idVendor, desc->idProduct);
 					break;
 				}
 				if (intf->iInterface != 0)
@@ -272,6 +274,7 @@ found_dfu:
 				pdfu->altsetting = intf->bAlternateSetting;
 				pdfu->devnum = libusb_get_device_address(dev);
 				pdfu->busnum = libusb_get_bus_number(dev);
+				pdfu->path = path;
 				pdfu->alt_name = alt_name;
 				pdfu->serial_name = serial_name;
 				if (dfu_mode)
@@ -289,22 +292,21 @@ found_dfu:
 	}
 }
 
-std::string DfuFinderImpl::get_path(libusb_device *dev)
+std::string DfuFinderImpl::get_path(libusb_device *dev, bool legacy)
 {
 	std::ostringstream ss;
 	uint8_t path[8];
 	int portCount = libusb_get_port_numbers(dev, path, sizeof(path));
 	if (portCount > 0)
 	{
+		// Same format as dfu-util, e.g. "1-2.3"
 		ss << static_cast<int>(libusb_get_bus_number(dev));
 		ss << "-";
 		ss << static_cast<int>(path[0]);
-		for (int j=0; j<portCount; j++)
+		for (int j=legacy ? 0 : 1; j<portCount; j++)
 		{
-			if (j==0)
-				ss << "-";
-			else
-				ss << ".";
+			// Older versions repeated the first port, e.g. "1-2-2.3"
+			ss << (legacy && j==0 ? "-" : ".");
 			ss << static_cast<int>(path[j]);
 		}
 	}
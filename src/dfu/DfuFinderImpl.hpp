@@ -14,15 +14,17 @@ public:
 	libusb_context *usbctx;
 	DfuFinder *f;
 	DfuFinder::Results *results;
+	// Level for failures to open a matching device, which are expected while a device is still enumerating
+	LogLevel openErrorLevel = LogLevel::Warn;
 
 	void find();
 protected:
 	int find_descriptor(const uint8_t *desc_list, int list_len,
 		uint8_t desc_type, void *res_buf, int res_size);
-	void probe_configuration(libusb_device *dev, libusb_device_descriptor *desc);
+	void probe_configuration(libusb_device *dev, libusb_device_descriptor *desc, const std::string &path);
 public:
 	// TODO: move elsewhere?
-	static std::string get_path(libusb_device *dev);
+	static std::string get_path(libusb_device *dev, bool legacy = false);
 
 };
 
@@ -24,12 +24,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <array>
+
 #include <libusb.h>
 
 #include "libFirmwareUpdate++/dfu/DfuInterface.hpp"
 #include "quirks.hpp"
 #include "PackedData.hpp"
 #include "ContextImpl.hpp"
+#include "UsbEventThread.hpp"
 #include "usb_dfu.hpp"
 
 static int dfu_timeout = 5000;  /* 5 seconds - default */
@@ -168,34 +171,43 @@ int DfuInterface::detach(uint16_t timeout)
 	return dfuXferOut(DFU_DETACH, timeout, nullptr, 0);
 }
 
+static void initStatus(dfu_status *status)
+{
+	status->bStatus       = DFU_STATUS_ERROR_UNKNOWN;
+	status->bwPollTimeout = 0;
+	status->bState        = STATE_DFU_ERROR;
+	status->iString       = 0;
+}
+
+static void parseStatus(dfu_status *status, const unsigned char *buffer, uint16_t quirks)
+{
+	PackedData::Reader d(buffer, 6);
+	status->bStatus = d.read_u8();
+	if (quirks & QUIRK_POLLTIMEOUT)
+	{
+		status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
+		d.skip(3);
+	}
+	else
+	{
+		status->bwPollTimeout = d.read_u24l();
+	}
+	status->bState  = d.read_u8();
+	status->iString = d.read_u8();
+}
+
 int DfuInterface::getStatus(dfu_status *status)
 {
 	unsigned char buffer[6];
 	int result;
 
 	/* Initialize the status data structure */
-	status->bStatus       = DFU_STATUS_ERROR_UNKNOWN;
-	status->bwPollTimeout = 0;
-	status->bState        = STATE_DFU_ERROR;
-	status->iString       = 0;
+	initStatus(status);
 
 	result = dfuXferIn(DFU_GETSTATUS, 0, buffer, 6);
 
-	if( 6 == result ) {
-		PackedData::Reader d(buffer, 6);
-		status->bStatus = d.read_u8();
-		if (quirks & QUIRK_POLLTIMEOUT)
-		{
-			status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
-			d.skip(3);
-		}
-		else
-		{
-			status->bwPollTimeout = d.read_u24l();
-		}
-		status->bState  = d.read_u8();
-		status->iString = d.read_u8();
-	}
+	if( 6 == result )
+		parseStatus(status, buffer, quirks);
 
 	return result;
 }
@@ -225,6 +237,43 @@ int DfuInterface::abort()
 	return dfuXferOut(DFU_ABORT, 0, nullptr, 0);
 }
 
+int DfuInterface::dfuXferInAsync(uint8_t bRequest, uint16_t wValue, unsigned char *data, uint16_t wLength, XferCallback cb)
+{
+	return ctx->pImpl->getUsbEventThread().submitControl(dev_handle,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+		bRequest, wValue, interface, data, wLength, dfu_timeout, std::move(cb));
+}
+
+int DfuInterface::dfuXferOutAsync(uint8_t bRequest, uint16_t wValue, const unsigned char *data, uint16_t wLength, XferCallback cb)
+{
+	// OUT data is copied by submitControl, so it is never written to
+	return ctx->pImpl->getUsbEventThread().submitControl(dev_handle,
+		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+		bRequest, wValue, interface, const_cast<unsigned char*>(data), wLength, dfu_timeout, std::move(cb));
+}
+
+int DfuInterface::downloadAsync(uint16_t blockNum, const unsigned char *data, uint16_t length, XferCallback cb)
+{
+	return dfuXferOutAsync(DFU_DNLOAD, blockNum, data, length, std::move(cb));
+}
+
+int DfuInterface::getStatusAsync(dfu_status *status, XferCallback cb)
+{
+	initStatus(status);
+	auto buffer = std::make_shared<std::array<unsigned char, 6>>();
+	uint16_t q = quirks;
+	return dfuXferInAsync(DFU_GETSTATUS, 0, buffer->data(), 6, [status, buffer, q, cb](int result) {
+		if (result == 6)
+			parseStatus(status, buffer->data(), q);
+		cb(result);
+	});
+}
+
+int DfuInterface::abortAsync(XferCallback cb)
+{
+	return dfuXferOutAsync(DFU_ABORT, 0, nullptr, 0, std::move(cb));
+}
+
 void DfuInterface::openDevice()
 {
 	if (isOpen)
@@ -0,0 +1,145 @@
+#include "DfuFile.hpp"
+#include "ContextImpl.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace FwUpd
+{
+
+DfuStreamReader::DfuStreamReader(DfuFile *f, std::shared_ptr<ChunkSource> src) : f(f), src(src)
+{
+	buf.resize(STDIN_CHUNK_SIZE + DFU_SUFFIX_LENGTH);
+}
+
+void DfuStreamReader::fill(size_t n)
+{
+	if (buffered() >= n || srcEof)
+		return;
+
+	// Move unread data to the start of the buffer, and make sure there is space for n bytes
+	if (head)
+	{
+		std::memmove(buf.data(), buf.data() + head, buffered());
+		tail -= head;
+		head = 0;
+	}
+	if (buf.size() < n)
+		buf.resize(n);
+
+	try {
+		while (tail < n && !srcEof)
+		{
+			size_t requested = buf.size() - tail;
+			size_t ret;
+			const uint8_t *chunk = src->next(requested, &ret);
+			std::memcpy(buf.data() + tail, chunk, ret);
+			tail += ret;
+			// Sources only return fewer bytes than requested at the end of the data
+			if (ret < requested)
+				srcEof = true;
+		}
+	} catch (Error &e) {
+		f->ctx->pImpl->logAndThrow(e.msgType, e.what());
+	}
+}
+
+void DfuStreamReader::finish()
+{
+	finished = true;
+	f->size.total = bytesReturned + buffered();
+	if (buffered() < DFU_SUFFIX_LENGTH)
+	{
+		// File too short for a suffix, let the reader log why
+		DfuFileReader(f).parseSuffix(nullptr, 0);
+	}
+	else
+	{
+		// CRC covers everything except the last 4 bytes
+		CRC32 suffixCrc = crc;
+		suffixCrc.update_u8(buf.data() + head, buffered() - 4);
+		const uint8_t *dfusuffix = buf.data() + tail - DFU_SUFFIX_LENGTH;
+		if (DfuFileReader(f).parseSuffix(dfusuffix, suffixCrc))
+		{
+			if (f->size.suffix != DFU_SUFFIX_LENGTH)
+				f->ctx->pImpl->logAndThrow(LogMsgType::FileFormatError, "DFU suffix longer than 16 bytes is not supported when streaming");
+			suffixLength = DFU_SUFFIX_LENGTH;
+		}
+	}
+
+	// CRC of everything before the suffix, kept for updateFile
+	CRC32 contentCrc = crc;
+	contentCrc.update_u8(buf.data() + head, buffered() - suffixLength);
+	f->contentCrc = contentCrc;
+	f->hasContentCrc = true;
+}
+
+void DfuStreamReader::start()
+{
+	fill(LPCDFU_PREFIX_LENGTH + DFU_SUFFIX_LENGTH);
+	size_t maxPrefixSize = buffered();
+	if (srcEof)
+		maxPrefixSize = (maxPrefixSize > DFU_SUFFIX_LENGTH) ? maxPrefixSize - DFU_SUFFIX_LENGTH : 0;
+	DfuFileReader(f).probePrefix(buf.data() + head, maxPrefixSize);
+}
+
+const uint8_t *DfuStreamReader::next(size_t n, size_t *got)
+{
+	fill(n + DFU_SUFFIX_LENGTH);
+
+	size_t available;
+	if (!srcEof)
+	{
+		available = buffered() - DFU_SUFFIX_LENGTH;
+	}
+	else
+	{
+		if (!finished)
+			finish();
+		available = buffered() - suffixLength;
+	}
+
+	*got = std::min(n, available);
+	const uint8_t *result = buf.data() + head;
+	crc.update_u8(result, *got);
+	head += *got;
+	bytesReturned += *got;
+	return result;
+}
+
+uint64_t DfuStreamReader::size() const
+{
+	if (finished)
+		return f->size.total - suffixLength;
+	return expectedSize;
+}
+
+const uint8_t *DfuStreamReader::getSuffix(size_t *length) const
+{
+	*length = finished ? suffixLength : 0;
+	return buf.data() + tail - *length;
+}
+
+
+std::shared_ptr<ChunkSource> DfuFile_openSource(std::shared_ptr<DfuFile> file, bool skipPrefix)
+{
+	uint64_t start = skipPrefix ? file->size.prefix : 0;
+	if (file->isStreaming())
+	{
+		if (file->stream->position() > start)
+			file->ctx->pImpl->logAndThrow("Streamed file has already been read");
+		// Discard the prefix
+		while (file->stream->position() < start)
+		{
+			size_t got;
+			file->stream->next(start - file->stream->position(), &got);
+			if (!got)
+				break;
+		}
+		return file->stream;
+	}
+	uint64_t length = file->size.total - file->size.suffix - start;
+	return std::make_shared<MemoryChunkSource>(file->getData() + start, length, file);
+}
+
+}
@@ -0,0 +1,314 @@
+#include "DownloadSession.hpp"
+#include "libFirmwareUpdate++/dfu/DeviceIdentity.hpp"
+#include "ContextImpl.hpp"
+#include "dfu/usb_dfu.hpp"
+#include "Util.hpp"
+#include "dfuse/DfuseController.hpp"
+#include "dfu/DfuFile.hpp"
+#include "dfu/RuntimeDetach.hpp"
+#include <libusb.h>
+
+#include <chrono>
+
+namespace FwUpd
+{
+
+const DfuFile &DownloadSession::getFile() const
+{
+	return d.image ? d.image->getFile() : *d.file;
+}
+
+void DownloadSession::waitForFile()
+{
+	if (!preparedFile.valid())
+		return;
+	d.ctx->pImpl->log(LogLevel::Verbose, "Waiting for file to be loaded");
+	dfuseImage = preparedFile.get();
+}
+
+void DownloadSession::checkFileLoadFinished()
+{
+	if (preparedFile.valid() && preparedFile.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		waitForFile();
+}
+
+void DownloadSession::checkFileId()
+{
+	UsbId fileId = d.plan ? d.plan->getSearchId() : getFile().getSearchId();
+	if (!runtime_usbId.matchesSearch(fileId) && !dif->usbId.matchesSearch(fileId))
+	{
+		const UsbId &suffixId = d.plan ? d.plan->getHeader().usbId : getFile().usbId;
+		d.ctx->pImpl->logfAndThrow("Error: File ID %04x:%04x does "
+			"not match device (%04x:%04x or %04x:%04x)",
+			suffixId.vendor, suffixId.product,
+			runtime_usbId.vendor, runtime_usbId.product,
+			dif->usbId.vendor, dif->usbId.product);
+	}
+}
+
+void DownloadSession::open()
+{
+	if (d.fileLoader && d.file && !d.plan)
+	{
+		// Not run on the context thread pool, since the loader may use the pool for checksumming
+		preparedFile = std::async(std::launch::async, [this]() {
+			std::shared_ptr<Dfuse::Image> parsed;
+			d.fileLoader(*d.file);
+			if (!d.file->isStreaming() && (d.forceDfuse || d.file->bcdDFU == 0x11a))
+			{
+				parsed = std::make_shared<Dfuse::Image>();
+				parsed->parse(d.ctx->pImpl, d.file->getData() + d.file->size.prefix, d.file->size.getPayload());
+			}
+			return std::shared_ptr<const Dfuse::Image>(parsed);
+		});
+	}
+	if (d.image)
+		dfuseImage = d.image->getDfuseImage();
+
+	// IDs from the file suffix are used for any IDs which were not specified
+	if (!(d.probe.match_usbId.hasVendor() && d.probe.match_usbId.hasProduct()))
+		waitForFile();
+	if (d.plan)
+		d.probe.match_usbId.defaultsFrom(d.plan->getSearchId());
+	else if (!preparedFile.valid())
+		getFile().provideDefaultSearchId(&d.probe.match_usbId);
+
+	struct dfu_status status;
+
+	int dfuse_device = 0;
+
+	d.ctx->pImpl->progress(0, "Searching USB devices");
+
+	d.probe.matchDfuOnly = false;
+	FwUpd::DfuFinder::Results dfuDevices = d.probe.find();
+	if (!dfuDevices.size()) {
+		d.ctx->pImpl->logAndThrow(LogMsgType::MatchError_NoMatches, "No matching DFU capable USB device found");
+	} else if (dfuDevices.size()>1) {
+		/* We cannot safely support more than one DFU capable device
+		 * with same vendor/product ID, since during DFU we need to do
+		 * a USB bus reset, after which the target device will get a
+		 * new address */
+		d.ctx->pImpl->logAndThrow(LogMsgType::MatchError_TooManyMatches, "More than one matching DFU capable USB device found! Try disconnecting all but one device");
+	}
+
+
+	/* We have exactly one device. */
+	dif = dfuDevices[0];
+
+	d.ctx->pImpl->log(LogLevel::Info, "Opening "+d.ctx->pImpl->getProductName());
+	dif->openDevice();
+
+	d.ctx->pImpl->logf(LogLevel::Info, "ID %04x:%04x", dif->usbId.vendor, dif->usbId.product);
+
+	d.ctx->pImpl->logf(LogLevel::Info, "Run-time device DFU version %04x",
+		   dif->func_dfu.bcdDFUVersion);
+
+	/* Transition from run-Time mode to DFU mode */
+	if (!(dif->flags & DFU_IFF_DFU)) {
+		runtime_usbId = dif->usbId;
+
+		/* Avoids detaching the device if the file has already failed to load */
+		if (!DfuInterface_runtimeDetach(*dif, [this]() { checkFileLoadFinished(); }))
+			goto dfustate;
+
+		/* the device gets a new address, so remember how to recognise it after re-enumeration */
+		DeviceIdentity identity = DeviceIdentity::fromInterface(*dif);
+		identity.dfuUsbId = d.probe.match_usbId_dfu;
+
+		/* keeping handles open might prevent re-enumeration */
+		dif = nullptr;
+		dfuDevices.clear();
+
+		d.probe.matchDfuOnly = true;
+		/* The DFU mode device normally appears on the same port, so only that needs to be searched while waiting */
+		FwUpd::DfuFinder::Results candidates;
+		if (d.probe.match_path.empty() && !identity.path.empty()) {
+			d.probe.match_path = identity.path;
+			candidates = d.probe.waitFor(d.reenumerateTimeoutMs);
+			d.probe.match_path = "";
+			dfuDevices = identity.select(candidates);
+			if (!dfuDevices.size()) {
+				candidates = d.probe.find();
+				dfuDevices = identity.select(candidates);
+			}
+		} else {
+			candidates = d.probe.waitFor(d.reenumerateTimeoutMs);
+			dfuDevices = identity.select(candidates);
+		}
+
+		if (!dfuDevices.size()) {
+			if (candidates.size()>1)
+				d.ctx->pImpl->logAndThrow(LogMsgType::MatchError_TooManyMatches, "More than one matching DFU capable USB device found! Try disconnecting all but one device");
+			d.ctx->pImpl->logAndThrow("Lost device after RESET?");
+		} else if (dfuDevices.size()>1) {
+			d.ctx->pImpl->logAndThrow(LogMsgType::MatchError_TooManyMatches, "More than one matching DFU capable USB device found! Try disconnecting all but one device");
+		}
+
+		dif = dfuDevices[0];
+
+		/* Check for DFU mode device */
+		if (!(dif->flags | DFU_IFF_DFU))
+			d.ctx->pImpl->logAndThrow("Device is not in DFU mode");
+
+		d.ctx->pImpl->log(LogLevel::Info, "Opening DFU USB Device...");
+		dif->openDevice();
+	} else {
+		/* we're already in DFU mode, so we can skip the detach/reset
+		 * procedure */
+		/* If a match vendor/product was specified, use that as the runtime
+		 * vendor/product, otherwise use the DFU mode vendor/product */
+		runtime_usbId = d.probe.match_usbId;
+		runtime_usbId.defaultsFrom(dif->usbId);
+	}
+
+dfustate:
+#if 0
+	d.ctx->pImpl->logf(LogLevel::Info, "Setting Configuration %u...", dif->configuration);
+	if (libusb_set_configuration(dif->dev_handle, dif->configuration) < 0) {
+		d.ctx->pImpl->logAndThrow("Cannot set configuration");
+	}
+#endif
+	d.ctx->pImpl->log(LogLevel::Info, "Claiming USB DFU Interface...");
+	dif->claimInterface();
+
+	d.ctx->pImpl->logf(LogLevel::Info, "Setting Alternate Setting #%d ...", dif->altsetting);
+	if (libusb_set_interface_alt_setting(dif->dev_handle, dif->interface, dif->altsetting) < 0) {
+		d.ctx->pImpl->logAndThrow("Cannot set alternate interface");
+	}
+
+status_again:
+	d.ctx->pImpl->log(LogLevel::Info, "Determining device status: ");
+	if (dif->getStatus(&status ) < 0) {
+		d.ctx->pImpl->logAndThrow("error get_status");
+	}
+	d.ctx->pImpl->logf(LogLevel::Info, "state = %s, status = %d",
+		   dfu_state_to_string(status.bState), status.bStatus);
+
+	milliSleep(status.bwPollTimeout);
+
+	switch (status.bState) {
+	case DFU_STATE_appIDLE:
+	case DFU_STATE_appDETACH:
+		d.ctx->pImpl->logAndThrow("Device still in Runtime Mode!");
+		break;
+	case DFU_STATE_dfuERROR:
+		d.ctx->pImpl->log(LogLevel::Info, "dfuERROR, clearing status\n");
+		if (dif->clearStatus() < 0) {
+			d.ctx->pImpl->logAndThrow("error clear_status");
+		}
+		goto status_again;
+		break;
+	case DFU_STATE_dfuDNLOAD_IDLE:
+	case DFU_STATE_dfuUPLOAD_IDLE:
+		d.ctx->pImpl->log(LogLevel::Info, "aborting previous incomplete transfer\n");
+		if (dif->abort() < 0) {
+			d.ctx->pImpl->logAndThrow("can't send DFU_ABORT");
+		}
+		goto status_again;
+		break;
+	case DFU_STATE_dfuIDLE:
+		d.ctx->pImpl->log(LogLevel::Info, "dfuIDLE, continuing\n");
+		break;
+	default:
+		break;
+	}
+
+	if (DFU_STATUS_OK != status.bStatus ) {
+		d.ctx->pImpl->logf(LogLevel::Warn, "DFU Status: '%s'\n",
+			dfu_status_to_string(status.bStatus));
+		/* Clear our status & try again. */
+		if (dif->clearStatus() < 0)
+			d.ctx->pImpl->logAndThrow("USB communication error");
+		if (dif->getStatus(&status) < 0)
+			d.ctx->pImpl->logAndThrow("USB communication error");
+		if (DFU_STATUS_OK != status.bStatus)
+			d.ctx->pImpl->logfAndThrow("Status is not OK: %d", status.bStatus);
+
+		milliSleep(status.bwPollTimeout);
+	}
+
+	d.ctx->pImpl->logf(LogLevel::Info, "DFU mode device DFU version %04x\n",
+		   dif->func_dfu.bcdDFUVersion);
+
+	if (dif->func_dfu.bcdDFUVersion == 0x11a)
+		dfuse_device = 1;
+
+	waitForFile();
+	bool streaming = !d.plan && getFile().isStreaming();
+
+	/* When streaming, the suffix is only known once all data has been read,
+	 * so the file ID is checked before the device is told the download is complete */
+	if (!streaming)
+		checkFileId();
+
+	if (d.plan || dfuse_device || d.forceDfuse || getFile().bcdDFU == 0x11a) {
+		DfuseController_download *c = new DfuseController_download(dif);
+		controller.reset(c);
+		c->file = d.file;
+		c->image = d.image;
+		c->dfuseImage = dfuseImage;
+		c->planFile = d.plan;
+		c->opts = d.dfuseOpts;
+		c->pollProfiles = d.pollProfiles;
+	} else {
+		DfuController_download *c = new DfuController_download(dif);
+		controller.reset(c);
+		c->file = d.file;
+		c->image = d.image;
+		c->pollProfiles = d.pollProfiles;
+		if (streaming)
+			c->onDataSent = [this]() { checkFileId(); };
+	}
+}
+
+void DownloadSession::start(std::function<void(std::exception_ptr error)> done)
+{
+	controller->start(std::move(done));
+}
+
+void DownloadSession::download()
+{
+	controller->run();
+}
+
+void DownloadSession::close()
+{
+	if (d.finalReset)
+	{
+		if (dif->detach(1000) < 0) {
+			/* Even if detach failed, just carry on to leave the
+						   device in a known state */
+			d.ctx->pImpl->log(LogLevel::Warn, "can't detach");
+		}
+		d.ctx->pImpl->log(LogLevel::Info, "Resetting USB to switch back to runtime mode");
+		int ret = libusb_reset_device(dif->dev_handle);
+		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
+			d.ctx->pImpl->logAndThrow("error resetting after download");
+		}
+	}
+
+	dif->closeDevice();
+}
+
+void DownloadSession::end(bool success)
+{
+	// What has been learned is still valid if the download fails
+	if (d.pollProfiles)
+	{
+		try {
+			d.pollProfiles->save();
+		} catch (std::exception &e) {
+			d.ctx->pImpl->logf(LogLevel::Warn, "Could not save poll profiles: %s", e.what());
+		}
+	}
+	d.ctx->pImpl->progress(1, success ? "Success" : "Failed");
+}
+
+DownloadSession::DownloadSession(DfuDownloader &d) :
+	d(d)
+{}
+
+DownloadSession::~DownloadSession()
+{}
+
+}
@@ -0,0 +1,57 @@
+#ifndef fwupd_dfu_DownloadSession_h
+#define fwupd_dfu_DownloadSession_h
+
+#include "libFirmwareUpdate++/dfu/DfuDownloader.hpp"
+#include "dfu/DfuController.hpp"
+#include "dfuse/DfuseImage.hpp"
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+
+namespace FwUpd
+{
+
+/*
+ * The steps of DfuDownloader::run() for one device, separated so that FleetDownloader can run the download step of
+ * many devices at once on the shared USB threads, while only opening and closing devices on threads of its own.
+ * open() and close() use synchronous transfers. Each step logs and throws on errors.
+ */
+class DownloadSession
+{
+protected:
+	// Settings, and the context used for logging. The probe is changed while following the device through detach.
+	DfuDownloader &d;
+	std::shared_ptr<const Dfuse::Image> dfuseImage;
+	std::future<std::shared_ptr<const Dfuse::Image>> preparedFile;
+	std::shared_ptr<DfuInterface> dif;
+	UsbId runtime_usbId;
+	std::unique_ptr<DfuController> controller;
+
+	const DfuFile &getFile() const;
+	// Rethrows any error from loading the file
+	void waitForFile();
+	// Rethrows any error from loading the file if it has finished loading
+	void checkFileLoadFinished();
+	void checkFileId();
+
+public:
+	// Finds and opens the device (detaching it if it is in runtime mode) and gets it to dfuIDLE
+	void open();
+	// Starts the download, done is called once it has ended (see DfuController::start)
+	void start(std::function<void(std::exception_ptr error)> done);
+	// Runs the download, waiting for it to end
+	void download();
+	// Resets the device if finalReset is set, then closes it
+	void close();
+	// Saves the poll profiles and reports the final progress
+	void end(bool success);
+
+	DownloadSession(DfuDownloader &d);
+	~DownloadSession();
+};
+
+}
+
+#endif
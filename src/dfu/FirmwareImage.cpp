@@ -0,0 +1,43 @@
+#include "libFirmwareUpdate++/dfu/FirmwareImage.hpp"
+#include "ContextImpl.hpp"
+#include "DfuFile.hpp"
+#include "dfuse/DfuseImage.hpp"
+
+namespace FwUpd
+{
+
+FirmwareImage::FirmwareImage(std::shared_ptr<DfuFile> file) : file(file)
+{}
+
+std::shared_ptr<const FirmwareImage> FirmwareImage::create(std::shared_ptr<DfuFile> file)
+{
+	if (file->isStreaming())
+		file->ctx->pImpl->logAndThrow(LogMsgType::InvalidOptions, "A streamed file cannot be shared between downloads");
+
+	std::shared_ptr<FirmwareImage> result(new FirmwareImage(file));
+	if (file->bcdDFU == 0x11a)
+	{
+		auto image = std::make_shared<Dfuse::Image>();
+		image->parse(file->ctx->pImpl, file->getData() + file->size.prefix, file->size.getPayload());
+		result->dfuseImage = image;
+	}
+	return result;
+}
+
+std::shared_ptr<const FirmwareImage> FirmwareImage::load(std::shared_ptr<Context> ctx, const std::string &filename,
+	DfuFile::LoadMode mode)
+{
+	auto file = std::make_shared<DfuFile>(ctx);
+	file->loadFile(filename, mode);
+	return create(file);
+}
+
+std::shared_ptr<ChunkSource> FirmwareImage_openSource(std::shared_ptr<const FirmwareImage> image, bool skipPrefix)
+{
+	const DfuFile &file = image->getFile();
+	uint64_t start = skipPrefix ? file.size.prefix : 0;
+	uint64_t length = file.size.total - file.size.suffix - start;
+	return std::make_shared<MemoryChunkSource>(file.getData() + start, length, image);
+}
+
+}
@@ -0,0 +1,255 @@
+#include "libFirmwareUpdate++/dfu/FlashPlanFile.hpp"
+#include "AtomicFile.hpp"
+#include "ContextImpl.hpp"
+#include "CRC32.hpp"
+#include "MappedFile.hpp"
+#include "PackedData.hpp"
+#include "dfu/DfuFile.hpp"
+#include "dfuse/DfuseImage.hpp"
+#include "dfuse/FlashPlan.hpp"
+#include "dfuse/MemLayout.hpp"
+
+#include <cstring>
+#include <vector>
+
+namespace FwUpd
+{
+
+namespace
+{
+
+const char planMagic[8] = {'F', 'W', 'U', 'P', 'P', 'L', 'A', 'N'};
+const size_t headerSize = 64;
+// Offset of the CRC of the header and tables, which is the last header field
+const size_t metaCrcOffset = 60;
+const size_t segmentRecordSize = 16;
+const size_t opRecordSize = 24;
+const uint64_t payloadAlign = 4096;
+
+uint32_t crc32(const uint8_t *data, size_t length, uint32_t val = 0xffffffff)
+{
+	CRC32 crc(val);
+	crc.update_u8(data, length);
+	return crc;
+}
+
+uint64_t alignUp(uint64_t x, uint64_t align)
+{
+	return (x + align - 1) / align * align;
+}
+
+void write_u64l(PackedData::Writer &w, uint64_t x)
+{
+	w.write_u32l(static_cast<uint32_t>(x));
+	w.write_u32l(static_cast<uint32_t>(x >> 32));
+}
+
+uint64_t read_u64l(PackedData::Reader &r)
+{
+	uint64_t lo = r.read_u32l();
+	uint64_t hi = r.read_u32l();
+	return lo | (hi << 32);
+}
+
+}
+
+FlashPlanFile::FlashPlanFile()
+{}
+
+void FlashPlanFile::compile(std::shared_ptr<const FirmwareImage> image, const std::string &layoutDesc,
+	uint8_t alternateSetting, uint32_t transferSize, const DfuseOptions &opts, const std::string &filename)
+{
+	const DfuFile &file = image->getFile();
+	ContextImpl *ctxi = file.ctx->pImpl;
+	std::shared_ptr<const Dfuse::Image> dfuseImage = image->getDfuseImage();
+	if (!dfuseImage)
+		ctxi->logAndThrow(LogMsgType::FileFormatError, "Only DfuSe images can be planned in advance");
+	if (!transferSize || transferSize > 0xffff)
+		ctxi->logfAndThrow(LogMsgType::InvalidOptions, "Invalid transfer size %u", transferSize);
+
+	Dfuse::MemLayout layout;
+	if (!layout.parseDesc(ctxi, layoutDesc))
+		ctxi->logAndThrow(LogMsgType::InvalidOptions, "Failed to parse memory layout");
+
+	const uint8_t *data = file.getData() + file.size.prefix;
+	Dfuse::FlashPlanner planner(*dfuseImage, layout, opts);
+	planner.alternateSetting = alternateSetting;
+	planner.transferSize = transferSize;
+	planner.blockAddressing = true;
+	planner.data = data;
+	Dfuse::FlashPlan plan = planner.compile(ctxi);
+
+	// Write data is laid out in plan order, each chunk starting at a multiple of the transfer size
+	std::vector<AtomicFile::Buffer> payloadBufs;
+	uint64_t payloadSize = 0;
+	CRC32 payloadCrc;
+	const std::vector<uint8_t> padding(transferSize, 0xff);
+	for (Dfuse::FlashOp &op : plan.ops)
+	{
+		if (op.type != Dfuse::FlashOp::Type::Write)
+			continue;
+		const uint8_t *chunk = data + op.offset;
+		op.offset = payloadSize;
+		uint64_t padded = alignUp(op.size, transferSize);
+		payloadBufs.push_back({chunk, op.size});
+		payloadBufs.push_back({padding.data(), static_cast<size_t>(padded - op.size)});
+		op.crc = crc32(chunk, op.size);
+		payloadCrc.update_u8(chunk, op.size);
+		payloadCrc.update_u8(padding.data(), padded - op.size);
+		payloadSize += padded;
+	}
+
+	size_t tablesSize = layout.segments.size() * segmentRecordSize + plan.ops.size() * opRecordSize;
+	uint64_t payloadOffset = alignUp(headerSize + tablesSize, payloadAlign);
+	std::vector<uint8_t> meta(payloadOffset, 0);
+	PackedData::Writer w(meta.data(), meta.size());
+	for (char c : planMagic)
+		w.write_u8(c);
+	w.write_u16l(formatVersion);
+	w.write_u16l(headerSize);
+	w.write_u16l(file.usbId.vendor);
+	w.write_u16l(file.usbId.product);
+	w.write_u16l(file.bcdDevice);
+	w.write_u8(alternateSetting);
+	w.write_u8(0);
+	w.write_u32l(transferSize);
+	w.write_u32l(crc32(reinterpret_cast<const uint8_t*>(layoutDesc.data()), layoutDesc.size()));
+	w.write_u32l(crc32(file.getData(), file.size.total));
+	w.write_u32l(layout.segments.size());
+	w.write_u32l(plan.ops.size());
+	write_u64l(w, payloadOffset);
+	write_u64l(w, payloadSize);
+	w.write_u32l(payloadCrc);
+	w.skip(4);
+
+	for (const Dfuse::MemSegment &seg : layout.segments)
+	{
+		w.write_u32l(seg.firstAddr);
+		w.write_u32l(seg.lastAddr);
+		w.write_u32l(seg.pagesize);
+		w.write_u8(seg.memtype);
+		w.skip(3);
+	}
+	for (const Dfuse::FlashOp &op : plan.ops)
+	{
+		w.write_u8(static_cast<uint8_t>(op.type));
+		w.write_u8(0);
+		w.write_u16l(op.block);
+		w.write_u32l(op.address);
+		w.write_u32l(op.size);
+		w.write_u32l(op.crc);
+		write_u64l(w, op.offset);
+	}
+
+	uint32_t metaCrc = crc32(meta.data(), metaCrcOffset);
+	metaCrc = crc32(meta.data() + headerSize, tablesSize, metaCrc);
+	PackedData::Writer crcW(meta.data() + metaCrcOffset, 4);
+	crcW.write_u32l(metaCrc);
+
+	ctxi->logf(LogLevel::Info, "Writing plan with %u operations and %u bytes of data to %s",
+		static_cast<unsigned int>(plan.ops.size()), static_cast<unsigned int>(payloadSize), filename.c_str());
+	AtomicFile out(filename);
+	out.write(meta.data(), meta.size());
+	out.writev(payloadBufs.data(), payloadBufs.size());
+	out.commit();
+}
+
+std::shared_ptr<const FlashPlanFile> FlashPlanFile::load(std::shared_ptr<Context> ctx, const std::string &filename,
+	bool verifyPayload)
+{
+	ContextImpl *ctxi = ctx->pImpl;
+	std::shared_ptr<FlashPlanFile> result(new FlashPlanFile());
+	result->mapping = std::make_shared<MappedFile>(ctxi, filename);
+	const uint8_t *fileData = result->mapping->data();
+	uint64_t fileSize = result->mapping->size();
+
+	if (fileSize < headerSize || std::memcmp(fileData, planMagic, sizeof(planMagic)) != 0)
+		ctxi->logAndThrow(LogMsgType::FileFormatError, filename + " is not a flash plan file");
+	PackedData::Reader r(fileData + sizeof(planMagic), headerSize - sizeof(planMagic));
+	uint16_t version = r.read_u16l();
+	if (version > formatVersion)
+		ctxi->logfAndThrow(LogMsgType::FileFormatError, "Flash plan format version %u is not supported", version);
+	if (r.read_u16l() != headerSize)
+		ctxi->logAndThrow(LogMsgType::FileFormatError, "Invalid flash plan header size");
+
+	Header &header = result->header;
+	header.usbId.vendor = r.read_u16l();
+	header.usbId.product = r.read_u16l();
+	header.bcdDevice = r.read_u16l();
+	header.alternateSetting = r.read_u8();
+	r.skip(1);
+	header.transferSize = r.read_u32l();
+	header.layoutCrc = r.read_u32l();
+	header.imageCrc = r.read_u32l();
+	uint32_t segmentCount = r.read_u32l();
+	uint32_t opCount = r.read_u32l();
+	uint64_t payloadOffset = read_u64l(r);
+	header.payloadSize = read_u64l(r);
+	header.payloadCrc = r.read_u32l();
+	uint32_t metaCrc = r.read_u32l();
+
+	uint64_t tablesSize = static_cast<uint64_t>(segmentCount) * segmentRecordSize +
+		static_cast<uint64_t>(opCount) * opRecordSize;
+	if (payloadOffset < headerSize + tablesSize || payloadOffset > fileSize ||
+		header.payloadSize > fileSize - payloadOffset)
+		ctxi->logAndThrow(LogMsgType::FileFormatError, "Flash plan file is truncated");
+	uint32_t crc = crc32(fileData, metaCrcOffset);
+	if (crc32(fileData + headerSize, tablesSize, crc) != metaCrc)
+		ctxi->logAndThrow(LogMsgType::FileFormatError, "Flash plan file is corrupt");
+	result->payload = fileData + payloadOffset;
+	if (verifyPayload && crc32(result->payload, header.payloadSize) != header.payloadCrc)
+		ctxi->logAndThrow(LogMsgType::FileFormatError, "Flash plan data is corrupt");
+
+	PackedData::Reader tables(fileData + headerSize, tablesSize);
+	auto layout = std::make_shared<Dfuse::MemLayout>();
+	layout->segments.resize(segmentCount);
+	for (Dfuse::MemSegment &seg : layout->segments)
+	{
+		seg.firstAddr = tables.read_u32l();
+		seg.lastAddr = tables.read_u32l();
+		seg.pagesize = tables.read_u32l();
+		seg.memtype = tables.read_u8();
+		tables.skip(3);
+	}
+	layout->normalize();
+
+	auto plan = std::make_shared<Dfuse::FlashPlan>();
+	plan->ops.resize(opCount);
+	for (Dfuse::FlashOp &op : plan->ops)
+	{
+		uint8_t type = tables.read_u8();
+		if (type > static_cast<uint8_t>(Dfuse::FlashOp::Type::Leave))
+			ctxi->logfAndThrow(LogMsgType::FileFormatError, "Unknown flash plan operation %u", type);
+		op.type = static_cast<Dfuse::FlashOp::Type>(type);
+		tables.skip(1);
+		op.block = tables.read_u16l();
+		op.address = tables.read_u32l();
+		op.size = tables.read_u32l();
+		op.crc = tables.read_u32l();
+		op.offset = read_u64l(tables);
+		if (op.type == Dfuse::FlashOp::Type::Write &&
+			(op.size > header.transferSize || op.size > header.payloadSize ||
+			op.offset > header.payloadSize - op.size))
+			ctxi->logAndThrow(LogMsgType::FileFormatError, "Flash plan write is outside the plan data");
+	}
+	result->layout = layout;
+	result->plan = plan;
+	return result;
+}
+
+UsbId FlashPlanFile::getSearchId() const
+{
+	UsbId result;
+	if (header.usbId.vendor != 0xFFFF)
+		result.vendor = header.usbId.vendor;
+	if (header.usbId.product != 0xFFFF)
+		result.product = header.usbId.product;
+	return result;
+}
+
+bool FlashPlanFile::matchesLayout(const std::string &layoutDesc) const
+{
+	return crc32(reinterpret_cast<const uint8_t*>(layoutDesc.data()), layoutDesc.size()) == header.layoutCrc;
+}
+
+}
@@ -0,0 +1,300 @@
+#include "libFirmwareUpdate++/dfu/FleetDownloader.hpp"
+#include "libFirmwareUpdate++/dfu/DfuDownloader.hpp"
+#include "ContextImpl.hpp"
+#include "usb_dfu.hpp"
+#include "RuntimeDetach.hpp"
+#include "DownloadSession.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+
+/* Threads opening and closing devices. Each mostly waits for the device, but more than a few would contend for the bus. */
+#define SETUP_THREADS 4
+/* How often detached devices are searched for while they re-enumerate */
+#define REENUMERATE_RESCAN_INTERVAL_MS 50
+
+namespace FwUpd
+{
+
+std::vector<FleetDownloader::DeviceResult> FleetDownloader::run()
+{
+	ContextImpl *ctxi = ctx->pImpl;
+	std::vector<DeviceResult> results;
+	if (!probe.match_path.empty())
+	{
+		ctxi->log(LogLevel::Error, LogMsgType::InvalidOptions, "A path to match cannot be used when downloading to several devices");
+		return results;
+	}
+
+	ctxi->progress(0, "Searching USB devices");
+	DfuFinder search = probe;
+	search.matchDfuOnly = false;
+	if (plan)
+		search.match_usbId.defaultsFrom(plan->getSearchId());
+	else
+		image->getFile().provideDefaultSearchId(&search.match_usbId);
+
+	// The finder returns an interface for each matching alternate setting, so devices are grouped by path
+	// Serial numbers are matched separately for devices in runtime and DFU mode
+	// Runtime mode interfaces are kept for detaching ahead of the download
+	std::vector<std::shared_ptr<DfuInterface>> runtimeInterfaces;
+	{
+		std::map<std::string, std::pair<DeviceResult, std::shared_ptr<DfuInterface>>> devices;
+		for (const std::shared_ptr<DfuInterface> &dif : search.find())
+		{
+			const std::string &path = dif->path;
+			if (path.empty())
+			{
+				ctxi->logf(LogLevel::Warn, "Skipping device %04x:%04x, its port path is not known",
+					dif->usbId.vendor, dif->usbId.product);
+				continue;
+			}
+			if (devices.count(path))
+				continue;
+			DeviceResult &r = devices[path].first;
+			r.path = path;
+			r.usbId = dif->usbId;
+			if (dif->serial_name != "UNKNOWN")
+				r.serial = dif->serial_name;
+			if (!(dif->flags & DFU_IFF_DFU))
+				devices[path].second = dif;
+		}
+		for (auto &d : devices)
+		{
+			results.push_back(std::move(d.second.first));
+			runtimeInterfaces.push_back(std::move(d.second.second));
+		}
+	}
+	if (results.empty())
+	{
+		ctxi->log(LogLevel::Error, LogMsgType::MatchError_NoMatches, "No matching DFU capable USB device found");
+		ctxi->progress(1, "Failed");
+		return results;
+	}
+	ctxi->logf(LogLevel::Info, "Downloading to %u devices", static_cast<unsigned int>(results.size()));
+
+	std::vector<bool> wasRuntime;
+	for (const auto &dif : runtimeInterfaces)
+		wasRuntime.push_back(dif != nullptr);
+
+	std::mutex mtx;
+	std::vector<float> progress(results.size(), 0);
+	std::vector<std::shared_ptr<Context>> deviceContexts;
+	for (size_t index=0; index<results.size(); index++)
+	{
+		DeviceResult &r = results[index];
+		auto deviceCtx = std::make_shared<Context>();
+		// Only the log and progress are per device
+		deviceCtx->pImpl->shareUsb(*ctxi);
+		deviceCtx->setMinLogLevel(ctx->getMinLogLevel());
+		deviceCtx->setProductName(ctx->getProductName());
+		deviceCtx->setLogHandler([&](const LogMsg &msg) {
+			r.log.push_back(msg);
+			if (msg.level == LogLevel::Error)
+				r.error = msg.txt;
+			if (deviceLogHandler)
+				deviceLogHandler(r.path, msg);
+			else
+				ctxi->log(msg.level, msg.type, "[" + r.path + "] " + msg.txt);
+		});
+		deviceCtx->setProgressHandler([&, index](float x, std::string desc) {
+			if (deviceProgressHandler)
+				deviceProgressHandler(r.path, x, desc);
+			std::lock_guard<std::mutex> lk(mtx);
+			progress[index] = x;
+			float total = 0;
+			for (float p : progress)
+				total += p;
+			ctxi->progress(total / progress.size(), "Downloading");
+		});
+		deviceContexts.push_back(deviceCtx);
+	}
+
+	// Settings for each device, and the steps of its download
+	std::vector<std::unique_ptr<DfuDownloader>> downloaders;
+	std::vector<std::unique_ptr<DownloadSession>> sessions;
+	for (size_t index=0; index<results.size(); index++)
+	{
+		DeviceResult &r = results[index];
+		const std::shared_ptr<Context> &deviceCtx = deviceContexts[index];
+		DfuDownloader *d = new DfuDownloader(deviceCtx, image);
+		downloaders.emplace_back(d);
+		d->plan = plan;
+		d->probe = probe;
+		d->probe.ctx = deviceCtx;
+		d->probe.match_path = r.path;
+		if (!r.serial.empty())
+		{
+			if (wasRuntime[index])
+				d->probe.match_serial = r.serial;
+			else
+				d->probe.match_serial_dfu = r.serial;
+		}
+		d->forceDfuse = forceDfuse;
+		d->finalReset = finalReset;
+		d->dfuseOpts = dfuseOpts;
+		d->pollProfiles = pollProfiles;
+		d->reenumerateTimeoutMs = reenumerateTimeoutMs;
+		sessions.emplace_back(new DownloadSession(*d));
+	}
+
+	// Sends the detach request (and reset) to a runtime mode device. Returns false if it was not detached.
+	// Failures are only logged: the downloader starts from whatever mode the device ends up in.
+	auto detach = [&](size_t index) {
+		ContextImpl *deviceCtxi = deviceContexts[index]->pImpl;
+		std::shared_ptr<DfuInterface> dif = std::move(runtimeInterfaces[index]);
+		deviceCtxi->log(LogLevel::Info, "Sending DFU detach request ahead of download");
+		try
+		{
+			dif->openDevice();
+			if (DfuInterface_runtimeDetach(*dif))
+				return true;
+		}
+		catch (const Error &)
+		{
+		}
+		dif->closeDevice();
+		return false;
+	};
+
+	// Devices are downloaded to in the order they become ready. Without detachAhead, that is the order they were
+	// found in. Otherwise devices already in DFU mode go first, while the others are detached and re-enumerate.
+	std::deque<size_t> ready;
+	// Detached devices, with the time to stop waiting for them to reappear in DFU mode
+	std::map<size_t, std::chrono::steady_clock::time_point> reenumerating;
+	std::condition_variable readyCv;
+	size_t active = 0;
+	size_t finished = 0;
+	size_t slots = results.size();
+	if (maxParallel)
+		slots = std::min(slots, maxParallel);
+
+	auto deviceDone = [&](size_t index, bool success) {
+		sessions[index]->end(success);
+		results[index].success = success;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			active--;
+			finished++;
+		}
+		readyCv.notify_all();
+	};
+
+	// Opening a device (which can include detaching it and waiting for it to re-enumerate) and closing it use
+	// synchronous transfers, so they run on a few threads of the fleet's own. The downloads in between run on the
+	// USB event thread and poll scheduler shared by all devices.
+	ThreadPool setupPool(std::min<size_t>(slots, SETUP_THREADS));
+	auto flash = [&](size_t index) {
+		try
+		{
+			sessions[index]->open();
+		}
+		catch (...)
+		{
+			deviceDone(index, false);
+			return;
+		}
+		sessions[index]->start([&, index](std::exception_ptr error) {
+			// Called on a USB thread, which must not make synchronous transfers
+			setupPool.submit([&, index, error]() {
+				bool success = !error;
+				if (success)
+				{
+					try
+					{
+						sessions[index]->close();
+					}
+					catch (...)
+					{
+						success = false;
+					}
+				}
+				deviceDone(index, success);
+			});
+		});
+	};
+
+	for (size_t index=0; index<results.size(); index++)
+	{
+		if (!detachAhead || !wasRuntime[index])
+		{
+			ready.push_back(index);
+			continue;
+		}
+		setupPool.submit([&, index]() {
+			bool detached = detach(index);
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				if (detached)
+					reenumerating[index] = std::chrono::steady_clock::now() + std::chrono::milliseconds(reenumerateTimeoutMs);
+				else
+					ready.push_back(index);
+			}
+			readyCv.notify_all();
+		});
+	}
+
+	std::unique_lock<std::mutex> lk(mtx);
+	while (finished < results.size())
+	{
+		while (!ready.empty() && active < slots)
+		{
+			size_t index = ready.front();
+			ready.pop_front();
+			active++;
+			setupPool.submit([&, index]() { flash(index); });
+		}
+		if (reenumerating.empty())
+		{
+			readyCv.wait(lk);
+			continue;
+		}
+
+		// One search for all detached devices, instead of each waiting for its own
+		lk.unlock();
+		DfuFinder search = probe;
+		search.matchDfuOnly = true;
+		DfuFinder::Results found = search.find();
+		lk.lock();
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = reenumerating.begin(); it != reenumerating.end();)
+		{
+			const std::string &path = results[it->first].path;
+			bool reappeared = std::any_of(found.begin(), found.end(),
+				[&](const std::shared_ptr<DfuInterface> &dif) { return dif->path == path; });
+			if (!reappeared && now < it->second)
+			{
+				++it;
+				continue;
+			}
+			if (!reappeared)
+				deviceContexts[it->first]->pImpl->log(LogLevel::Warn, "Device did not reappear in DFU mode after detaching");
+			ready.push_back(it->first);
+			it = reenumerating.erase(it);
+		}
+		if (!reenumerating.empty())
+			readyCv.wait_for(lk, std::chrono::milliseconds(REENUMERATE_RESCAN_INTERVAL_MS));
+	}
+	lk.unlock();
+
+	size_t succeeded = std::count_if(results.begin(), results.end(), [](const DeviceResult &r) { return r.success; });
+	ctxi->logf(succeeded == results.size() ? LogLevel::Info : LogLevel::Error, "Downloaded to %u of %u devices",
+		static_cast<unsigned int>(succeeded), static_cast<unsigned int>(results.size()));
+	ctxi->progress(1, succeeded == results.size() ? "Success" : "Failed");
+	return results;
+}
+
+FleetDownloader::FleetDownloader(std::shared_ptr<Context> ctx, std::shared_ptr<const FirmwareImage> image) :
+	ctx(ctx), image(image), probe(ctx)
+{}
+
+FleetDownloader::FleetDownloader(std::shared_ptr<Context> ctx, std::shared_ptr<const FlashPlanFile> plan) :
+	ctx(ctx), plan(plan), probe(ctx)
+{}
+
+}
@@ -0,0 +1,179 @@
+#include "libFirmwareUpdate++/dfu/ImageCache.hpp"
+#include "ContextImpl.hpp"
+#include "CRC32.hpp"
+#include "ThreadPool.hpp"
+
+#include <cstring>
+#include <tuple>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Files larger than this have their content hash calculated on multiple threads */
+#define PARALLEL_HASH_MIN_SIZE (16*1024*1024)
+
+namespace FwUpd
+{
+
+bool ImageCache::FileId::operator<(const FileId &other) const
+{
+	return std::tie(filename, size, mtime, mtimeNsec, inode) <
+		std::tie(other.filename, other.size, other.mtime, other.mtimeNsec, other.inode);
+}
+
+bool ImageCache::getFileId(const std::string &filename, FileId *id)
+{
+	id->filename = filename;
+#if defined(_WIN32) || defined(_WIN64)
+	struct _stat64 st;
+	if (_stat64(filename.c_str(), &st) != 0)
+		return false;
+	id->mtimeNsec = 0;
+	id->inode = 0;
+#else
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+#if defined(__APPLE__)
+	id->mtimeNsec = st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+	id->mtimeNsec = st.st_mtim.tv_nsec;
+#else
+	id->mtimeNsec = 0;
+#endif
+	id->inode = st.st_ino;
+#endif
+	id->size = st.st_size;
+	id->mtime = st.st_mtime;
+	return true;
+}
+
+ImageCache::ImageCache(std::shared_ptr<Context> ctx, uint64_t maxBytes) :
+	ctx(ctx), maxBytes(maxBytes)
+{}
+
+void ImageCache::remove(std::list<Entry>::iterator it)
+{
+	const FirmwareImage *image = it->image.get();
+	if (--imageRefs[image] == 0)
+	{
+		imageRefs.erase(image);
+		stats.bytesCached -= image->getFile().size.total;
+	}
+	index.erase(it->id);
+	entries.erase(it);
+	stats.entries = entries.size();
+}
+
+void ImageCache::evict()
+{
+	while (stats.bytesCached > maxBytes && !entries.empty())
+	{
+		remove(std::prev(entries.end()));
+		stats.evictions++;
+	}
+}
+
+std::shared_ptr<const FirmwareImage> ImageCache::load(const std::string &filename)
+{
+	FileId id;
+	bool haveId = getFileId(filename, &id);
+	if (haveId)
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		auto it = index.find(id);
+		if (it != index.end())
+		{
+			entries.splice(entries.begin(), entries, it->second);
+			stats.hits++;
+			stats.bytesSaved += id.size;
+			return it->second->image;
+		}
+	}
+
+	// Loading is done without holding the lock, so that other files can be looked up in the meantime
+	std::shared_ptr<const FirmwareImage> image = FirmwareImage::load(ctx, filename, DfuFile::LoadMode::Copy);
+	const DfuFile &file = image->getFile();
+
+	// Don't cache the file if it changed while it was being loaded
+	FileId idAfter;
+	if (!haveId || !getFileId(filename, &idAfter) || idAfter < id || id < idAfter || file.size.total != id.size)
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		stats.misses++;
+		return image;
+	}
+
+	CRC32 crc;
+	if (file.size.total >= PARALLEL_HASH_MIN_SIZE)
+		crc.update_u8_parallel(file.getData(), file.size.total, ctx->pImpl->getThreadPool());
+	else
+		crc.update_u8(file.getData(), file.size.total);
+
+	std::lock_guard<std::mutex> lk(mtx);
+	stats.misses++;
+	if (file.size.total > maxBytes)
+		return image;
+
+	// Another thread may have loaded the same file in the meantime
+	auto it = index.find(id);
+	if (it != index.end())
+		return it->second->image;
+
+	// Older versions of the file are no longer useful
+	for (auto e = entries.begin(); e != entries.end();)
+	{
+		auto curr = e++;
+		if (curr->id.filename == filename)
+			remove(curr);
+	}
+
+	for (const Entry &e : entries)
+	{
+		const DfuFile &other = e.image->getFile();
+		if (e.contentCrc == crc && other.size.total == file.size.total &&
+			std::memcmp(other.getData(), file.getData(), file.size.total) == 0)
+		{
+			image = e.image;
+			stats.contentMatches++;
+			break;
+		}
+	}
+
+	Entry entry;
+	entry.id = id;
+	entry.contentCrc = crc;
+	entry.image = image;
+	entries.push_front(entry);
+	index[id] = entries.begin();
+	if (imageRefs[image.get()]++ == 0)
+		stats.bytesCached += file.size.total;
+	stats.entries = entries.size();
+	evict();
+	return image;
+}
+
+void ImageCache::clear()
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	entries.clear();
+	index.clear();
+	imageRefs.clear();
+	stats.bytesCached = 0;
+	stats.entries = 0;
+}
+
+void ImageCache::setMaxBytes(uint64_t x)
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	maxBytes = x;
+	evict();
+}
+
+ImageCache::Stats ImageCache::getStats() const
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	return stats;
+}
+
+}
@@ -0,0 +1,175 @@
+#include "libFirmwareUpdate++/dfu/PollProfiles.hpp"
+#include "ContextImpl.hpp"
+#include "AtomicFile.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+/* Fewer samples than this are not enough to rely on */
+#define MIN_SAMPLES 3
+/* Counts are halved once there are more samples than this, so that profiles follow changes in device behaviour */
+#define MAX_SAMPLES 32
+/* Fraction of previous operations which should have finished when the device is first polled */
+#define POLL_QUANTILE 0.8
+
+#define FILE_HEADER "# libFirmwareUpdate++ poll profiles v1"
+
+namespace FwUpd
+{
+
+static const char *operationNames[] = {
+	"ChunkWrite",
+	"PageErase",
+	"MassErase",
+	"SetAddress",
+	"Manifest",
+};
+
+int PollProfiles::bucketFor(uint32_t ms)
+{
+	if (ms <= 1)
+		return 0;
+	int bucket = static_cast<int>(std::floor(4*std::log2(static_cast<double>(ms))));
+	return std::min(bucket, bucketCount-1);
+}
+
+uint32_t PollProfiles::bucketStart(int bucket)
+{
+	return static_cast<uint32_t>(std::ceil(std::pow(2.0, bucket/4.0)));
+}
+
+PollProfiles::PollProfiles(std::shared_ptr<Context> ctx, std::string filename) :
+	ctx(ctx), filename(filename)
+{
+	if (filename.empty())
+		return;
+	std::ifstream in(filename);
+	if (!in)
+		return;
+
+	std::string line;
+	int lineNum = 0;
+	while (std::getline(in, line))
+	{
+		lineNum++;
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		// vendor:product:bcdDevice operation bucket:count...
+		std::istringstream ls(line);
+		std::string id, opName;
+		unsigned int vendor, product, bcdDevice;
+		ls >> id >> opName;
+		int op = 0;
+		while (op < static_cast<int>(Operation::Count) && opName != operationNames[op])
+			op++;
+		if (std::sscanf(id.c_str(), "%x:%x:%x", &vendor, &product, &bcdDevice) != 3 ||
+			op == static_cast<int>(Operation::Count))
+		{
+			ctx->pImpl->logf(LogLevel::Warn, "Ignoring invalid line %d in poll profile file %s",
+				lineNum, filename.c_str());
+			continue;
+		}
+
+		Histogram h;
+		std::string entry;
+		while (ls >> entry)
+		{
+			int bucket;
+			unsigned int count;
+			if (std::sscanf(entry.c_str(), "%d:%u", &bucket, &count) == 2 && bucket >= 0 && bucket < bucketCount)
+			{
+				h.counts[bucket] += count;
+				h.total += count;
+			}
+		}
+		profiles[Key(vendor, product, bcdDevice, static_cast<Operation>(op))] = h;
+	}
+}
+
+bool PollProfiles::estimate(const UsbId &usbId, uint16_t bcdDevice, Operation op, uint32_t *ms) const
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	auto it = profiles.find(Key(usbId.vendor, usbId.product, bcdDevice, op));
+	if (it == profiles.end() || it->second.total < MIN_SAMPLES)
+		return false;
+
+	const Histogram &h = it->second;
+	uint32_t needed = static_cast<uint32_t>(std::ceil(h.total * POLL_QUANTILE));
+	uint32_t sum = 0;
+	int bucket = 0;
+	for (; bucket < bucketCount-1; bucket++)
+	{
+		sum += h.counts[bucket];
+		if (sum >= needed)
+			break;
+	}
+	// End of the bucket, so that the operations in it have finished
+	*ms = bucketStart(bucket+1);
+	return true;
+}
+
+void PollProfiles::record(const UsbId &usbId, uint16_t bcdDevice, Operation op, uint32_t busyMs, bool doneAtFirstPoll)
+{
+	int bucket = bucketFor(busyMs);
+	// The device may have finished well before it was polled, which was at the end of a bucket. Counting the sample
+	// two buckets lower lets the estimate come down until polls start finding the device still busy.
+	if (doneAtFirstPoll)
+		bucket = std::max(bucket-2, 0);
+
+	std::lock_guard<std::mutex> lk(mtx);
+	Histogram &h = profiles[Key(usbId.vendor, usbId.product, bcdDevice, op)];
+	h.counts[bucket]++;
+	h.total++;
+	if (h.total > MAX_SAMPLES)
+	{
+		h.total = 0;
+		for (uint32_t &c : h.counts)
+		{
+			c /= 2;
+			h.total += c;
+		}
+	}
+	modified = true;
+}
+
+void PollProfiles::save()
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	if (filename.empty() || !modified)
+		return;
+
+	std::ostringstream out;
+	out << FILE_HEADER << "\n";
+	for (const auto &p : profiles)
+	{
+		char id[32];
+		std::snprintf(id, sizeof(id), "%04x:%04x:%04x", std::get<0>(p.first) & 0xFFFF, std::get<1>(p.first) & 0xFFFF,
+			std::get<2>(p.first));
+		out << id << " " << operationNames[static_cast<int>(std::get<3>(p.first))];
+		for (int i=0; i<bucketCount; i++)
+		{
+			if (p.second.counts[i])
+				out << " " << i << ":" << p.second.counts[i];
+		}
+		out << "\n";
+	}
+
+	std::string data = out.str();
+	AtomicFile f(filename);
+	f.write(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+	f.commit();
+	modified = false;
+}
+
+void PollProfiles::clear()
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	profiles.clear();
+	modified = true;
+}
+
+}
@@ -0,0 +1,78 @@
+#include "RuntimeDetach.hpp"
+#include "ContextImpl.hpp"
+#include "usb_dfu.hpp"
+#include "Util.hpp"
+#include <libusb.h>
+
+namespace FwUpd
+{
+
+bool DfuInterface_runtimeDetach(DfuInterface &dif, const std::function<void()> &beforeDetach)
+{
+	ContextImpl *ctxi = dif.ctx->pImpl;
+	struct dfu_status status;
+	int err;
+
+	/* In runtime mode, there can only be one DFU Interface descriptor according to the DFU Spec. */
+	/* FIXME: check if the selected device really has only one */
+	ctxi->log(LogLevel::Info, "Claiming USB DFU Runtime Interface...");
+	dif.claimInterface();
+
+	if (libusb_set_interface_alt_setting(dif.dev_handle, dif.interface, 0) < 0) {
+		ctxi->logAndThrow("Cannot set alt interface zero");
+	}
+
+	ctxi->log(LogLevel::Info, "Determining device status: ");
+
+	err = dif.getStatus(&status);
+	if (err == LIBUSB_ERROR_PIPE) {
+		ctxi->log(LogLevel::Info, "Device does not implement get_status, assuming appIDLE");
+		status.bStatus = DFU_STATUS_OK;
+		status.bwPollTimeout = 0;
+		status.bState  = DFU_STATE_appIDLE;
+		status.iString = 0;
+	} else if (err < 0) {
+		ctxi->logAndThrow("error get_status");
+	} else {
+		ctxi->logf(LogLevel::Info, "state = %s, status = %d\n",
+			   dfu_state_to_string(status.bState), status.bStatus);
+	}
+	milliSleep(status.bwPollTimeout);
+
+	switch (status.bState) {
+	case DFU_STATE_appIDLE:
+	case DFU_STATE_appDETACH:
+		if (beforeDetach)
+			beforeDetach();
+		ctxi->logf(LogLevel::Info, "Device really in Runtime Mode, sending DFU "
+			   "detach request...");
+		if (dif.detach(1000) < 0) {
+			ctxi->log(LogLevel::Warn, "error detaching");
+		}
+		if (dif.func_dfu.attr_willDetach()) {
+			ctxi->log(LogLevel::Info, "Device will detach and reattach...");
+		} else {
+			ctxi->log(LogLevel::Info, "Resetting USB...");
+			int ret = libusb_reset_device(dif.dev_handle);
+			if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND)
+				ctxi->logAndThrow("error resetting "
+					"after detach");
+		}
+		break;
+	case DFU_STATE_dfuERROR:
+		ctxi->log(LogLevel::Info, "dfuERROR, clearing status");
+		if (dif.clearStatus() < 0) {
+			ctxi->logAndThrow("error clear_status");
+		}
+		/* fall through */
+	default:
+		ctxi->log(LogLevel::Warn, "WARNING: Runtime device already in DFU state ?!?");
+		dif.releaseInterface();
+		return false;
+	}
+	dif.releaseInterface();
+	dif.closeDevice();
+	return true;
+}
+
+}
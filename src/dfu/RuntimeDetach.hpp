@@ -0,0 +1,24 @@
+#ifndef fwupd_dfu_RuntimeDetach_h
+#define fwupd_dfu_RuntimeDetach_h
+
+#include "libFirmwareUpdate++/dfu/DfuInterface.hpp"
+
+#include <functional>
+
+namespace FwUpd
+{
+
+/*
+ * Switches an open runtime mode interface to DFU mode: claims it, checks its status and, if it really is in appIDLE or
+ * appDETACH, sends DFU_DETACH followed by a USB reset (unless the device detaches by itself). beforeDetach (if set) is
+ * called just before the detach request, and can throw to leave the device alone.
+ * Returns true if the device was detached, in which case it has been closed and will re-enumerate.
+ * Returns false if it turned out to be in a DFU state already (dfuERROR is cleared), in which case it is left open
+ * with the interface released.
+ * Logs and throws on errors.
+ */
+bool DfuInterface_runtimeDetach(DfuInterface &dif, const std::function<void()> &beforeDetach = nullptr);
+
+}
+
+#endif
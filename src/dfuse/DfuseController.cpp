@@ -2,9 +2,13 @@
 #include "ContextImpl.hpp"
 #include "dfu/usb_dfu.hpp"
 #include "PackedData.hpp"
-#include "DfuseFilePart.hpp"
 #include "MemLayout.hpp"
-#include "Util.hpp"
+#include "CRC32.hpp"
+#include "FlashPlan.hpp"
+#include "dfu/DfuFile.hpp"
+
+#include <algorithm>
+#include <cinttypes>
 
 namespace FwUpd
 {
@@ -26,30 +30,23 @@ const char* DfuseCommand_toString(DfuseCommand cmd)
 	}
 }
 
-int DfuseController::specialCommand(unsigned int address, DfuseCommand command)
+void DfuseController::specialCommand(unsigned int address, DfuseCommand command, Step next)
 {
 	unsigned char buf[5];
 	PackedData::Writer bufW(buf, sizeof(buf));
 	int length;
-	int ret;
-	struct dfu_status dst;
-	int firstpoll = 1;
 
 	if (command == DfuseCommand::ErasePage) {
-		int page_size;
-
-		Dfuse::MemSegment *segment = memLayout.findSegment(address);
-		if (!segment || !segment->isEraseable()) {
+		Dfuse::MemPage page;
+		if (!memLayout.pageInfo(address, &page) || !page.isEraseable()) {
 			ctxi()->logfAndThrow("Page at 0x%08x can not be erased",
 				address);
 		}
-		page_size = segment->pagesize;
-		ctxi()->logf(LogLevel::Verbose2, "Erasing page size %i at address 0x%08x, page "
-			       "starting at 0x%08x\n", page_size, address,
-			       address & ~(page_size - 1));
+		ctxi()->logf(LogLevel::Verbose2, "Erasing page size %u at address 0x%08x, page "
+			       "starting at 0x%08x\n", page.size, address,
+			       page.base);
 		bufW.write_u8(0x41);/* Erase command */
 		length = 5;
-		last_erased_page = address & ~(page_size - 1);
 	} else if (command == DfuseCommand::SetAddress) {
 		ctxi()->logf(LogLevel::Verbose3, "Setting address pointer to 0x%08x\n",
 			       address);
@@ -66,44 +63,67 @@ int DfuseController::specialCommand(unsigned int address, DfuseCommand command)
 	}
 	bufW.write_u32l(address);
 
-	ret = req_dnload(length, buf, 0);
-	if (ret < 0) {
-		ctxi()->logfAndThrow("Error during special command \"%s\" download",
-			DfuseCommand_toString(command));
-	}
-	do {
-		ret = dif->getStatus(&dst);
+	addressPointerValid = false;
+	sendDownload(0, buf, length, [this, address, command, next](int ret) {
+		if (ret < 0) {
+			ctxi()->logfAndThrow("Error during special command \"%s\" download",
+				DfuseCommand_toString(command));
+		}
+		poller = BusyPoller(this, command == DfuseCommand::ErasePage ? PollProfiles::Operation::PageErase :
+			command == DfuseCommand::MassErase ? PollProfiles::Operation::MassErase : PollProfiles::Operation::SetAddress);
+		pollCommand(address, command, true, next);
+	});
+}
+
+void DfuseController::pollCommand(unsigned int address, DfuseCommand command, bool firstPoll, Step next)
+{
+	requestStatus([this, address, command, firstPoll, next](int ret) {
 		if (ret < 0) {
 			ctxi()->logfAndThrow("Error during special command \"%s\" get_status",
 			     DfuseCommand_toString(command));
 		}
-		if (firstpoll) {
-			firstpoll = 0;
-			if (dst.bState != DFU_STATE_dfuDNBUSY) {
-				ctxi()->logf(LogLevel::Info, "state(%u) = %s, status(%u) = %s", dst.bState,
-				       dfu_state_to_string(dst.bState), dst.bStatus,
-				       dfu_status_to_string(dst.bStatus));
+		if (firstPoll) {
+			if (status.bState != DFU_STATE_dfuDNBUSY) {
+				ctxi()->logf(LogLevel::Info, "state(%u) = %s, status(%u) = %s", status.bState,
+				       dfu_state_to_string(status.bState), status.bStatus,
+				       dfu_status_to_string(status.bStatus));
 				ctxi()->logfAndThrow("Wrong state after command \"%s\" download",
 				     DfuseCommand_toString(command));
 			}
-			/* STM32F405 lies about mass erase timeout */
-			if (command == DfuseCommand::MassErase && dst.bwPollTimeout == 100) {
-				dst.bwPollTimeout = 35000;
+			/* STM32F405 lies about mass erase timeout (a learned poll profile takes precedence) */
+			if (command == DfuseCommand::MassErase && status.bwPollTimeout == 100) {
+				status.bwPollTimeout = 35000;
 				ctxi()->logf(LogLevel::Info, "Setting timeout to 35 seconds\n");
 			}
 		}
 		/* wait while command is executed */
-		ctxi()->logf(LogLevel::Verbose, "Poll timeout %i ms", dst.bwPollTimeout);
-		milliSleep(dst.bwPollTimeout);
-		if (command == DfuseCommand::ReadUnprotect)
-			return ret;
-	} while (dst.bState == DFU_STATE_dfuDNBUSY);
+		ctxi()->logf(LogLevel::Verbose, "Poll timeout %i ms", status.bwPollTimeout);
+		if (command == DfuseCommand::ReadUnprotect) {
+			after(status.bwPollTimeout, next);
+			return;
+		}
+		if (status.bState == DFU_STATE_dfuDNBUSY) {
+			after(poller.delay(status.bwPollTimeout), [this, address, command, next]() {
+				pollCommand(address, command, false, next);
+			});
+			return;
+		}
 
-	if (dst.bStatus != DFU_STATUS_OK) {
-		ctxi()->logfAndThrow("%s not correctly executed",
-			DfuseCommand_toString(command));
-	}
-	return ret;
+		if (status.bStatus != DFU_STATUS_OK) {
+			ctxi()->logfAndThrow("%s not correctly executed",
+				DfuseCommand_toString(command));
+		}
+		poller.done();
+		if (command == DfuseCommand::ErasePage)
+			erasedPages.add(address);
+		else if (command == DfuseCommand::MassErase)
+			erasedPages.addAll();
+		if (command == DfuseCommand::SetAddress) {
+			addressPointer = address;
+			addressPointerValid = true;
+		}
+		next();
+	});
 }
 
 int DfuseController::req_upload(const unsigned short length, unsigned char *data, unsigned short transaction)
@@ -116,238 +136,293 @@ int DfuseController::req_upload(const unsigned short length, unsigned char *data
 	return status;
 }
 
-int DfuseController::req_dnload(const unsigned short length, unsigned char *data, unsigned short transaction)
+void DfuseController_download::dnload_chunk(const uint8_t *data, int size, int transaction,
+	std::function<void(int bytesSent)> next)
 {
-	int status = dif->download(transaction, data, length);
-	if (status < 0) {
-		ctxi()->logfAndThrow(LogMsgType::UsbIoError, "%s: libusb_control_transfer returned %d",
-			__FUNCTION__, status);
-	}
-	return status;
+	sendDownload(transaction, data, size, [this, size, next](int ret) {
+		if (ret < 0) {
+			ctxi()->logfAndThrow(LogMsgType::UsbIoError, "%s: libusb_control_transfer returned %d",
+				"dnload_chunk", ret);
+		}
+		/* Zero-size requests start manifestation, polling ends before that has finished so there is nothing to learn */
+		poller = BusyPoller(this, PollProfiles::Operation::ChunkWrite);
+		pollChunk(size, ret, next);
+	});
 }
 
-
-
-void DfuseController_download::progress(const uint8_t *dataPos)
+void DfuseController_download::pollChunk(int size, int bytesSent, std::function<void(int bytesSent)> next)
 {
-	// Progress is indicated by read position in the file
-	// It is assumed that dataPos points to somewhere in file->data, not a copy of the data.
-	size_t i = dataPos - (file->data.data()+file->size.prefix);
-	// <10% and >90% reserved for enumeration/reset/other programming tasks
-	float prog = (static_cast<float>(i)/file->size.getPayload()) * 0.9 + 0.05;
-	ctxi()->progress(prog, "Downloading");
+	requestStatus([this, size, bytesSent, next](int ret) {
+		ctxi()->assert_usbXferOk(ret, "Error during download get_status");
+		auto finished = [this, bytesSent, next]() {
+			if (status.bState == DFU_STATE_dfuMANIFEST)
+				ctxi()->log(LogLevel::Info, "Transitioning to dfuMANIFEST state");
+			else if (status.bStatus == DFU_STATUS_OK)
+				poller.done();
+
+			if (status.bStatus != DFU_STATUS_OK) {
+				ctxi()->logf(LogLevel::Warn, "Chunk write failed! state(%u) = %s, status(%u) = %s", status.bState,
+				       dfu_state_to_string(status.bState), status.bStatus,
+				       dfu_status_to_string(status.bStatus));
+				next(-1);
+				return;
+			}
+			next(bytesSent);
+		};
+		/* The next request is not a status poll, so the device's poll timeout does not need to pass first */
+		if (status.bState == DFU_STATE_dfuDNLOAD_IDLE ||
+				status.bState == DFU_STATE_dfuERROR) {
+			finished();
+			return;
+		}
+		uint32_t wait = (size && status.bState == DFU_STATE_dfuDNBUSY) ? poller.delay(status.bwPollTimeout) :
+			status.bwPollTimeout;
+		if (status.bState == DFU_STATE_dfuMANIFEST)
+			after(wait, finished);
+		else
+			after(wait, [this, size, bytesSent, next]() { pollChunk(size, bytesSent, next); });
+	});
 }
 
-int DfuseController_download::dnload_chunk(const uint8_t *data, int size, int transaction)
+Dfuse::FlashTimeModel DfuseController_download::timeModel() const
 {
-	int bytes_sent;
-	struct dfu_status dst;
-
-	bytes_sent = req_dnload(size, size ? const_cast<uint8_t*>(data) : NULL, transaction);
-
-	do {
-		ctxi()->assert_usbXferOk(dif->getStatus(&dst), "Error during download get_status");
-		milliSleep(dst.bwPollTimeout);
-	} while (dst.bState != DFU_STATE_dfuDNLOAD_IDLE &&
-			 dst.bState != DFU_STATE_dfuERROR &&
-		 dst.bState != DFU_STATE_dfuMANIFEST);
-
-	if (dst.bState == DFU_STATE_dfuMANIFEST)
-		ctxi()->log(LogLevel::Info, "Transitioning to dfuMANIFEST state");
-
-	if (dst.bStatus != DFU_STATUS_OK) {
-		ctxi()->logf(LogLevel::Warn, "Chunk write failed! state(%u) = %s, status(%u) = %s", dst.bState,
-		       dfu_state_to_string(dst.bState), dst.bStatus,
-		       dfu_status_to_string(dst.bStatus));
-		return -1;
+	Dfuse::FlashTimeModel model;
+	if (pollProfiles) {
+		/* With mixed sector sizes (e.g. 16K, 64K and 128K), one learned time would be wrong for most pages */
+		if (Dfuse::EraseCostModel::uniformPageSize(memLayout))
+			pollProfiles->estimate(dif->usbId, dif->bcdDevice, PollProfiles::Operation::PageErase, &model.erase.learnedPageMs);
+		pollProfiles->estimate(dif->usbId, dif->bcdDevice, PollProfiles::Operation::MassErase, &model.erase.learnedMassMs);
+		pollProfiles->estimate(dif->usbId, dif->bcdDevice, PollProfiles::Operation::ChunkWrite, &model.learnedWriteMs);
+		pollProfiles->estimate(dif->usbId, dif->bcdDevice, PollProfiles::Operation::SetAddress, &model.learnedSetAddressMs);
 	}
-	return bytes_sent;
+	return model;
 }
 
-/* Writes an element of any size to the device, taking care of page erases */
-/* returns 0 on success, otherwise -EINVAL */
-int DfuseController_download::dnload_element(unsigned int dwElementAddress,
-												unsigned int dwElementSize, const uint8_t *data)
+Dfuse::FlashPlan DfuseController_download::compilePlan(const uint8_t *data)
 {
-	int p;
-	int ret;
-
-	/* Check at least that we can write to the last address */
-	if (!memLayout.isAddressWriteable(dwElementAddress + dwElementSize - 1)) {
-		ctxi()->logfAndThrow("Last page at 0x%08x is not writeable",
-			dwElementAddress + dwElementSize - 1);
+	ctxi()->logf(LogLevel::Info, "file contains %i DFU images", static_cast<int>(dfuseImage->targets.size()));
+	for (const Dfuse::ImageTarget &target : dfuseImage->targets) {
+		ctxi()->logf(LogLevel::Info, "image for alternate setting %i, (%i elements)",
+					 static_cast<int>(target.alternateSetting),
+					 static_cast<int>(target.elements.size()));
+		if (target.alternateSetting != dif->altsetting) {
+			ctxi()->log(LogLevel::Warn, "Image does not match current alternate setting.\n"
+			       "Please rerun with the correct -a option setting to download this image!");
+			continue;
+		}
+		for (const Dfuse::ImageElement &e : target.elements)
+			ctxi()->logf(LogLevel::Info, "address = 0x%08x, size = %i", e.address, e.size);
 	}
 
+	Dfuse::FlashPlanner planner(*dfuseImage, memLayout, *opts);
+	planner.alternateSetting = dif->altsetting;
+	planner.transferSize = transferSize;
+	/* Devices count blocks in their own transfer size */
+	planner.blockAddressing = (static_cast<uint32_t>(transferSize) == dif->func_dfu.wTransferSize);
+	planner.data = data;
+	planner.eraseCost = timeModel().erase;
+	return planner.compile(ctxi());
+}
 
-	for (p = 0; p < (int)dwElementSize; p += transferSize) {
-		int page_size;
-		unsigned int erase_address;
-		unsigned int address = dwElementAddress + p;
-		int chunk_size = transferSize;
-
-		Dfuse::MemSegment *segment = memLayout.findSegment(address);
-		if (!segment || !segment->isWriteable()) {
-			ctxi()->logfAndThrow("Page at 0x%08x is not writeable",
-				address);
-		}
-		page_size = segment->pagesize;
-
-		/* check if this is the last chunk */
-		if (p + chunk_size > (int)dwElementSize)
-			chunk_size = dwElementSize - p;
+void DfuseController_download::executePlan(const Dfuse::FlashPlan &plan, const uint8_t *data, bool verifyData,
+	Step next)
+{
+	this->plan = &plan;
+	planData = data;
+	verifyPlanData = verifyData;
+	nextOp = 0;
+	planModel = timeModel();
+	planTotalMs = std::max<uint64_t>(1, planModel.estimateMs(plan, memLayout));
+	planDoneMs = 0;
+	dataFinished = false;
+	planDone = next;
+	executeNextOp();
+}
 
-		/* Erase only for flash memory downloads */
-		if (segment->isEraseable() && !opts->massErase) {
-			/* erase all involved pages */
-			for (erase_address = address;
-			     erase_address < address + chunk_size;
-			     erase_address += page_size)
-				if ((erase_address & ~(page_size - 1)) !=
-				    last_erased_page)
-					specialCommand(erase_address,
-							      DfuseCommand::ErasePage);
+void DfuseController_download::finishData(Step next)
+{
+	if (dataFinished) {
+		next();
+		return;
+	}
+	dataFinished = true;
+	dataSent([this, next]() { abortToIdle(next); });
+}
 
-			if (((address + chunk_size - 1) & ~(page_size - 1)) !=
-			    last_erased_page) {
-				ctxi()->log(LogLevel::Verbose3, "Chunk extends into next page, erase it as well");
-				specialCommand(address + chunk_size - 1,
-						      DfuseCommand::ErasePage);
+void DfuseController_download::executeNextOp()
+{
+	if (nextOp == plan->ops.size()) {
+		finishData(planDone);
+		return;
+	}
+	const Dfuse::FlashOp &op = plan->ops[nextOp++];
+	bool erasing = (op.type == Dfuse::FlashOp::Type::ErasePage || op.type == Dfuse::FlashOp::Type::MassErase);
+	ctxi()->progress(0.05 + 0.9 * planDoneMs / planTotalMs, erasing ? "Erasing" : "Downloading");
+	ctxi()->logf(LogLevel::Verbose2, "Plan step: %s at 0x%08x", Dfuse::FlashOp::typeName(op.type), op.address);
+	planDoneMs += planModel.estimateMs(op, memLayout);
+
+	Step next = [this]() { executeNextOp(); };
+	switch (op.type) {
+	case Dfuse::FlashOp::Type::ErasePage:
+		specialCommand(op.address, DfuseCommand::ErasePage, next);
+		break;
+	case Dfuse::FlashOp::Type::MassErase:
+		ctxi()->log(LogLevel::Info, "Performing mass erase, this can take a moment");
+		specialCommand(0, DfuseCommand::MassErase, next);
+		break;
+	case Dfuse::FlashOp::Type::SetAddress:
+		specialCommand(op.address, DfuseCommand::SetAddress, next);
+		break;
+	case Dfuse::FlashOp::Type::Write: {
+		const uint8_t *chunk = planData + op.offset;
+		if (verifyPlanData) {
+			/* Nothing else checks the data of a plan file before it is written */
+			CRC32 crc;
+			crc.update_u8(chunk, op.size);
+			if (crc != op.crc) {
+				ctxi()->logfAndThrow(LogMsgType::FileFormatError, "Plan data for 0x%08x is corrupt", op.address);
 			}
 		}
-
 		ctxi()->logf(LogLevel::Verbose, " Download from image offset "
 			       "%08x to memory %08x-%08x, size %i\n",
-			       p, address, address + chunk_size - 1,
-			       chunk_size);
-
-		progress(data+p);
-		specialCommand(address, DfuseCommand::SetAddress);
-
-		/* transaction = 2 for no address offset */
-		ret = dnload_chunk(data + p, chunk_size, 2);
-		if (ret != chunk_size) {
-			ctxi()->logfAndThrow("Failed to write whole chunk: "
-				"%i of %i bytes", ret, chunk_size);
-		}
+			       static_cast<unsigned int>(op.offset), op.address, op.address + op.size - 1,
+			       static_cast<int>(op.size));
+		int size = static_cast<int>(op.size);
+		dnload_chunk(chunk, size, op.block, [this, size, next](int ret) {
+			if (ret != size) {
+				ctxi()->logfAndThrow("Failed to write whole chunk: "
+					"%i of %i bytes", ret, size);
+			}
+			next();
+		});
+		break;
+	}
+	case Dfuse::FlashOp::Type::Leave: {
+		unsigned int address = op.address;
+		finishData([this, address, next]() {
+			specialCommand(address, DfuseCommand::SetAddress, [this, next]() {
+				dnload_chunk(nullptr, 0, 2, [next](int) { next(); }); /* Zero-size */
+			});
+		});
+		break;
+	}
 	}
-	progress(data+dwElementSize);
-	return 0;
 }
 
-int DfuseController_download::dnload_dfuseFile()
+void DfuseController_download::checkPlanFile()
 {
-	DfuseFilePart::Prefix dfuPrefix;
-	DfuseFilePart::TargetPrefix targetPrefix;
-	DfuseFilePart::ElementHeader elementHeader;
-
-	ctxi()->progress(0.05, "Downloading");
-
-	int ret;
-	int bFirstAddressSaved = 0;
-
-	PackedData::Reader data(file->data.data() + file->size.prefix, file->size.getPayload());
-
-        /* Must be larger than a minimal DfuSe header and suffix */
-	if (!data.enoughBytes(dfuPrefix.packedSize+targetPrefix.packedSize+elementHeader.packedSize))
-	{
-		ctxi()->logAndThrow(LogMsgType::FileFormatError, "File too small for a DfuSe file");
+	const FlashPlanFile::Header &header = planFile->getHeader();
+	if (!planFile->matchesLayout(dif->alt_name)) {
+		ctxi()->logAndThrow(LogMsgType::InvalidOptions, "Plan was made for a different memory layout");
 	}
-
-	dfuPrefix.parse(ctxi(), data.subReader(dfuPrefix.packedSize));
-	ctxi()->logf(LogLevel::Info, "file contains %i DFU images", dfuPrefix.targetsCount);
-
-	for (uint8_t image = 1; image <= dfuPrefix.targetsCount; image++) {
-		ctxi()->logf(LogLevel::Info, "parsing DFU image %i", static_cast<int>(image));
-		targetPrefix.parse(ctxi(), data.subReader(targetPrefix.packedSize));
-
-		ctxi()->logf(LogLevel::Info, "image for alternate setting %i, (%i elements, total size = %i)",
-					 static_cast<int>(targetPrefix.alternateSetting),
-					 static_cast<int>(targetPrefix.nbElements),
-					 static_cast<int>(targetPrefix.targetSize));
-		if (targetPrefix.alternateSetting != dif->altsetting)
-			ctxi()->log(LogLevel::Warn, "Image does not match current alternate setting.\n"
-			       "Please rerun with the correct -a option setting to download this image!");
-		for (uint32_t element = 1; element <= targetPrefix.nbElements; element++) {
-			ctxi()->logf(LogLevel::Info, "parsing element %i, ", static_cast<int>(element));
-			elementHeader.parse(ctxi(), data.subReader(elementHeader.packedSize));
-
-			ctxi()->logf(LogLevel::Info, "address = 0x%08x, size = %i", elementHeader.elementAddress, elementHeader.elementSize);
-
-			if (!bFirstAddressSaved) {
-				bFirstAddressSaved = 1;
-				dfuse_address = elementHeader.elementAddress;
-			}
-			/* sanity check */
-			if (!data.enoughBytes(elementHeader.elementSize))
-				ctxi()->logfAndThrow(LogMsgType::FileFormatError, "File too small for element size");
-
-			if (targetPrefix.alternateSetting == dif->altsetting) {
-				ret = dnload_element(elementHeader.elementAddress, elementHeader.elementSize, data.getCurrPtr());
-			} else {
-				ret = 0;
-			}
-
-			/* advance read pointer */
-			data.skip(elementHeader.elementSize);
-
-			// TODO: check whther return value check is needed, or whether all errors are now handled by exceptions
-			if (ret != 0)
-				return ret;
-		}
+	if (header.alternateSetting != dif->altsetting) {
+		ctxi()->logfAndThrow(LogMsgType::InvalidOptions, "Plan is for alternate setting %i",
+			static_cast<int>(header.alternateSetting));
 	}
+	/* Block numbers in the plan count in the device's transfer size */
+	if (header.transferSize != dif->func_dfu.wTransferSize) {
+		ctxi()->logfAndThrow(LogMsgType::InvalidOptions, "Plan was made for transfer size %u, device uses %u",
+			header.transferSize, static_cast<unsigned int>(dif->func_dfu.wTransferSize));
+	}
+	if (planFile->getPlan()->count(Dfuse::FlashOp::Type::MassErase) && !opts->force) {
+		ctxi()->logAndThrow(LogMsgType::InvalidOptions, "The mass erase command "
+			"can only be used with force");
+	}
+}
 
-	if (data.remainingBytes()!=0)
-		ctxi()->logf(LogLevel::Warn, "%d bytes leftover", data.remainingBytes());
-
-	ctxi()->log(LogLevel::Info, "done parsing DfuSe file");
-
-	return 0;
+const DfuFile &DfuseController_download::getFile() const
+{
+	return image ? image->getFile() : *file;
 }
 
-int DfuseController_download::run()
+void DfuseController_download::begin()
 {
 	calcTransferSize();
-	last_erased_page = 1; /* non-aligned value, won't match */
+	addressPointerValid = false;
 
-	int ret;
+	/* The suffix of a streamed file is only known at the end, but its version
+	 * and ID have to be checked before any flash is erased */
+	if (!planFile && getFile().isStreaming()) {
+		ctxi()->logAndThrow(LogMsgType::InvalidOptions, "Streaming is not supported for DfuSe downloads");
+	}
 
-	if (!memLayout.parseDesc(ctxi(), dif->alt_name)) {
-		ctxi()->logAndThrow(LogMsgType::UsbIoError, "Failed to parse memory layout");
+	if (planFile) {
+		/* The layout was checked when the plan was made, it only has to be the same one */
+		checkPlanFile();
+		memLayout = *planFile->getLayout();
+	} else {
+		/* Identical devices share the parsed layout */
+		std::shared_ptr<const Dfuse::MemLayout> layout = Dfuse::MemLayout::getCached(ctxi(), dif->alt_name);
+		if (!layout) {
+			ctxi()->logAndThrow(LogMsgType::UsbIoError, "Failed to parse memory layout");
+		}
+		memLayout = *layout;
 	}
+	erasedPages.reset(memLayout);
 	if (opts->unprotect) {
 		if (!opts->force) {
 			ctxi()->logAndThrow(LogMsgType::InvalidOptions, "The read unprotect command "
 				"will erase the flash memory"
 				"and can only be used with force");
 		}
-		specialCommand(0, DfuseCommand::ReadUnprotect);
-		ctxi()->log(LogLevel::Info, "Device disconnects, erases flash and resets now");
-		return 0;
+		specialCommand(0, DfuseCommand::ReadUnprotect, [this]() {
+			ctxi()->log(LogLevel::Info, "Device disconnects, erases flash and resets now");
+			finish();
+		});
+		return;
 	}
-	if (opts->massErase) {
-		if (!opts->force) {
-			ctxi()->logAndThrow(LogMsgType::InvalidOptions, "The mass erase command "
-				"can only be used with force");
-		}
-		ctxi()->progress(0.1, "Mass erase");
-		ctxi()->log(LogLevel::Info, "Performing mass erase, this can take a moment");
-		specialCommand(0, DfuseCommand::MassErase);
+	if (planFile) {
+		const Dfuse::FlashPlan &plan = *planFile->getPlan();
+		ctxi()->logf(LogLevel::Info, "Download plan from file: %u page erases, %u address commands, %u writes "
+			"(%" PRIu64 " bytes), estimated %" PRIu64 " ms",
+			static_cast<unsigned int>(plan.count(Dfuse::FlashOp::Type::ErasePage)),
+			static_cast<unsigned int>(plan.count(Dfuse::FlashOp::Type::SetAddress)),
+			static_cast<unsigned int>(plan.count(Dfuse::FlashOp::Type::Write)),
+			plan.bytesWritten(), timeModel().estimateMs(plan, memLayout));
+		executePlan(plan, planFile->getPayload(), true, [this]() {
+			memLayout.clear();
+			finish();
+		});
+		return;
+	}
+	if (image && !dfuseImage)
+		dfuseImage = image->getDfuseImage();
+	if ((opts->massErase || opts->autoMassErase) && !opts->force) {
+		ctxi()->logAndThrow(LogMsgType::InvalidOptions, "The mass erase command "
+			"can only be used with force");
 	}
 
-	if (file->bcdDFU != 0x11a) {
+	if (getFile().bcdDFU != 0x11a) {
 		ctxi()->logAndThrow("Only DfuSe file version 1.1a is supported for DfuSe format files");
 	}
-	ret = dnload_dfuseFile();
-	memLayout.clear();
-
-	abortToIdle();
 
-	if (opts->leave) {
-		specialCommand(dfuse_address, DfuseCommand::SetAddress);
-		dnload_chunk(nullptr, 0, 2); /* Zero-size */
+	/* Streamed files were rejected above, so the whole file is in memory */
+	const uint8_t *data = getFile().getData() + getFile().size.prefix;
+	if (!dfuseImage) {
+		auto parsed = std::make_shared<Dfuse::Image>();
+		parsed->parse(ctxi(), data, getFile().size.getPayload());
+		dfuseImage = parsed;
 	}
-	return ret;
-}
 
+	/* The whole download is worked out (and checked) before anything is sent */
+	ownPlan = compilePlan(data);
+	const Dfuse::FlashPlan &plan = ownPlan;
+	ctxi()->logf(LogLevel::Info, "Download plan: %u page erases, %u address commands, %u writes (%" PRIu64 " bytes), "
+		"estimated %" PRIu64 " ms",
+		static_cast<unsigned int>(plan.count(Dfuse::FlashOp::Type::ErasePage)),
+		static_cast<unsigned int>(plan.count(Dfuse::FlashOp::Type::SetAddress)),
+		static_cast<unsigned int>(plan.count(Dfuse::FlashOp::Type::Write)),
+		plan.bytesWritten(), timeModel().estimateMs(plan, memLayout));
+	if (plan.blankBytesTrimmed)
+		ctxi()->logf(LogLevel::Info, "Trimmed %" PRIu64 " blank bytes from the end of elements", plan.blankBytesTrimmed);
+	if (plan.blankBytesSkipped)
+		ctxi()->logf(LogLevel::Info, "Skipped %" PRIu64 " bytes in blank chunks", plan.blankBytesSkipped);
+	executePlan(plan, data, false, [this]() {
+		if (dfuseImage->leftoverBytes!=0)
+			ctxi()->logf(LogLevel::Warn, "%" PRIu64 " bytes leftover", dfuseImage->leftoverBytes);
+		memLayout.clear();
+		finish();
+	});
+}
 
 }
@@ -6,6 +6,10 @@
 
 #include "dfu/DfuController.hpp"
 #include "MemLayout.hpp"
+#include "ErasePlan.hpp"
+#include "FlashPlan.hpp"
+#include "DfuseImage.hpp"
+#include "PackedData.hpp"
 
 #include <cstdint>
 #include <memory>
@@ -26,30 +30,69 @@ const char * DfuseCommand_toString(DfuseCommand cmd);
 class DfuseController : public DfuController
 {
 protected:
+	void pollCommand(unsigned int address, DfuseCommand command, bool firstPoll, Step next);
+
 public:
-	unsigned int last_erased_page = 1; /* non-aligned value, won't match */
 	Dfuse::MemLayout memLayout;
-	unsigned int dfuse_address = 0;
+	// Pages erased so far, so that no page is erased twice (which would lose data already written to it)
+	Dfuse::PageSet erasedPages;
+	// Address pointer set by the last command, if that was SetAddress. Erase commands also move the pointer (at least in
+	// ST's implementation), so it is only known after SetAddress.
+	bool addressPointerValid = false;
+	unsigned int addressPointer = 0;
 	std::shared_ptr<DfuseOptions> opts = std::make_shared<DfuseOptions>();
 
-	int specialCommand(unsigned int address, DfuseCommand command);
+	// Sends a command and waits for the device to execute it, then calls next
+	void specialCommand(unsigned int address, DfuseCommand command, Step next);
 	int req_upload(const unsigned short length, unsigned char *data, unsigned short transaction);
-	int req_dnload(const unsigned short length, unsigned char *data, unsigned short transaction);
 	using DfuController::DfuController;
 };
 
 class DfuseController_download : public DfuseController
 {
 protected:
-	void progress(const uint8_t *dataPos);
-	int dnload_chunk(const uint8_t *data, int size, int transaction);
-	int dnload_element(unsigned int dwElementAddress,
-					   unsigned int dwElementSize, const uint8_t *data);
-	int dnload_dfuseFile();
+	// State of the plan being executed
+	Dfuse::FlashPlan ownPlan;
+	const Dfuse::FlashPlan *plan = nullptr;
+	const uint8_t *planData = nullptr;
+	bool verifyPlanData = false;
+	size_t nextOp = 0;
+	Dfuse::FlashTimeModel planModel;
+	uint64_t planTotalMs = 0;
+	uint64_t planDoneMs = 0;
+	// The device is only told the download is complete once all data has been sent
+	bool dataFinished = false;
+	Step planDone;
+
+	// Writes a chunk, then calls next with the number of bytes written, or -1 if the device reported an error
+	void dnload_chunk(const uint8_t *data, int size, int transaction, std::function<void(int bytesSent)> next);
+	void pollChunk(int size, int bytesSent, std::function<void(int bytesSent)> next);
+	// Learned (or default) times for the operations of a plan
+	Dfuse::FlashTimeModel timeModel() const;
+	// Plans the download of dfuseImage for the current alternate setting. data is the DfuSe data if it is in memory
+	// (needed for leaving out blank chunks).
+	Dfuse::FlashPlan compilePlan(const uint8_t *data);
+	// Sends the requests of a plan, then calls next. Write data is taken from data at the operation offsets, and checked
+	// against the operation CRCs if verifyData is set. The plan and data must stay valid until next is called.
+	void executePlan(const Dfuse::FlashPlan &plan, const uint8_t *data, bool verifyData, Step next);
+	// Sends the next operation of the plan being executed
+	void executeNextOp();
+	// Tells the device that all data has been sent (once), then calls next
+	void finishData(Step next);
+	void begin() override;
+	// Checks that planFile was made for this device
+	void checkPlanFile();
+	const DfuFile &getFile() const;
 
 public:
 	std::shared_ptr<DfuFile> file;
-	int run();
+	// Alternative to file, for downloading the same image to several devices at once
+	std::shared_ptr<const FirmwareImage> image;
+	// Optional, structure of the file if it has already been parsed (element offsets are relative to the start of the
+	// DfuSe data). Taken from image, or parsed from the file, if not set.
+	std::shared_ptr<const Dfuse::Image> dfuseImage;
+	// Optional, download planned in advance, used instead of file or image
+	std::shared_ptr<const FlashPlanFile> planFile;
 	using DfuseController::DfuseController;
 };
 
@@ -0,0 +1,76 @@
+#include "DfuseImage.hpp"
+#include "DfuseFilePart.hpp"
+#include "ContextImpl.hpp"
+#include "PackedData.hpp"
+
+namespace FwUpd
+{
+namespace Dfuse
+{
+
+void Image::parse(ContextImpl *ctxi, const uint8_t *data, uint64_t length)
+{
+	DfuseFilePart::Prefix dfuPrefix;
+	DfuseFilePart::TargetPrefix targetPrefix;
+	DfuseFilePart::ElementHeader elementHeader;
+
+	targets.clear();
+	leftoverBytes = 0;
+
+	if (length != static_cast<size_t>(length))
+		ctxi->logAndThrow(LogMsgType::FileFormatError, "DfuSe file is too big");
+	PackedData::Reader d(data, static_cast<size_t>(length));
+
+	/* Must be larger than a minimal DfuSe header and suffix */
+	if (!d.enoughBytes(dfuPrefix.packedSize+targetPrefix.packedSize+elementHeader.packedSize))
+		ctxi->logAndThrow(LogMsgType::FileFormatError, "File too small for a DfuSe file");
+
+	dfuPrefix.parse(ctxi, d.subReader(dfuPrefix.packedSize));
+	for (uint8_t image = 1; image <= dfuPrefix.targetsCount; image++) {
+		if (!d.enoughBytes(targetPrefix.packedSize))
+			ctxi->logAndThrow(LogMsgType::FileFormatError, "File too small for a DfuSe file");
+		targetPrefix.parse(ctxi, d.subReader(targetPrefix.packedSize));
+
+		ImageTarget target;
+		target.alternateSetting = targetPrefix.alternateSetting;
+		if (targetPrefix.targetNamed)
+			target.name = targetPrefix.targetName.c_str();
+
+		for (uint32_t element = 1; element <= targetPrefix.nbElements; element++) {
+			if (!d.enoughBytes(elementHeader.packedSize))
+				ctxi->logAndThrow(LogMsgType::FileFormatError, "File too small for a DfuSe file");
+			elementHeader.parse(ctxi, d.subReader(elementHeader.packedSize));
+
+			/* sanity check */
+			if (!d.enoughBytes(elementHeader.elementSize))
+				ctxi->logAndThrow(LogMsgType::FileFormatError, "File too small for element size");
+
+			ImageElement e;
+			e.address = elementHeader.elementAddress;
+			e.size = elementHeader.elementSize;
+			e.offset = d.getCurrPtr() - data;
+			target.elements.push_back(e);
+			d.skip(elementHeader.elementSize);
+		}
+		targets.push_back(target);
+	}
+	leftoverBytes = d.remainingBytes();
+
+	ctxi->logf(LogLevel::Verbose, "DfuSe file contains %i images", static_cast<int>(targets.size()));
+}
+
+bool Image::getFirstAddress(uint32_t *address) const
+{
+	for (const ImageTarget &target : targets)
+	{
+		if (!target.elements.empty())
+		{
+			*address = target.elements[0].address;
+			return true;
+		}
+	}
+	return false;
+}
+
+}
+}
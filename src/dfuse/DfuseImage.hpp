@@ -0,0 +1,53 @@
+#ifndef fwupd_dfuse_DfuseImage_h
+#define fwupd_dfuse_DfuseImage_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace FwUpd
+{
+
+class ContextImpl;
+
+namespace Dfuse
+{
+
+// Block of data in a DfuSe file to be written at a given address
+class ImageElement
+{
+public:
+	uint32_t address;
+	uint32_t size;
+	// Offset of the element data from the start of the DfuSe data (i.e. after any DFU prefix)
+	uint64_t offset;
+};
+
+class ImageTarget
+{
+public:
+	uint8_t alternateSetting;
+	// Empty if the target is not named
+	std::string name;
+	std::vector<ImageElement> elements;
+};
+
+// Structure of a DfuSe file, parsed in advance so that the file can be checked before a download starts
+class Image
+{
+public:
+	std::vector<ImageTarget> targets;
+	// Bytes after the last element
+	uint64_t leftoverBytes = 0;
+
+	// Parses DfuSe data (the file contents excluding prefix and suffix). Logs and throws if the data is invalid.
+	void parse(ContextImpl *ctxi, const uint8_t *data, uint64_t length);
+	// Address of the first element in the file, which is used as the start address when leaving DFU mode.
+	// Returns false if there are no elements.
+	bool getFirstAddress(uint32_t *address) const;
+};
+
+}
+}
+
+#endif
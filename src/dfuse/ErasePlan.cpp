@@ -0,0 +1,153 @@
+#include "ErasePlan.hpp"
+
+#include <algorithm>
+
+namespace FwUpd
+{
+namespace Dfuse
+{
+
+void PageSet::reset(const MemLayout &layout)
+{
+	this->layout = &layout;
+	bits.clear();
+	for (const MemSegment &seg : layout.segments)
+	{
+		size_t pages = 0;
+		if (seg.isEraseable() && seg.pagesize)
+			pages = (static_cast<uint64_t>(seg.lastAddr) - seg.firstAddr) / seg.pagesize + 1;
+		bits.emplace_back(pages, false);
+	}
+	total = 0;
+}
+
+void PageSet::clear()
+{
+	for (std::vector<bool> &b : bits)
+		b.assign(b.size(), false);
+	total = 0;
+}
+
+bool PageSet::add(uint32_t address)
+{
+	MemPage page;
+	if (!layout || !layout->pageInfo(address, &page) || bits[page.segment].empty())
+		return false;
+	std::vector<bool>::reference bit = bits[page.segment][page.index];
+	if (!bit)
+	{
+		bit = true;
+		total++;
+	}
+	return true;
+}
+
+void PageSet::addRange(uint32_t address, uint32_t size)
+{
+	if (!layout || !size)
+		return;
+	uint64_t last = static_cast<uint64_t>(address) + size - 1;
+	for (size_t i=layout->segmentIndexFrom(address); i<layout->segments.size(); i++)
+	{
+		const MemSegment &seg = layout->segments[i];
+		if (seg.firstAddr > last)
+			return;
+		if (bits[i].empty())
+			continue;
+		uint64_t firstPage = (std::max<uint64_t>(address, seg.firstAddr) - seg.firstAddr) / seg.pagesize;
+		uint64_t lastPage = (std::min<uint64_t>(last, seg.lastAddr) - seg.firstAddr) / seg.pagesize;
+		for (uint64_t page=firstPage; page<=lastPage; page++)
+		{
+			std::vector<bool>::reference bit = bits[i][page];
+			if (!bit)
+			{
+				bit = true;
+				total++;
+			}
+		}
+	}
+}
+
+void PageSet::addAll()
+{
+	total = 0;
+	for (std::vector<bool> &b : bits)
+	{
+		b.assign(b.size(), true);
+		total += b.size();
+	}
+}
+
+bool PageSet::contains(uint32_t address) const
+{
+	MemPage page;
+	if (!layout || !layout->pageInfo(address, &page))
+		return false;
+	return !bits[page.segment].empty() && bits[page.segment][page.index];
+}
+
+std::vector<uint32_t> PageSet::pageAddresses() const
+{
+	std::vector<uint32_t> pages;
+	if (!layout)
+		return pages;
+	pages.reserve(total);
+	for (size_t i=0; i<layout->segments.size(); i++)
+	{
+		const MemSegment &seg = layout->segments[i];
+		for (size_t page=0; page<bits[i].size(); page++)
+		{
+			if (bits[i][page])
+				pages.push_back(static_cast<uint32_t>(seg.firstAddr + page * seg.pagesize));
+		}
+	}
+	// Segments are in address order, so the pages are too
+	return pages;
+}
+
+uint32_t EraseCostModel::defaultPageMs(uint32_t pagesize)
+{
+	return 10 + pagesize / 128;
+}
+
+bool EraseCostModel::uniformPageSize(const MemLayout &layout)
+{
+	uint32_t size = 0;
+	for (const MemSegment &seg : layout.segments)
+	{
+		if (!seg.isEraseable())
+			continue;
+		if (size && seg.pagesize != size)
+			return false;
+		size = seg.pagesize;
+	}
+	return true;
+}
+
+uint64_t EraseCostModel::pageMs(uint32_t pagesize) const
+{
+	return (learnedPageMs ? learnedPageMs : defaultPageMs(pagesize)) + commandOverheadMs;
+}
+
+uint64_t EraseCostModel::pagesMs(const PageSet &pages) const
+{
+	uint64_t ms = 0;
+	for (uint32_t address : pages.pageAddresses())
+		ms += pageMs(pages.getLayout()->findSegment(address)->pagesize);
+	return ms;
+}
+
+uint64_t EraseCostModel::massMs(const MemLayout &layout) const
+{
+	if (learnedMassMs)
+		return learnedMassMs + commandOverheadMs;
+	PageSet all;
+	all.reset(layout);
+	all.addAll();
+	EraseCostModel byPage = *this;
+	byPage.commandOverheadMs = 0;
+	return byPage.pagesMs(all) / 2 + commandOverheadMs;
+}
+
+}
+}
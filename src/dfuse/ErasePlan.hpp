@@ -0,0 +1,76 @@
+#ifndef fwupd_dfuse_ErasePlan_h
+#define fwupd_dfuse_ErasePlan_h
+
+#include "MemLayout.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace FwUpd
+{
+namespace Dfuse
+{
+
+// Set of pages in the erasable segments of a layout, as one bitmap per segment
+class PageSet
+{
+protected:
+	const MemLayout *layout = nullptr;
+	// Indexed like layout->segments, empty for segments which cannot be erased
+	std::vector<std::vector<bool>> bits;
+	size_t total = 0;
+
+public:
+	// Empties the set and sizes it for layout, which must outlive it (or until the next reset)
+	void reset(const MemLayout &layout);
+	void clear();
+
+	// Adds the page containing address. Returns false if it is not in an erasable segment.
+	bool add(uint32_t address);
+	// Adds every page that a write of size bytes at address touches
+	void addRange(uint32_t address, uint32_t size);
+	// Adds every erasable page in the layout
+	void addAll();
+	bool contains(uint32_t address) const;
+	size_t count() const
+	{
+		return total;
+	}
+	// Start addresses of the pages in the set, in address order
+	std::vector<uint32_t> pageAddresses() const;
+
+	const MemLayout *getLayout() const
+	{
+		return layout;
+	}
+};
+
+/*
+ * Estimated times for erasing pages one by one and for a mass erase, to decide which is faster for a download.
+ * Learned times (from PollProfiles) are used when there are any, otherwise the times are estimated from the page
+ * sizes, with flash erasing roughly 128 KiB per second and a mass erase taking half as long as erasing every page.
+ */
+class EraseCostModel
+{
+public:
+	// Learned busy time of a page erase and a mass erase, 0 if not known. Learned times are not kept per page size, so
+	// learnedPageMs should only be set for layouts where every erasable page has the same size (see uniformPageSize()).
+	uint32_t learnedPageMs = 0;
+	uint32_t learnedMassMs = 0;
+	// USB requests for each erase command (DNLOAD and GETSTATUS polls)
+	uint32_t commandOverheadMs = 3;
+
+	static uint32_t defaultPageMs(uint32_t pagesize);
+	// Returns true if all erasable segments of layout have the same page size
+	static bool uniformPageSize(const MemLayout &layout);
+
+	// Time for one page erase command
+	uint64_t pageMs(uint32_t pagesize) const;
+	uint64_t pagesMs(const PageSet &pages) const;
+	uint64_t massMs(const MemLayout &layout) const;
+};
+
+}
+}
+
+#endif
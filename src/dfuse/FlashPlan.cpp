@@ -0,0 +1,201 @@
+#include "FlashPlan.hpp"
+#include "BlankCheck.hpp"
+#include "ContextImpl.hpp"
+
+#include <algorithm>
+
+namespace FwUpd
+{
+namespace Dfuse
+{
+
+const char *FlashOp::typeName(Type type)
+{
+	switch (type)
+	{
+	case Type::ErasePage:
+		return "erase page";
+	case Type::MassErase:
+		return "mass erase";
+	case Type::SetAddress:
+		return "set address";
+	case Type::Write:
+		return "write";
+	case Type::Leave:
+		return "leave";
+	}
+	return nullptr;
+}
+
+size_t FlashPlan::count(FlashOp::Type type) const
+{
+	return std::count_if(ops.begin(), ops.end(), [type](const FlashOp &op) { return op.type == type; });
+}
+
+uint64_t FlashPlan::bytesWritten() const
+{
+	uint64_t total = 0;
+	for (const FlashOp &op : ops)
+	{
+		if (op.type == FlashOp::Type::Write)
+			total += op.size;
+	}
+	return total;
+}
+
+FlashPlan FlashPlanner::compile(ContextImpl *ctxi) const
+{
+	if (!transferSize)
+		ctxi->logAndThrow("Transfer size must be specified");
+
+	FlashPlan plan;
+	bool checkBlank = data && (opts.skipBlankChunks || opts.trimBlankTail);
+	PageSet pages;
+	pages.reset(layout);
+	std::vector<FlashOp> writes;
+
+	for (const ImageTarget &target : image.targets)
+	{
+		if (target.alternateSetting != alternateSetting)
+			continue;
+		for (const ImageElement &e : target.elements)
+		{
+			if (!e.size)
+				continue;
+			const MemSegment *last = layout.findSegment(e.address + e.size - 1);
+			if (!last || !last->isWriteable())
+				ctxi->logfAndThrow("Last page at 0x%08x is not writeable", e.address + e.size - 1);
+
+			// Chunks of this element which are blank, and not written unless data follows them (for trimBlankTail)
+			std::vector<FlashOp> blankRun;
+			for (uint32_t p = 0; p < e.size; p += transferSize)
+			{
+				FlashOp op;
+				op.type = FlashOp::Type::Write;
+				op.address = e.address + p;
+				op.size = std::min(transferSize, e.size - p);
+				op.offset = e.offset + p;
+
+				MemPage page;
+				if (!layout.pageInfo(op.address, &page) || !page.isWriteable())
+					ctxi->logfAndThrow("Page at 0x%08x is not writeable", op.address);
+				// Erased flash reads as 0xff, so blank chunks do not need to be written there
+				bool blank = checkBlank && page.isEraseable() && BlankCheck::isBlank(data + op.offset, op.size);
+
+				if (blank && opts.trimBlankTail)
+				{
+					blankRun.push_back(op);
+					continue;
+				}
+				// Not the end of the element after all
+				for (const FlashOp &held : blankRun)
+				{
+					pages.addRange(held.address, held.size);
+					if (opts.skipBlankChunks)
+						plan.blankBytesSkipped += held.size;
+					else
+						writes.push_back(held);
+				}
+				blankRun.clear();
+
+				pages.addRange(op.address, op.size);
+				if (blank)
+					plan.blankBytesSkipped += op.size;
+				else
+					writes.push_back(op);
+			}
+			for (const FlashOp &held : blankRun)
+				plan.blankBytesTrimmed += held.size;
+		}
+	}
+
+	bool massErase = opts.massErase;
+	if (!massErase && opts.autoMassErase && pages.count())
+	{
+		uint64_t pagesMs = eraseCost.pagesMs(pages);
+		uint64_t massMs = eraseCost.massMs(layout);
+		ctxi->logf(LogLevel::Info, "%u pages to erase, estimated %u ms (mass erase %u ms)",
+			static_cast<unsigned int>(pages.count()), static_cast<unsigned int>(pagesMs),
+			static_cast<unsigned int>(massMs));
+		massErase = massMs < pagesMs;
+	}
+	if (massErase)
+	{
+		FlashOp op;
+		op.type = FlashOp::Type::MassErase;
+		plan.ops.push_back(op);
+	}
+	else
+	{
+		for (uint32_t address : pages.pageAddresses())
+		{
+			FlashOp op;
+			op.type = FlashOp::Type::ErasePage;
+			op.address = address;
+			plan.ops.push_back(op);
+		}
+	}
+
+	// Block numbers from 2 on address transferSize blocks after the address pointer. Nothing after this moves it.
+	bool pointerSet = false;
+	uint32_t pointer = 0;
+	for (FlashOp &op : writes)
+	{
+		uint32_t blockOffset = op.address - pointer;
+		if (!pointerSet || !blockAddressing || op.address < pointer || blockOffset % transferSize ||
+			blockOffset / transferSize > 0xffff - 2)
+		{
+			FlashOp set;
+			set.type = FlashOp::Type::SetAddress;
+			set.address = op.address;
+			plan.ops.push_back(set);
+			pointerSet = true;
+			pointer = op.address;
+			blockOffset = 0;
+		}
+		op.block = static_cast<uint16_t>(2 + blockOffset / transferSize);
+		plan.ops.push_back(op);
+	}
+
+	if (opts.leave)
+	{
+		FlashOp op;
+		op.type = FlashOp::Type::Leave;
+		image.getFirstAddress(&op.address);
+		plan.ops.push_back(op);
+	}
+	return plan;
+}
+
+uint64_t FlashTimeModel::estimateMs(const FlashOp &op, const MemLayout &layout) const
+{
+	switch (op.type)
+	{
+	case FlashOp::Type::ErasePage:
+	{
+		MemPage page;
+		return erase.pageMs(layout.pageInfo(op.address, &page) ? page.size : 0);
+	}
+	case FlashOp::Type::MassErase:
+		return erase.massMs(layout);
+	case FlashOp::Type::SetAddress:
+		return learnedSetAddressMs + erase.commandOverheadMs;
+	case FlashOp::Type::Write:
+		// Full speed USB moves about 1 KiB per ms, and STM32 flash programs about as fast
+		return (learnedWriteMs ? learnedWriteMs : op.size / 1024) + op.size / 1024 + erase.commandOverheadMs;
+	case FlashOp::Type::Leave:
+		return erase.commandOverheadMs;
+	}
+	return 0;
+}
+
+uint64_t FlashTimeModel::estimateMs(const FlashPlan &plan, const MemLayout &layout) const
+{
+	uint64_t ms = 0;
+	for (const FlashOp &op : plan.ops)
+		ms += estimateMs(op, layout);
+	return ms;
+}
+
+}
+}
@@ -0,0 +1,109 @@
+#ifndef fwupd_dfuse_FlashPlan_h
+#define fwupd_dfuse_FlashPlan_h
+
+#include "libFirmwareUpdate++/dfu/DfuseOptions.hpp"
+
+#include "DfuseImage.hpp"
+#include "ErasePlan.hpp"
+#include "MemLayout.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace FwUpd
+{
+
+class ContextImpl;
+
+namespace Dfuse
+{
+
+// One request (with its status polling) to be sent to a DfuSe device
+class FlashOp
+{
+public:
+	enum class Type
+	{
+		ErasePage,
+		MassErase,
+		SetAddress,
+		// Download size bytes from offset in the DfuSe data as block number block, which the device writes to address
+		Write,
+		// Set the address pointer to address and send a zero-length download, which makes the device leave DFU mode and
+		// start the firmware at address. All data has been sent by this point.
+		Leave,
+	};
+	Type type;
+	uint32_t address = 0;
+	uint32_t size = 0;
+	uint16_t block = 0;
+	uint64_t offset = 0;
+	// CRC32 of the data of a write, only set for plans loaded from a file (where it is checked before the data is sent)
+	uint32_t crc = 0;
+
+	static const char *typeName(Type type);
+};
+
+class FlashPlan
+{
+public:
+	std::vector<FlashOp> ops;
+	// Bytes of element data not written because they are blank
+	uint64_t blankBytesSkipped = 0;
+	uint64_t blankBytesTrimmed = 0;
+
+	size_t count(FlashOp::Type type) const;
+	uint64_t bytesWritten() const;
+};
+
+/*
+ * Works out the requests for downloading the elements of a DfuSe image for one alternate setting, before anything is
+ * sent to the device:
+ * - every element is checked against the memory layout
+ * - pages are erased once, in address order, before any data is written (or a mass erase is used, see DfuseOptions)
+ * - with skipBlankChunks or trimBlankTail, blank chunks are left out (this needs data)
+ * - the address pointer is only set when a chunk cannot be reached by counting up block numbers from the last one
+ * Chunks are written in file order, so the data can be read sequentially.
+ */
+class FlashPlanner
+{
+public:
+	const Image &image;
+	const MemLayout &layout;
+	const DfuseOptions &opts;
+	uint8_t alternateSetting = 0;
+	uint32_t transferSize = 0;
+	// Set if the device counts block numbers in transferSize blocks (i.e. it uses the same transfer size)
+	bool blockAddressing = true;
+	// Start of the DfuSe data (element offsets are relative to it). Only needed to find blank chunks.
+	const uint8_t *data = nullptr;
+	EraseCostModel eraseCost;
+
+	FlashPlanner(const Image &image, const MemLayout &layout, const DfuseOptions &opts) :
+		image(image), layout(layout), opts(opts)
+	{}
+
+	// Logs and throws if an element cannot be written
+	FlashPlan compile(ContextImpl *ctxi) const;
+};
+
+/*
+ * Estimated time for each operation of a plan, from learned poll times where there are any.
+ * The defaults are rough figures for full speed USB and STM32 flash.
+ */
+class FlashTimeModel
+{
+public:
+	EraseCostModel erase;
+	// Busy time to write a chunk, 0 to estimate it from the size
+	uint32_t learnedWriteMs = 0;
+	uint32_t learnedSetAddressMs = 0;
+
+	uint64_t estimateMs(const FlashOp &op, const MemLayout &layout) const;
+	uint64_t estimateMs(const FlashPlan &plan, const MemLayout &layout) const;
+};
+
+}
+}
+
+#endif
@@ -3,15 +3,20 @@
  * following the ST DfuSe 1.1a specification.
  */
 
-#include <stdio.h>
-#include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
-#include <errno.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
 
 #include "dfu/DfuFile.hpp"
 #include "dfuse/MemLayout.hpp"
 #include "ContextImpl.hpp"
 
+/* Number of different descriptors kept by MemLayout::getCached() */
+#define LAYOUT_CACHE_MAX_ENTRIES 64
+
 namespace FwUpd
 {
 namespace Dfuse
@@ -22,132 +27,288 @@ void MemLayout::clear()
 	segments.resize(0);
 }
 
-bool MemLayout::parseDesc(ContextImpl *ctxi, const std::string& intf_descStr)
+namespace
 {
-	clear();
 
-	const char *intf_desc = intf_descStr.c_str();
-	char multiplier, memtype;
-	unsigned int address;
-	int sectors, size;
-	char *name, *typestring;
-	int ret;
-	int count = 0;
-	char separator;
-	int scanned;
-	MemSegment segment;
+// Conversions matching the sscanf() ones the descriptor used to be parsed with (leading whitespace is skipped)
+void skipSpace(const char *&p, const char *end)
+{
+	while (p < end && isspace(static_cast<unsigned char>(*p)))
+		p++;
+}
 
-	name = (char*)malloc(intf_descStr.length());
+bool readDecimal(const char *&p, const char *end, uint32_t *x)
+{
+	skipSpace(p, end);
+	if (p < end && *p == '+')
+		p++;
+	if (p == end || !isdigit(static_cast<unsigned char>(*p)))
+		return false;
+	*x = 0;
+	for (; p < end && isdigit(static_cast<unsigned char>(*p)); p++)
+		*x = *x * 10 + (*p - '0');
+	return true;
+}
 
-	ret = sscanf(intf_desc, "@%[^/]%n", name, &scanned);
-	if (ret < 1) {
-		free(name);
-		ctxi->logf(LogLevel::Warn, "Could not read name, sscanf returned %d", ret);
+bool readHex(const char *&p, const char *end, uint32_t *x)
+{
+	skipSpace(p, end);
+	if (p == end || !isxdigit(static_cast<unsigned char>(*p)))
 		return false;
+	*x = 0;
+	for (; p < end && isxdigit(static_cast<unsigned char>(*p)); p++)
+	{
+		char c = *p;
+		*x = *x * 16 + (isdigit(static_cast<unsigned char>(c)) ? c - '0' : (c | 0x20) - 'a' + 10);
 	}
-	ctxi->logf(LogLevel::Info, "DfuSe interface name: \"%s\"", name);
+	return true;
+}
 
-	intf_desc += scanned;
-	typestring = (char*)malloc(strlen(intf_desc));
+bool readLiteral(const char *&p, const char *end, const char *literal)
+{
+	const char *q = p;
+	for (; *literal; literal++, q++)
+	{
+		if (q == end || *q != *literal)
+			return false;
+	}
+	p = q;
+	return true;
+}
 
-	while (ret = sscanf(intf_desc, "/0x%x/%n", &address, &scanned),
-	       ret > 0) {
+}
+
+/*
+ * Parses a descriptor such as "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg/0x1FFF7800/01*512 e" in a
+ * single pass over the string: a name, then for each address, comma separated segments of
+ * <sectors>*<size><multiplier><type>. Invalid segments are skipped (their memory is still counted towards the address of
+ * the next one).
+ */
+bool MemLayout::parseDesc(ContextImpl *ctxi, const std::string& intf_descStr)
+{
+	clear();
 
-		intf_desc += scanned;
-		while (ret = sscanf(intf_desc, "%u*%u%c%[^,/]%n",
-				    &sectors, &size, &multiplier, typestring,
-				    &scanned), ret > 2) {
-			intf_desc += scanned;
+	const char *p = intf_descStr.data();
+	const char *end = p + intf_descStr.size();
+	int count = 0;
+
+	if (p == end || *p != '@') {
+		ctxi->log(LogLevel::Warn, "Could not read name");
+		return false;
+	}
+	const char *name = ++p;
+	while (p < end && *p != '/')
+		p++;
+	int nameLength = static_cast<int>(p - name);
+	if (!nameLength) {
+		ctxi->log(LogLevel::Warn, "Could not read name");
+		return false;
+	}
+	ctxi->logf(LogLevel::Info, "DfuSe interface name: \"%.*s\"", nameLength, name);
+	/* Quirk for STM32F4 devices */
+	bool deviceFeature = (nameLength == 14 && memcmp(name, "Device Feature", 14) == 0);
+
+	uint32_t address;
+	while (readLiteral(p, end, "/0x") && readHex(p, end, &address) && readLiteral(p, end, "/")) {
+		for (;;) {
+			const char *segmentStart = p;
+			uint32_t sectors, size;
+			if (!readDecimal(p, end, &sectors) || !readLiteral(p, end, "*") ||
+			    !readDecimal(p, end, &size) || p == end) {
+				p = segmentStart;
+				break;
+			}
+			char multiplier = *p++;
+			const char *typestring = p;
+			while (p < end && *p != ',' && *p != '/')
+				p++;
+			int typeLength = static_cast<int>(p - typestring);
 
 			count++;
-			memtype = 0;
-			if (ret == 4) {
-				if (strlen(typestring) == 1
-				    && typestring[0] != '/')
-					memtype = typestring[0];
-				else {
-					ctxi->logf(LogLevel::Warn, "Parsing type identifier '%s' "
-						"failed for segment %i",
-						typestring, count);
-					continue;
-				}
+			char memtype = 0;
+			bool valid = true;
+			if (typeLength == 1) {
+				memtype = typestring[0];
+			} else if (typeLength > 1) {
+				ctxi->logf(LogLevel::Warn, "Parsing type identifier '%.*s' "
+					"failed for segment %i",
+					typeLength, typestring, count);
+				valid = false;
 			}
 
-			/* Quirk for STM32F4 devices */
-			if (strcmp(name, "Device Feature") == 0)
-				memtype = 'e';
+			uint32_t unit = 1;
+			if (valid) {
+				if (deviceFeature)
+					memtype = 'e';
 
-			switch (multiplier) {
-			case 'B':
-				break;
-			case 'K':
-				size *= 1024;
-				break;
-			case 'M':
-				size *= 1024 * 1024;
-				break;
-			case 'a':
-			case 'b':
-			case 'c':
-			case 'd':
-			case 'e':
-			case 'f':
-			case 'g':
-				if (!memtype) {
-					ctxi->logf(LogLevel::Warn, "Non-valid multiplier '%c', "
-						"interpreted as type "
-						"identifier instead",
-						multiplier);
-					memtype = multiplier;
+				switch (multiplier) {
+				case 'B':
+					break;
+				case 'K':
+					unit = 1024;
+					break;
+				case 'M':
+					unit = 1024 * 1024;
 					break;
+				case 'a':
+				case 'b':
+				case 'c':
+				case 'd':
+				case 'e':
+				case 'f':
+				case 'g':
+					if (!memtype) {
+						ctxi->logf(LogLevel::Warn, "Non-valid multiplier '%c', "
+							"interpreted as type "
+							"identifier instead",
+							multiplier);
+						memtype = multiplier;
+						break;
+					}
+					/* fallthrough */
+				default:
+					ctxi->logf(LogLevel::Warn, "Non-valid multiplier '%c', "
+						"assuming bytes", multiplier);
 				}
-				/* fallthrough if memtype was already set */
-			default:
-				ctxi->logf(LogLevel::Warn, "Non-valid multiplier '%c', "
-					"assuming bytes", multiplier);
-			}
 
-			if (!memtype) {
-				ctxi->logf(LogLevel::Warn, "No valid type for segment %d\n", count);
-				continue;
+				if (!memtype) {
+					ctxi->logf(LogLevel::Warn, "No valid type for segment %d\n", count);
+					valid = false;
+				}
+			} else if (multiplier == 'K') {
+				unit = 1024;
+			} else if (multiplier == 'M') {
+				unit = 1024 * 1024;
 			}
+			size *= unit;
 
-			segment.firstAddr = address;
-			segment.lastAddr = address + sectors * size - 1;
-			segment.pagesize = size;
-			segment.memtype = memtype & 7;
-			segments.push_back(segment);
+			if (valid) {
+				MemSegment segment;
+				segment.firstAddr = address;
+				segment.lastAddr = address + sectors * size - 1;
+				segment.pagesize = size;
+				segment.memtype = memtype & 7;
+				segments.push_back(segment);
 
-			ctxi->logf(LogLevel::Verbose, "Memory segment at 0x%08x %3d x %4d = "
-				       "%5d (%s%s%s)\n",
-				       address, sectors, size, sectors * size,
-				       segment.isReadable()  ? "r" : "",
-				       segment.isEraseable()  ? "e" : "",
-				       segment.isWriteable() ? "w" : "");
+				ctxi->logf(LogLevel::Verbose, "Memory segment at 0x%08x %3u x %4u = "
+					       "%5u (%s%s%s)\n",
+					       address, sectors, size, sectors * size,
+					       segment.isReadable()  ? "r" : "",
+					       segment.isEraseable()  ? "e" : "",
+					       segment.isWriteable() ? "w" : "");
+			}
 
 			address += sectors * size;
 
-			separator = *intf_desc;
-			if (separator == ',')
-				intf_desc += 1;
+			if (p < end && *p == ',')
+				p++;
 			else
 				break;
-		}	/* while per segment */
+		}	/* for per segment */
+	}	/* while per address */
 
-	}		/* while per address */
-	free(name);
-	free(typestring);
+	if (normalize())
+		ctxi->log(LogLevel::Warn, "Ignoring memory segments which overlap earlier ones");
+	ctxi->logf(LogLevel::Verbose, "%u memory segments after merging", static_cast<unsigned int>(segments.size()));
 	return true;
 }
 
+std::shared_ptr<const MemLayout> MemLayout::getCached(ContextImpl *ctxi, const std::string &intf_descStr)
+{
+	static std::mutex mtx;
+	static std::map<std::string, std::shared_ptr<const MemLayout>> cache;
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		auto it = cache.find(intf_descStr);
+		if (it != cache.end()) {
+			ctxi->log(LogLevel::Verbose, "Using cached memory layout for \"" + intf_descStr + "\"");
+			return it->second;
+		}
+	}
+
+	auto layout = std::make_shared<MemLayout>();
+	if (!layout->parseDesc(ctxi, intf_descStr))
+		return nullptr;
+	std::lock_guard<std::mutex> lk(mtx);
+	/* Devices only have a few different descriptors, so this only happens if they keep changing */
+	if (cache.size() >= LAYOUT_CACHE_MAX_ENTRIES)
+		cache.clear();
+	cache[intf_descStr] = layout;
+	return layout;
+}
+
+size_t MemLayout::normalize()
+{
+	std::stable_sort(segments.begin(), segments.end(), [](const MemSegment &a, const MemSegment &b) {
+		return a.firstAddr < b.firstAddr;
+	});
+	size_t dropped = 0;
+	size_t count = 0;
+	for (const MemSegment &seg : segments)
+	{
+		if (count)
+		{
+			MemSegment &prev = segments[count-1];
+			if (seg.firstAddr <= prev.lastAddr)
+			{
+				dropped++;
+				continue;
+			}
+			if (prev.lastAddr + 1 == seg.firstAddr && prev.pagesize == seg.pagesize && prev.memtype == seg.memtype)
+			{
+				prev.lastAddr = seg.lastAddr;
+				continue;
+			}
+		}
+		segments[count++] = seg;
+	}
+	segments.resize(count);
+	return dropped;
+}
+
 MemSegment *MemLayout::findSegment(uint32_t address)
 {
-	for (MemSegment &seg : segments)
+	return const_cast<MemSegment*>(static_cast<const MemLayout*>(this)->findSegment(address));
+}
+
+const MemSegment *MemLayout::findSegment(uint32_t address) const
+{
+	size_t i = segmentIndexFrom(address);
+	if (i == segments.size() || segments[i].firstAddr > address)
+		return nullptr;
+	return &segments[i];
+}
+
+size_t MemLayout::segmentIndexFrom(uint32_t address) const
+{
+	// Segments do not overlap, so they are sorted by end address as well
+	auto it = std::lower_bound(segments.begin(), segments.end(), address, [](const MemSegment &seg, uint32_t addr) {
+		return seg.lastAddr < addr;
+	});
+	return it - segments.begin();
+}
+
+bool MemLayout::pageInfo(uint32_t address, MemPage *page) const
+{
+	size_t i = segmentIndexFrom(address);
+	if (i == segments.size() || segments[i].firstAddr > address)
+		return false;
+	const MemSegment &seg = segments[i];
+	page->segment = i;
+	page->memtype = seg.memtype;
+	if (seg.pagesize)
+	{
+		page->index = (address - seg.firstAddr) / seg.pagesize;
+		page->base = seg.firstAddr + page->index * seg.pagesize;
+		page->size = seg.pagesize;
+	}
+	else
 	{
-		if (seg.firstAddr<=address && seg.lastAddr>=address)
-			return &seg;
+		page->index = 0;
+		page->base = seg.firstAddr;
+		page->size = seg.lastAddr - seg.firstAddr + 1;
 	}
-	return nullptr;
+	return true;
 }
 
 bool MemLayout::isAddressReadable(uint32_t address)
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <cstdint>
+#include <memory>
 #include <string>
 
 namespace FwUpd
@@ -43,13 +44,52 @@ public:
 	}
 };
 
+// Page containing an address
+class MemPage
+{
+public:
+	uint32_t base;
+	uint32_t size;
+	uint8_t memtype;
+	// Index of the segment in MemLayout::segments, and of the page within the segment
+	size_t segment;
+	uint32_t index;
+
+	bool isReadable() const
+	{
+		return (memtype & MemSegment::Flag_Readable);
+	}
+	bool isEraseable() const
+	{
+		return (memtype & MemSegment::Flag_Eraseable);
+	}
+	bool isWriteable() const
+	{
+		return (memtype & MemSegment::Flag_Writeable);
+	}
+};
+
 class MemLayout
 {
 public:
+	// Sorted by address, see normalize()
 	std::vector<MemSegment> segments;
 	void clear();
+	// Parses a DfuSe interface descriptor string. Returns false if it does not start with a name.
 	bool parseDesc(ContextImpl *ctxi, const std::string &intf_descStr);
+	// Parsed layout for a descriptor string from a process-wide cache, so that each descriptor is only parsed once no
+	// matter how many devices use it. Thread-safe. Returns null (and caches nothing) if parseDesc() fails.
+	static std::shared_ptr<const MemLayout> getCached(ContextImpl *ctxi, const std::string &intf_descStr);
+	// Sorts segments by address and merges adjacent segments with the same page size and type. Segments which overlap an
+	// earlier one are dropped. Must be called after changing segments directly. Returns the number of segments dropped.
+	size_t normalize();
+
 	MemSegment *findSegment(uint32_t address);
+	const MemSegment *findSegment(uint32_t address) const;
+	// Index of the first segment which ends at or after address, segments.size() if there is none
+	size_t segmentIndexFrom(uint32_t address) const;
+	// Returns false if address is not in any segment
+	bool pageInfo(uint32_t address, MemPage *page) const;
 
 	bool isAddressReadable(uint32_t address);
 	bool isAddressEraseable(uint32_t address);
@@ -0,0 +1,145 @@
+#include "Check.hpp"
+
+#include "CRC32.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace FwUpd;
+
+namespace
+{
+
+// Fixed seed, so that a failure can be reproduced
+std::mt19937 rng(12345);
+
+uint32_t randomU32()
+{
+	return std::uniform_int_distribution<uint32_t>()(rng);
+}
+
+size_t randomSize(size_t max)
+{
+	return std::uniform_int_distribution<size_t>(0, max)(rng);
+}
+
+std::vector<uint8_t> randomData(size_t n)
+{
+	std::vector<uint8_t> data(n);
+	for (uint8_t &x : data)
+		x = static_cast<uint8_t>(randomU32());
+	return data;
+}
+
+uint32_t reference(const uint8_t *x, size_t n, uint32_t val = 0xffffffff)
+{
+	CRC32 crc(val);
+	crc.update_u8(x, n, CRC32::Engine::Bytewise);
+	return crc;
+}
+
+uint32_t withEngine(CRC32::Engine engine, const uint8_t *x, size_t n, uint32_t val = 0xffffffff)
+{
+	CRC32 crc(val);
+	crc.update_u8(x, n, engine);
+	return crc;
+}
+
+void testKnownValue()
+{
+	const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+	// The standard CRC-32 check value, which includes a final inversion that CRC32 leaves to the caller
+	CHECK_EQ(~reference(check, sizeof(check)), 0xcbf43926);
+	CRC32 byByte;
+	for (uint8_t x : check)
+		byByte.update_u8(x);
+	CHECK_EQ(byByte.val, reference(check, sizeof(check)));
+}
+
+void testEngine(CRC32::Engine engine)
+{
+	std::printf("Testing %s\n", CRC32::engineName(engine));
+	// Room for every alignment of the longest buffer
+	std::vector<uint8_t> data = randomData(65536 + 64);
+
+	// Every short length (including those below a single 16 byte block and odd tails) at every alignment
+	for (size_t offset = 0; offset < 16; offset++)
+	{
+		for (size_t n = 0; n <= 300; n++)
+		{
+			uint32_t val = randomU32();
+			CHECK_EQ(withEngine(engine, data.data() + offset, n, val), reference(data.data() + offset, n, val));
+		}
+	}
+
+	// Random lengths, alignments and starting values
+	for (int i = 0; i < 500; i++)
+	{
+		size_t offset = randomSize(63);
+		size_t n = randomSize(i < 250 ? 4096 : 65536);
+		uint32_t val = randomU32();
+		CHECK_EQ(withEngine(engine, data.data() + offset, n, val), reference(data.data() + offset, n, val));
+	}
+
+	// Updating piece by piece gives the same result as a single update
+	for (int i = 0; i < 50; i++)
+	{
+		size_t n = randomSize(20000);
+		CRC32 crc;
+		for (size_t pos = 0; pos < n;)
+		{
+			size_t count = std::min(n - pos, randomSize(100));
+			crc.update_u8(data.data() + pos, count, engine);
+			pos += count;
+		}
+		CHECK_EQ(crc.val, reference(data.data(), n));
+	}
+}
+
+void testCombine()
+{
+	std::vector<uint8_t> data = randomData(70000);
+	for (int i = 0; i < 300; i++)
+	{
+		// Mostly short blocks, which are where off-by-one errors in the length would show
+		size_t n = randomSize(i < 200 ? 64 : data.size());
+		size_t split = randomSize(n);
+		uint32_t val = randomU32();
+		uint32_t crcA = reference(data.data(), split, val);
+		uint32_t crcB = reference(data.data() + split, n - split);
+		CHECK_EQ(CRC32::combine(crcA, crcB, n - split), reference(data.data(), n, val));
+	}
+	// An empty second block leaves the CRC unchanged
+	CHECK_EQ(CRC32::combine(0x12345678, 0xffffffff, 0), 0x12345678);
+}
+
+void testParallel()
+{
+	// Large enough to be split into blocks, with an odd length so the last block is a different size
+	std::vector<uint8_t> data = randomData((9 << 20) + 13);
+	ThreadPool pool(3);
+	CRC32 crc(0x89abcdef);
+	crc.update_u8_parallel(data.data(), data.size(), pool);
+	CHECK_EQ(crc.val, reference(data.data(), data.size(), 0x89abcdef));
+}
+
+}
+
+int main()
+{
+	testKnownValue();
+	const CRC32::Engine engines[] = {CRC32::Engine::Slicing, CRC32::Engine::PCLMUL, CRC32::Engine::ARMv8};
+	for (CRC32::Engine engine : engines)
+	{
+		if (CRC32::isSupported(engine))
+			testEngine(engine);
+		else
+			std::printf("%s is not supported on this CPU\n", CRC32::engineName(engine));
+	}
+	testCombine();
+	testParallel();
+	return Test::result();
+}
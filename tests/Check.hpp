@@ -0,0 +1,57 @@
+#ifndef fwupd_tests_Check_h
+#define fwupd_tests_Check_h
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+
+/*
+ * Minimal checks for the test programs, which have no dependencies beyond the library.
+ * A failed check is printed and counted, and the test continues. main() returns Test::result() so ctest sees failures.
+ */
+namespace FwUpd
+{
+namespace Test
+{
+
+inline int &failures()
+{
+	static int count = 0;
+	return count;
+}
+
+inline bool check(bool ok, const char *expr, const char *file, int line)
+{
+	if (!ok)
+	{
+		std::printf("%s:%d: check failed: %s\n", file, line, expr);
+		failures()++;
+	}
+	return ok;
+}
+
+inline bool checkEqual(uint64_t actual, uint64_t expected, const char *expr, const char *file, int line)
+{
+	if (actual != expected)
+	{
+		std::printf("%s:%d: check failed: %s is 0x%" PRIx64 ", expected 0x%" PRIx64 "\n", file, line, expr, actual,
+			expected);
+		failures()++;
+	}
+	return actual == expected;
+}
+
+inline int result()
+{
+	if (failures())
+		std::printf("%d checks failed\n", failures());
+	return failures() ? 1 : 0;
+}
+
+}
+}
+
+#define CHECK(expr) FwUpd::Test::check((expr), #expr, __FILE__, __LINE__)
+#define CHECK_EQ(actual, expected) FwUpd::Test::checkEqual((actual), (expected), #actual, __FILE__, __LINE__)
+
+#endif
@@ -0,0 +1,334 @@
+#include "Check.hpp"
+
+#include "libFirmwareUpdate++/Context.hpp"
+#include "dfuse/FlashPlan.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+using namespace FwUpd;
+using namespace FwUpd::Dfuse;
+
+namespace
+{
+
+const uint32_t flashBase = 0x08000000;
+
+// Builds an image element by element, and plans it for an STM32F4 style layout (4x16K, 64K, 7x128K pages)
+class Fixture
+{
+public:
+	std::shared_ptr<Context> ctx = std::make_shared<Context>();
+	MemLayout layout;
+	Image image;
+	DfuseOptions opts;
+	std::vector<uint8_t> data;
+	EraseCostModel eraseCost;
+	bool blockAddressing = true;
+
+	Fixture()
+	{
+		CHECK(layout.parseDesc(ctx->pImpl, "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg"));
+		image.targets.resize(1);
+		image.targets[0].alternateSetting = 0;
+	}
+
+	// Appends an element filled with fill, returning its data so that parts of it can be changed
+	uint8_t *addElement(uint32_t address, uint32_t size, uint8_t fill = 0x55)
+	{
+		ImageElement e;
+		e.address = address;
+		e.size = size;
+		e.offset = data.size();
+		image.targets[0].elements.push_back(e);
+		data.resize(data.size() + size, fill);
+		return data.data() + e.offset;
+	}
+
+	FlashPlan compile(uint32_t transferSize)
+	{
+		FlashPlanner planner(image, layout, opts);
+		planner.transferSize = transferSize;
+		planner.blockAddressing = blockAddressing;
+		planner.data = data.data();
+		planner.eraseCost = eraseCost;
+		return planner.compile(ctx->pImpl);
+	}
+};
+
+std::vector<FlashOp> opsOfType(const FlashPlan &plan, FlashOp::Type type)
+{
+	std::vector<FlashOp> result;
+	for (const FlashOp &op : plan.ops)
+	{
+		if (op.type == type)
+			result.push_back(op);
+	}
+	return result;
+}
+
+// Index of the first op of type, or ops.size() if there is none
+size_t firstOf(const FlashPlan &plan, FlashOp::Type type)
+{
+	size_t i = 0;
+	while (i < plan.ops.size() && plan.ops[i].type != type)
+		i++;
+	return i;
+}
+
+void testEraseSetOutOfOrderAndOverlapping()
+{
+	Fixture f;
+	// Second 16K page and first part of the third, then the first page, then overlapping the second page again
+	f.addElement(flashBase + 0x4000, 0x5000);
+	f.addElement(flashBase, 0x100);
+	f.addElement(flashBase + 0x6000, 0x100);
+	FlashPlan plan = f.compile(2048);
+
+	std::vector<FlashOp> erases = opsOfType(plan, FlashOp::Type::ErasePage);
+	if (CHECK_EQ(erases.size(), 3))
+	{
+		// Each page once, in address order
+		CHECK_EQ(erases[0].address, flashBase);
+		CHECK_EQ(erases[1].address, flashBase + 0x4000);
+		CHECK_EQ(erases[2].address, flashBase + 0x8000);
+	}
+	// All erases come before the first write
+	CHECK(firstOf(plan, FlashOp::Type::Write) > 2);
+	CHECK_EQ(opsOfType(plan, FlashOp::Type::MassErase).size(), 0);
+
+	// Writes stay in file order, so the data is read sequentially
+	std::vector<FlashOp> writes = opsOfType(plan, FlashOp::Type::Write);
+	if (CHECK_EQ(writes.size(), 12))
+	{
+		CHECK_EQ(writes[0].address, flashBase + 0x4000);
+		CHECK_EQ(writes[0].offset, 0);
+		CHECK_EQ(writes[9].address, flashBase + 0x8800);
+		CHECK_EQ(writes[9].size, 0x800);
+		CHECK_EQ(writes[10].address, flashBase);
+		CHECK_EQ(writes[10].size, 0x100);
+		CHECK_EQ(writes[10].offset, 0x5000);
+		CHECK_EQ(writes[11].address, flashBase + 0x6000);
+		CHECK_EQ(writes[11].offset, 0x5100);
+	}
+	CHECK_EQ(plan.bytesWritten(), 0x5200);
+}
+
+void testElementOutsideLayout()
+{
+	Fixture f;
+	// The error is expected, so it is not logged
+	f.ctx->setLogHandler([](const LogMsg &) {});
+	f.addElement(flashBase + 0x100000 - 0x100, 0x200);
+	bool threw = false;
+	try {
+		f.compile(2048);
+	} catch (std::exception &) {
+		threw = true;
+	}
+	CHECK(threw);
+}
+
+void testTrimBlankTail()
+{
+	Fixture f;
+	f.opts.trimBlankTail = true;
+	// Data, blank, data, then a blank tail which runs into the next 16K page
+	uint8_t *e = f.addElement(flashBase + 0x3000, 0x2000);
+	std::fill(e + 0x400, e + 0x800, 0xff);
+	std::fill(e + 0xc00, e + 0x2000, 0xff);
+	FlashPlan plan = f.compile(0x400);
+
+	// The blank chunk followed by data is still written
+	std::vector<FlashOp> writes = opsOfType(plan, FlashOp::Type::Write);
+	if (CHECK_EQ(writes.size(), 3))
+	{
+		CHECK_EQ(writes[1].address, flashBase + 0x3400);
+		CHECK_EQ(writes[2].address, flashBase + 0x3800);
+	}
+	CHECK_EQ(plan.blankBytesTrimmed, 0x1400);
+	CHECK_EQ(plan.blankBytesSkipped, 0);
+	// The page holding only trimmed chunks is not erased
+	std::vector<FlashOp> erases = opsOfType(plan, FlashOp::Type::ErasePage);
+	if (CHECK_EQ(erases.size(), 1))
+		CHECK_EQ(erases[0].address, flashBase);
+
+	// An element which is entirely blank is left out completely
+	Fixture blank;
+	blank.opts.trimBlankTail = true;
+	blank.addElement(flashBase, 0x1000, 0xff);
+	plan = blank.compile(0x400);
+	CHECK_EQ(plan.ops.size(), 0);
+	CHECK_EQ(plan.blankBytesTrimmed, 0x1000);
+}
+
+void testSkipBlankChunks()
+{
+	Fixture f;
+	f.opts.skipBlankChunks = true;
+	uint8_t *e = f.addElement(flashBase + 0x3000, 0x2000);
+	std::fill(e + 0x400, e + 0x800, 0xff);
+	std::fill(e + 0xc00, e + 0x2000, 0xff);
+	FlashPlan plan = f.compile(0x400);
+
+	std::vector<FlashOp> writes = opsOfType(plan, FlashOp::Type::Write);
+	if (CHECK_EQ(writes.size(), 2))
+	{
+		CHECK_EQ(writes[0].address, flashBase + 0x3000);
+		CHECK_EQ(writes[1].address, flashBase + 0x3800);
+		CHECK_EQ(writes[1].offset, 0x800);
+	}
+	CHECK_EQ(plan.blankBytesSkipped, 0x1800);
+	CHECK_EQ(plan.blankBytesTrimmed, 0);
+	// Pages covered by skipped chunks are still erased, so they read back as 0xff
+	CHECK_EQ(opsOfType(plan, FlashOp::Type::ErasePage).size(), 2);
+
+	// Without data, nothing is known to be blank
+	FlashPlanner planner(f.image, f.layout, f.opts);
+	planner.transferSize = 0x400;
+	plan = planner.compile(f.ctx->pImpl);
+	CHECK_EQ(opsOfType(plan, FlashOp::Type::Write).size(), 8);
+	CHECK_EQ(plan.blankBytesSkipped, 0);
+}
+
+void testBlockNumbering()
+{
+	Fixture f;
+	// Contiguous, then a gap of a whole number of blocks, then a gap which is not, then going backwards
+	f.addElement(flashBase, 0x1800);
+	f.addElement(flashBase + 0x2000, 0x400);
+	f.addElement(flashBase + 0x2c00, 0x400);
+	f.addElement(flashBase + 0x1800, 0x400);
+	FlashPlan plan = f.compile(0x800);
+
+	std::vector<FlashOp> ops;
+	for (const FlashOp &op : plan.ops)
+	{
+		if (op.type == FlashOp::Type::SetAddress || op.type == FlashOp::Type::Write)
+			ops.push_back(op);
+	}
+	if (CHECK_EQ(ops.size(), 9))
+	{
+		CHECK(ops[0].type == FlashOp::Type::SetAddress);
+		CHECK_EQ(ops[0].address, flashBase);
+		CHECK_EQ(ops[1].block, 2);
+		CHECK_EQ(ops[2].block, 3);
+		CHECK_EQ(ops[3].block, 4);
+		// The gap is skipped by counting blocks
+		CHECK(ops[4].type == FlashOp::Type::Write);
+		CHECK_EQ(ops[4].address, flashBase + 0x2000);
+		CHECK_EQ(ops[4].block, 6);
+		// Not on a block boundary relative to the address pointer
+		CHECK(ops[5].type == FlashOp::Type::SetAddress);
+		CHECK_EQ(ops[5].address, flashBase + 0x2c00);
+		CHECK_EQ(ops[6].block, 2);
+		// Block numbers cannot go backwards
+		CHECK(ops[7].type == FlashOp::Type::SetAddress);
+		CHECK_EQ(ops[7].address, flashBase + 0x1800);
+		CHECK_EQ(ops[8].block, 2);
+	}
+
+	// Without block addressing, every write sets the address
+	f.blockAddressing = false;
+	plan = f.compile(0x800);
+	CHECK_EQ(plan.count(FlashOp::Type::SetAddress), plan.count(FlashOp::Type::Write));
+	for (const FlashOp &op : opsOfType(plan, FlashOp::Type::Write))
+		CHECK_EQ(op.block, 2);
+}
+
+void testBlockNumberLimit()
+{
+	const uint32_t transferSize = 16;
+	Fixture f;
+	f.addElement(flashBase, transferSize);
+	// Block 0xffff is the last one that can be reached from the address pointer
+	f.addElement(flashBase + transferSize * 0xfffd, transferSize);
+	f.addElement(flashBase + transferSize * 0xfffe, transferSize);
+	FlashPlan plan = f.compile(transferSize);
+
+	CHECK_EQ(plan.count(FlashOp::Type::SetAddress), 2);
+	std::vector<FlashOp> writes = opsOfType(plan, FlashOp::Type::Write);
+	if (CHECK_EQ(writes.size(), 3))
+	{
+		CHECK_EQ(writes[0].block, 2);
+		CHECK_EQ(writes[1].block, 0xffff);
+		CHECK_EQ(writes[2].block, 2);
+	}
+	size_t i = plan.ops.size() - 2;
+	CHECK(plan.ops[i].type == FlashOp::Type::SetAddress);
+	CHECK_EQ(plan.ops[i].address, flashBase + transferSize * 0xfffe);
+}
+
+void testAutoMassErase()
+{
+	// A few small pages are faster to erase one by one
+	Fixture few;
+	few.opts.autoMassErase = true;
+	few.addElement(flashBase, 0x100);
+	FlashPlan plan = few.compile(2048);
+	CHECK_EQ(plan.count(FlashOp::Type::MassErase), 0);
+	CHECK_EQ(plan.count(FlashOp::Type::ErasePage), 1);
+
+	// Most of the flash is faster to mass erase
+	Fixture most;
+	most.opts.autoMassErase = true;
+	most.addElement(flashBase + 0x20000, 0xe0000);
+	plan = most.compile(2048);
+	CHECK_EQ(plan.count(FlashOp::Type::MassErase), 1);
+	CHECK_EQ(plan.count(FlashOp::Type::ErasePage), 0);
+	CHECK(plan.ops[0].type == FlashOp::Type::MassErase);
+
+	// Learned times take precedence over the estimates
+	most.eraseCost.learnedPageMs = 10;
+	most.eraseCost.learnedMassMs = 20000;
+	plan = most.compile(2048);
+	CHECK_EQ(plan.count(FlashOp::Type::MassErase), 0);
+	CHECK_EQ(plan.count(FlashOp::Type::ErasePage), 7);
+
+	// Nothing to erase, so no mass erase either
+	Fixture blank;
+	blank.opts.autoMassErase = true;
+	blank.opts.trimBlankTail = true;
+	blank.addElement(flashBase, 0x1000, 0xff);
+	plan = blank.compile(2048);
+	CHECK_EQ(plan.ops.size(), 0);
+
+	// An explicit mass erase replaces the page erases regardless of cost
+	Fixture forced;
+	forced.opts.massErase = true;
+	forced.addElement(flashBase, 0x100);
+	plan = forced.compile(2048);
+	CHECK_EQ(plan.count(FlashOp::Type::MassErase), 1);
+	CHECK_EQ(plan.count(FlashOp::Type::ErasePage), 0);
+}
+
+void testLeave()
+{
+	Fixture f;
+	f.opts.leave = true;
+	f.addElement(flashBase + 0x4000, 0x100);
+	f.addElement(flashBase, 0x100);
+	FlashPlan plan = f.compile(2048);
+	// Leaves after all writes, starting the firmware at the first element in the file
+	if (CHECK(!plan.ops.empty()))
+	{
+		CHECK(plan.ops.back().type == FlashOp::Type::Leave);
+		CHECK_EQ(plan.ops.back().address, flashBase + 0x4000);
+	}
+}
+
+}
+
+int main()
+{
+	testEraseSetOutOfOrderAndOverlapping();
+	testElementOutsideLayout();
+	testTrimBlankTail();
+	testSkipBlankChunks();
+	testBlockNumbering();
+	testBlockNumberLimit();
+	testAutoMassErase();
+	testLeave();
+	return Test::result();
+}
@@ -0,0 +1,226 @@
+#include "Check.hpp"
+
+#include "PollScheduler.hpp"
+#include "UsbEventThread.hpp"
+
+#include <libusb.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <vector>
+
+using namespace FwUpd;
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Event thread whose transfers are completed by the test, which plays the device
+class FakeDeviceThread : public UsbEventThread
+{
+protected:
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<libusb_transfer*> submitted;
+
+	int submitTransfer(libusb_transfer *transfer) override
+	{
+		if (submitResult < 0)
+			return submitResult;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			submitted.push_back(transfer);
+		}
+		cv.notify_one();
+		return 0;
+	}
+
+public:
+	// Returned by the next submissions instead of accepting the transfer, if negative
+	int submitResult = 0;
+
+	libusb_transfer *take()
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		cv.wait(lk, [&]() { return !submitted.empty(); });
+		libusb_transfer *transfer = submitted.front();
+		submitted.pop_front();
+		return transfer;
+	}
+
+	size_t pendingCount() const
+	{
+		return pending;
+	}
+
+	// Completes a transfer as libusb would, by calling its callback
+	static void complete(libusb_transfer *transfer, libusb_transfer_status status, int length,
+		const uint8_t *inData = nullptr)
+	{
+		transfer->status = status;
+		transfer->actual_length = length;
+		if (inData)
+			std::memcpy(libusb_control_transfer_get_data(transfer), inData, length);
+		transfer->callback(transfer);
+	}
+
+	using UsbEventThread::UsbEventThread;
+};
+
+uint16_t setupWord(const libusb_transfer *transfer, int offset)
+{
+	return static_cast<uint16_t>(transfer->buffer[offset] | (transfer->buffer[offset + 1] << 8));
+}
+
+void testOut(FakeDeviceThread &events)
+{
+	uint8_t data[4] = {1, 2, 3, 4};
+	std::promise<int> result;
+	int ret = events.submitControl(nullptr, 0x21, 1, 5, 2, data, sizeof(data), 1000,
+		[&](int x) { result.set_value(x); });
+	CHECK_EQ(ret, 0);
+	// OUT data is copied when the transfer is submitted
+	std::memset(data, 0, sizeof(data));
+
+	libusb_transfer *transfer = events.take();
+	CHECK_EQ(transfer->buffer[0], 0x21);
+	CHECK_EQ(transfer->buffer[1], 1);
+	CHECK_EQ(setupWord(transfer, 2), 5);
+	CHECK_EQ(setupWord(transfer, 4), 2);
+	CHECK_EQ(setupWord(transfer, 6), 4);
+	const uint8_t expected[4] = {1, 2, 3, 4};
+	CHECK(!std::memcmp(libusb_control_transfer_get_data(transfer), expected, sizeof(expected)));
+	FakeDeviceThread::complete(transfer, LIBUSB_TRANSFER_COMPLETED, 4);
+	CHECK_EQ(result.get_future().get(), 4);
+	CHECK_EQ(events.pendingCount(), 0);
+}
+
+void testIn(FakeDeviceThread &events)
+{
+	uint8_t status[6] = {};
+	std::promise<int> result;
+	CHECK_EQ(events.submitControl(nullptr, 0xa1, 3, 0, 0, status, sizeof(status), 1000,
+		[&](int x) { result.set_value(x); }), 0);
+	const uint8_t reply[6] = {0, 10, 0, 0, 4, 0};
+	FakeDeviceThread::complete(events.take(), LIBUSB_TRANSFER_COMPLETED, 6, reply);
+	CHECK_EQ(result.get_future().get(), 6);
+	CHECK(!std::memcmp(status, reply, sizeof(reply)));
+}
+
+void testErrors(FakeDeviceThread &events)
+{
+	const std::pair<libusb_transfer_status, int> cases[] = {
+		{LIBUSB_TRANSFER_STALL, LIBUSB_ERROR_PIPE},
+		{LIBUSB_TRANSFER_TIMED_OUT, LIBUSB_ERROR_TIMEOUT},
+		{LIBUSB_TRANSFER_NO_DEVICE, LIBUSB_ERROR_NO_DEVICE},
+		{LIBUSB_TRANSFER_ERROR, LIBUSB_ERROR_IO},
+	};
+	for (const auto &c : cases)
+	{
+		std::promise<int> result;
+		events.submitControl(nullptr, 0x21, 1, 0, 0, nullptr, 0, 1000, [&](int x) { result.set_value(x); });
+		FakeDeviceThread::complete(events.take(), c.first, 0);
+		CHECK_EQ(result.get_future().get(), c.second);
+	}
+
+	// The callback is not called if the transfer could not be submitted
+	bool called = false;
+	events.submitResult = LIBUSB_ERROR_NO_DEVICE;
+	CHECK_EQ(events.submitControl(nullptr, 0x21, 1, 0, 0, nullptr, 0, 1000, [&](int) { called = true; }),
+		LIBUSB_ERROR_NO_DEVICE);
+	events.submitResult = 0;
+	CHECK(!called);
+	CHECK_EQ(events.pendingCount(), 0);
+
+	// A throwing callback does not affect later transfers
+	events.submitControl(nullptr, 0x21, 1, 0, 0, nullptr, 0, 1000, [](int) { throw std::runtime_error("test"); });
+	FakeDeviceThread::complete(events.take(), LIBUSB_TRANSFER_COMPLETED, 0);
+	CHECK_EQ(events.pendingCount(), 0);
+}
+
+// Polls the status the way the download controllers do: each completion schedules the next request after the poll
+// timeout the device reported, until it is no longer busy
+void testPollChain(FakeDeviceThread &events)
+{
+	PollScheduler scheduler;
+	uint8_t status[6];
+	std::promise<int> polls;
+	int count = 0;
+	std::function<void()> poll = [&]() {
+		events.submitControl(nullptr, 0xa1, 3, 0, 0, status, sizeof(status), 1000, [&](int result) {
+			count++;
+			if (result != 6 || status[4] != 4)
+			{
+				polls.set_value(count);
+				return;
+			}
+			scheduler.scheduleAfter(status[1], poll);
+		});
+	};
+	Clock::time_point start = Clock::now();
+	poll();
+	// Busy (dfuDNBUSY) with a 20ms poll timeout twice, then idle
+	const uint8_t busy[6] = {0, 20, 0, 0, 4, 0};
+	const uint8_t idle[6] = {0, 0, 0, 0, 5, 0};
+	FakeDeviceThread::complete(events.take(), LIBUSB_TRANSFER_COMPLETED, 6, busy);
+	FakeDeviceThread::complete(events.take(), LIBUSB_TRANSFER_COMPLETED, 6, busy);
+	FakeDeviceThread::complete(events.take(), LIBUSB_TRANSFER_COMPLETED, 6, idle);
+	CHECK_EQ(polls.get_future().get(), 3);
+	CHECK(Clock::now() - start >= std::chrono::milliseconds(40));
+}
+
+void testSchedulerOrder()
+{
+	PollScheduler scheduler;
+	std::mutex mtx;
+	std::vector<int> order;
+	std::promise<void> done;
+	Clock::time_point start = Clock::now();
+	auto record = [&](int x) {
+		std::lock_guard<std::mutex> lk(mtx);
+		CHECK(Clock::now() - start >= std::chrono::milliseconds(x));
+		order.push_back(x);
+		if (order.size() == 4)
+			done.set_value();
+	};
+	scheduler.scheduleAfter(30, [&]() { record(30); });
+	scheduler.scheduleAfter(10, [&]() { record(10); });
+	// Tasks can schedule further tasks
+	scheduler.scheduleAfter(20, [&]() { record(20); scheduler.scheduleAfter(20, [&]() { record(40); }); });
+	done.get_future().get();
+	CHECK(order == std::vector<int>({10, 20, 30, 40}));
+
+	// A deadline which has already passed runs straight away
+	std::promise<void> late;
+	scheduler.schedule(Clock::now() - std::chrono::seconds(1), [&]() { late.set_value(); });
+	CHECK(late.get_future().wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+}
+
+}
+
+int main()
+{
+	testSchedulerOrder();
+
+	libusb_context *usbCtx = nullptr;
+	if (libusb_init(&usbCtx))
+	{
+		std::printf("libusb could not be initialised, skipping the event thread tests\n");
+		return Test::result();
+	}
+	{
+		FakeDeviceThread events(usbCtx);
+		testOut(events);
+		testIn(events);
+		testErrors(events);
+		testPollChain(events);
+	}
+	libusb_exit(usbCtx);
+	return Test::result();
+}